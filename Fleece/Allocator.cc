@@ -0,0 +1,74 @@
+//
+// Allocator.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "Allocator.hh"
+#include "PlatformCompat.hh"
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+namespace fleece {
+
+    class MallocAllocator : public Allocator {
+    public:
+        void* allocate(size_t size) override {
+            return ::malloc(size);
+        }
+        void* reallocate(void *ptr, size_t, size_t newSize) override {
+            return ::realloc(ptr, newSize);
+        }
+        void deallocate(void *ptr, size_t) noexcept override {
+            ::free(ptr);
+        }
+    };
+
+    // nullptr means the default; that way this is valid even during static initialization.
+    static std::atomic<Allocator*> sCurrentAllocator {nullptr};
+
+
+    Allocator& Allocator::defaultAllocator() noexcept {
+        // Never destroyed, since blocks may still be freed by other static destructors:
+        static MallocAllocator *sDefaultAllocator = new MallocAllocator;
+        return *sDefaultAllocator;
+    }
+
+    Allocator& Allocator::current() noexcept {
+        Allocator *allocator = sCurrentAllocator.load(std::memory_order_acquire);
+        return allocator ? *allocator : defaultAllocator();
+    }
+
+    void Allocator::setCurrent(Allocator *allocator) noexcept {
+        sCurrentAllocator.store(allocator, std::memory_order_release);
+    }
+
+
+    void* Allocator::allocateOrThrow(size_t size) {
+        void *result = allocate(size);
+        if (_usuallyFalse(!result))
+            throw std::bad_alloc();
+        return result;
+    }
+
+    void* Allocator::reallocateOrThrow(void *ptr, size_t oldSize, size_t newSize) {
+        void *result = reallocate(ptr, oldSize, newSize);
+        if (_usuallyFalse(!result))
+            throw std::bad_alloc();
+        return result;
+    }
+
+}
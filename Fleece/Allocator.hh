@@ -0,0 +1,56 @@
+//
+// Allocator.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include <stddef.h>
+
+
+namespace fleece {
+
+    /** Allocates the memory of alloc_slice buffers (which include Encoder/Writer output
+        chunks), StringTable hash tables and heap-based TempArrays. Install a subclass with
+        setCurrent() to route those to an arena, a NUMA-local heap, huge pages, etc.
+
+        Every call is given the size of the block, so an implementation can keep track of the
+        bytes in use and enforce a budget; allocate/reallocate return nullptr on failure, which
+        Fleece turns into std::bad_alloc. A block is always freed by the allocator that allocated
+        it, so the current allocator can be changed at any time, but each one has to outlive
+        the blocks it allocated. Blocks must be at least 8-byte aligned, like malloc's. */
+    class Allocator {
+    public:
+        virtual ~Allocator() =default;
+
+        virtual void* allocate(size_t size) =0;
+        virtual void* reallocate(void *ptr, size_t oldSize, size_t newSize) =0;
+        virtual void deallocate(void *ptr, size_t size) noexcept =0;
+
+        /** Like allocate and reallocate, but throw std::bad_alloc on failure. */
+        void* allocateOrThrow(size_t size);
+        void* reallocateOrThrow(void *ptr, size_t oldSize, size_t newSize);
+
+        /** The allocator used for new blocks. Initially the malloc-based default. */
+        static Allocator& current() noexcept;
+
+        /** Sets the process-wide allocator; nullptr restores the default. */
+        static void setCurrent(Allocator*) noexcept;
+
+        /** The default allocator, which calls malloc, realloc and free. */
+        static Allocator& defaultAllocator() noexcept;
+    };
+
+}
@@ -20,6 +20,7 @@
 #include "Internal.hh"
 #include "PlatformCompat.hh"
 #include "varint.hh"
+#include <algorithm>
 
 
 namespace fleece {
@@ -71,10 +72,17 @@ namespace fleece {
 
 
     uint32_t Array::count() const noexcept {
+        if (_usuallyFalse(tag() == kSpecialTag)) {
+            // Segmented array: the total count follows the pointer to the index
+            uint32_t count;
+            return GetUVarInt32(slice(&_byte[2 + kWide], kMaxVarintLen32), &count) ? count : 0;
+        }
         return impl(this)._count;
     }
 
     const Value* Array::get(uint32_t index) const noexcept {
+        if (_usuallyFalse(tag() == kSpecialTag))
+            return iterator(this)[index];
         return impl(this)[index];
     }
 
@@ -84,20 +92,62 @@ namespace fleece {
 
 
     Array::iterator::iterator(const Array *a) noexcept
-    :impl(a),
-     _value(firstValue())
-    { }
+    :impl(a && _usuallyFalse(a->tag() == kSpecialTag) ? nullptr : a)
+    {
+        if (a) {
+            if (auto index = a->segmentIndex()) {
+                impl segments(index);
+                _nextSegment = segments._first;
+                _segmentsLeft = segments._count;
+                _indexWide = segments._wide;
+                _laterCount = a->count();
+                nextSegment();
+            }
+        }
+        _value = firstValue();
+    }
+
+    // Makes the next non-empty segment of a segmented array current, if there is one.
+    void Array::iterator::nextSegment() noexcept {
+        while (_count == 0 && _segmentsLeft > 0) {
+            (impl&)*this = impl(Value::deref(_nextSegment, _indexWide));
+            _nextSegment = _nextSegment->next(_indexWide);
+            --_segmentsLeft;
+            _laterCount -= std::min(_count, _laterCount);
+        }
+    }
+
+    // Random access to an item past the current segment.
+    const Value* Array::iterator::laterValue(unsigned i) const noexcept {
+        i -= _count;
+        auto segment = _nextSegment;
+        for (auto n = _segmentsLeft; n > 0; --n) {
+            impl items(Value::deref(segment, _indexWide));
+            if (i < items._count)
+                return items[i];
+            i -= items._count;
+            segment = segment->next(_indexWide);
+        }
+        return nullptr;
+    }
 
     Array::iterator& Array::iterator::operator++() {
         throwIf(_count == 0, OutOfRange, "iterating past end of array");
         if (_usuallyTrue(--_count > 0))
             _first = _first->next(_wide);
+        else if (_usuallyFalse(_segmentsLeft > 0))
+            nextSegment();
         _value = firstValue();
         return *this;
     }
 
     Array::iterator& Array::iterator::operator += (uint32_t n) {
-        throwIf(n > _count, OutOfRange, "iterating past end of array");
+        throwIf(n > count(), OutOfRange, "iterating past end of array");
+        while (_usuallyFalse(n >= _count && _segmentsLeft > 0)) {
+            n -= _count;
+            _count = 0;
+            nextSegment();
+        }
         _count -= n;
         if (_usuallyTrue(_count > 0))
             _first = offsetby(_first, width(_wide)*n);
@@ -105,4 +155,47 @@ namespace fleece {
         return *this;
     }
 
+
+
+    Array::compactIterator::compactIterator(const Array *a) noexcept
+    :_segmented(a && _usuallyFalse(a->tag() == kSpecialTag))
+    {
+        if (_usuallyFalse(_segmented)) {
+            _first = a;
+            _count = a->count();
+            _wide = false;
+            _value = a->get(0);
+        } else {
+            impl items(a);
+            _first = items._first;
+            _count = items._count;
+            _wide = items._wide;
+            _value = items.firstValue();
+        }
+    }
+
+    const Value* Array::compactIterator::operator[] (unsigned i) const noexcept {
+        if (_usuallyFalse(i >= _count))
+            return nullptr;
+        if (_usuallyFalse(_segmented)) {
+            auto array = (const Array*)_first;
+            return array->get(array->count() - _count + i);
+        }
+        return Value::deref(offsetby(_first, width(_wide) * i), _wide);
+    }
+
+    Array::compactIterator& Array::compactIterator::operator++() {
+        throwIf(_count == 0, OutOfRange, "iterating past end of array");
+        --_count;
+        if (_usuallyFalse(_segmented)) {
+            _value = (*this)[0];
+        } else if (_usuallyTrue(_count > 0)) {
+            _first = _first->next(_wide);
+            _value = Value::deref(_first, _wide);
+        } else {
+            _value = nullptr;
+        }
+        return *this;
+    }
+
 }
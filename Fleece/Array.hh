@@ -24,7 +24,8 @@ namespace fleece {
 
     class Dict;
 
-    /** A Value that's an array. */
+    /** A Value that's an array. (It may be a segmented array, whose items are stored in several
+        ordinary arrays; this is invisible to readers, except that get() is slower.) */
     class Array : public Value {
         struct impl {
             const Value* _first;
@@ -60,7 +61,7 @@ namespace fleece {
             iterator(const Array* a) noexcept;
 
             /** Returns the number of _remaining_ items. */
-            uint32_t count() const noexcept                  {return _count;}
+            uint32_t count() const noexcept                  {return _count + _laterCount;}
 
             const Value* value() const noexcept              {return _value;}
             explicit operator const Value* const () noexcept {return _value;}
@@ -71,7 +72,9 @@ namespace fleece {
 
             /** Random access to items. Index is relative to the current item.
                 This is very fast, faster than array::get(). */
-            const Value* operator[] (unsigned i) const noexcept    {return ((impl&)*this)[i];}
+            const Value* operator[] (unsigned i) const noexcept {
+                return (i < _count) ? ((impl&)*this)[i] : laterValue(i);
+            }
 
             /** Returns false when the iterator reaches the end. */
             explicit operator bool() const noexcept          {return _count > 0;}
@@ -84,12 +87,47 @@ namespace fleece {
 
         private:
             const Value* rawValue() noexcept                 {return _first;}
+            void nextSegment() noexcept;
+            const Value* laterValue(unsigned i) const noexcept;
 
             const Value *_value;
+            // Segmented arrays only: the current segment is in the impl; these track the rest.
+            const Value *_nextSegment {nullptr}; // Index item pointing to the next segment
+            uint32_t _segmentsLeft {0};          // Number of segments after the current one
+            uint32_t _laterCount {0};            // Number of items in those segments
+            bool _indexWide {false};             // Is the index a wide array?
             
             friend class Value;
         };
 
+        /** A smaller array iterator, whose size fits in the C API's FLArrayIterator (that size
+            is part of the C ABI.) It's as fast as `iterator` on ordinary arrays, but steps
+            through a segmented array by index, so each item costs a get(). */
+        class compactIterator {
+        public:
+            compactIterator(const Array* a) noexcept;
+
+            /** Returns the number of _remaining_ items. */
+            uint32_t count() const noexcept                  {return _count;}
+
+            const Value* value() const noexcept              {return _value;}
+
+            /** Random access to items. Index is relative to the current item. */
+            const Value* operator[] (unsigned i) const noexcept;
+
+            explicit operator bool() const noexcept          {return _count > 0;}
+
+            /** Steps to the next item. (Throws if there are no more items.) */
+            compactIterator& operator++();
+
+        private:
+            const Value* _first;    // Next item, or (if _segmented) the Array itself
+            uint32_t _count;        // Number of remaining items
+            bool _wide;             // Are the items wide?
+            bool _segmented;        // Is this a segmented array?
+            const Value *_value;    // The current item
+        };
+
         iterator begin() const noexcept                      {return iterator(this);}
 
         constexpr Array()  :Value(internal::kArrayTag, 0, 0) { }
@@ -0,0 +1,300 @@
+//
+// Base64.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "Base64.hh"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    // SSSE3 isn't part of the x86-64 baseline, so compile for it per-function and check the
+    // CPU at runtime:
+    #define FL_BASE64_SSSE3
+    #define SSSE3_FN __attribute__((target("ssse3")))
+    #include <tmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #define FL_BASE64_SSSE3
+    #define SSSE3_FN
+    #include <intrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define FL_BASE64_NEON
+    #include <arm_neon.h>
+#endif
+
+
+namespace fleece {
+
+    static const char kBase64Chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    // Maps a character to its 6-bit value, or 0xFF if it's not in the alphabet.
+    static const uint8_t kBase64Values[256] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+        0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    };
+
+
+#pragma mark - SSSE3:
+
+#ifdef FL_BASE64_SSSE3
+
+    static bool haveSSSE3() {
+#if defined(__SSSE3__)
+        return true;
+#elif defined(_MSC_VER)
+        static const bool sHave = [] {
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 9)) != 0;
+        }();
+        return sHave;
+#else
+        static const bool sHave = __builtin_cpu_supports("ssse3");
+        return sHave;
+#endif
+    }
+
+    // Encodes 12 bytes at a time to 16 characters. Reads 16 bytes, so it stops while there are
+    // still at least 4 bytes left.
+    SSSE3_FN
+    static void encodeSSSE3(const uint8_t* &src, const uint8_t *end, char* &dst) {
+        const __m128i shuffle = _mm_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+        const __m128i shiftLUT = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        while (end - src >= 16) {
+            // Split each 3 bytes into four 6-bit indices, one per byte:
+            __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), shuffle);
+            __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                                         _mm_set1_epi32(0x04000040));
+            __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                                         _mm_set1_epi32(0x01000010));
+            __m128i indices = _mm_or_si128(hi, lo);
+            // Map each index range to the offset that turns it into its ASCII character:
+            __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+            __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+            range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+            __m128i chars = _mm_add_epi8(indices, _mm_shuffle_epi8(shiftLUT, range));
+            _mm_storeu_si128((__m128i*)dst, chars);
+            src += 12;
+            dst += 16;
+        }
+    }
+
+    // Decodes 16 characters at a time to 12 bytes, stopping at the first block that contains
+    // anything but Base64 digits. Writes 16 bytes, so it stops while 24 characters remain.
+    SSSE3_FN
+    static void decodeSSSE3(const uint8_t* &src, const uint8_t *end, uint8_t* &dst) {
+        const __m128i pack = _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+        while (end - src >= 24) {
+            __m128i in = _mm_loadu_si128((const __m128i*)src);
+            // Classify each character (bytes >= 0x80 are negative, so they match no range):
+            __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                                          _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+            __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+                                          _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+            __m128i plus  = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+            __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+            __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                                         _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+            if (_mm_movemask_epi8(valid) != 0xFFFF)
+                break;
+            __m128i shift = _mm_or_si128(
+                                _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)),
+                                             _mm_and_si128(lower, _mm_set1_epi8(-71))),
+                                _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(4)),
+                                             _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(19)),
+                                                          _mm_and_si128(slash, _mm_set1_epi8(16)))));
+            __m128i values = _mm_add_epi8(in, shift);
+            // Merge pairs of 6-bit values into 12 bits, then pairs of those into 24:
+            __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+            merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+            _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(merged, pack));
+            src += 16;
+            dst += 12;
+        }
+    }
+
+#endif // FL_BASE64_SSSE3
+
+
+#pragma mark - NEON:
+
+#ifdef FL_BASE64_NEON
+
+    // Encodes 48 bytes at a time to 64 characters.
+    static void encodeNEON(const uint8_t* &src, const uint8_t *end, char* &dst) {
+        auto chars = (const uint8_t*)kBase64Chars;
+        const uint8x16x4_t table = {{vld1q_u8(chars),      vld1q_u8(chars + 16),
+                                     vld1q_u8(chars + 32), vld1q_u8(chars + 48)}};
+        const uint8x16_t mask = vdupq_n_u8(0x3F);
+        while (end - src >= 48) {
+            uint8x16x3_t in = vld3q_u8(src);
+            uint8x16x4_t out;
+            out.val[0] = vshrq_n_u8(in.val[0], 2);
+            out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)),
+                                  mask);
+            out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)),
+                                  mask);
+            out.val[3] = vandq_u8(in.val[2], mask);
+            for (int i = 0; i < 4; ++i)
+                out.val[i] = vqtbl4q_u8(table, out.val[i]);
+            vst4q_u8((uint8_t*)dst, out);
+            src += 48;
+            dst += 64;
+        }
+    }
+
+    // Converts 16 Base64 digits to their values; returns false if any isn't a digit.
+    static inline bool valuesNEON(uint8x16_t in, uint8x16_t &values) {
+        uint8x16_t upper = vandq_u8(vcgeq_u8(in, vdupq_n_u8('A')), vcleq_u8(in, vdupq_n_u8('Z')));
+        uint8x16_t lower = vandq_u8(vcgeq_u8(in, vdupq_n_u8('a')), vcleq_u8(in, vdupq_n_u8('z')));
+        uint8x16_t digit = vandq_u8(vcgeq_u8(in, vdupq_n_u8('0')), vcleq_u8(in, vdupq_n_u8('9')));
+        uint8x16_t plus  = vceqq_u8(in, vdupq_n_u8('+'));
+        uint8x16_t slash = vceqq_u8(in, vdupq_n_u8('/'));
+        uint8x16_t valid = vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, vorrq_u8(plus, slash)));
+        if (vminvq_u8(valid) != 0xFF)
+            return false;
+        uint8x16_t shift = vorrq_u8(vorrq_u8(vandq_u8(upper, vdupq_n_u8((uint8_t)-65)),
+                                             vandq_u8(lower, vdupq_n_u8((uint8_t)-71))),
+                                    vorrq_u8(vandq_u8(digit, vdupq_n_u8(4)),
+                                             vorrq_u8(vandq_u8(plus, vdupq_n_u8(19)),
+                                                      vandq_u8(slash, vdupq_n_u8(16)))));
+        values = vaddq_u8(in, shift);
+        return true;
+    }
+
+    // Decodes 64 characters at a time to 48 bytes, stopping at the first block that contains
+    // anything but Base64 digits.
+    static void decodeNEON(const uint8_t* &src, const uint8_t *end, uint8_t* &dst) {
+        while (end - src >= 64) {
+            uint8x16x4_t in = vld4q_u8(src);
+            uint8x16_t a, b, c, d;
+            if (!valuesNEON(in.val[0], a) || !valuesNEON(in.val[1], b)
+                    || !valuesNEON(in.val[2], c) || !valuesNEON(in.val[3], d))
+                break;
+            uint8x16x3_t out;
+            out.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+            out.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+            out.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+            vst3q_u8(dst, out);
+            src += 64;
+            dst += 48;
+        }
+    }
+
+#endif // FL_BASE64_NEON
+
+
+#pragma mark - ENCODE / DECODE:
+
+
+    size_t EncodeBase64(slice data, void *dstStart) {
+        auto src = (const uint8_t*)data.buf, end = (const uint8_t*)data.end();
+        auto dst = (char*)dstStart;
+#if defined(FL_BASE64_SSSE3)
+        if (haveSSSE3())
+            encodeSSSE3(src, end, dst);
+#elif defined(FL_BASE64_NEON)
+        encodeNEON(src, end, dst);
+#endif
+        for (; end - src >= 3; src += 3, dst += 4) {
+            uint32_t n = (uint32_t)src[0] << 16 | (uint32_t)src[1] << 8 | src[2];
+            dst[0] = kBase64Chars[n >> 18];
+            dst[1] = kBase64Chars[(n >> 12) & 0x3F];
+            dst[2] = kBase64Chars[(n >> 6) & 0x3F];
+            dst[3] = kBase64Chars[n & 0x3F];
+        }
+        if (src < end) {
+            uint32_t n = (uint32_t)src[0] << 16;
+            if (end - src == 2)
+                n |= (uint32_t)src[1] << 8;
+            dst[0] = kBase64Chars[n >> 18];
+            dst[1] = kBase64Chars[(n >> 12) & 0x3F];
+            dst[2] = (end - src == 2) ? kBase64Chars[(n >> 6) & 0x3F] : '=';
+            dst[3] = '=';
+            dst += 4;
+        }
+        return dst - (char*)dstStart;
+    }
+
+
+    size_t DecodeBase64(slice base64, void *dstStart) {
+        auto src = (const uint8_t*)base64.buf, end = (const uint8_t*)base64.end();
+        auto dst = (uint8_t*)dstStart;
+        for (;;) {
+#if defined(FL_BASE64_SSSE3)
+            if (haveSSSE3())
+                decodeSSSE3(src, end, dst);
+#elif defined(FL_BASE64_NEON)
+            decodeNEON(src, end, dst);
+#endif
+            for (; end - src >= 4; src += 4, dst += 3) {
+                uint32_t a = kBase64Values[src[0]], b = kBase64Values[src[1]],
+                         c = kBase64Values[src[2]], d = kBase64Values[src[3]];
+                if (_usuallyFalse((a | b | c | d) & 0x80))
+                    break;
+                uint32_t n = a << 18 | b << 12 | c << 6 | d;
+                dst[0] = (uint8_t)(n >> 16);
+                dst[1] = (uint8_t)(n >> 8);
+                dst[2] = (uint8_t)n;
+            }
+            if (src == end)
+                break;
+
+            // Slow path: decode the next four digits, skipping any other characters:
+            uint32_t n = 0;
+            unsigned digits = 0;
+            for (; src < end && digits < 4; ++src) {
+                uint8_t value = kBase64Values[*src];
+                if (value < 0x80) {
+                    n = (n << 6) | value;
+                    ++digits;
+                }
+            }
+            if (digits == 4) {
+                dst[0] = (uint8_t)(n >> 16);
+                dst[1] = (uint8_t)(n >> 8);
+                dst[2] = (uint8_t)n;
+                dst += 3;
+            } else {
+                // At the end; flush the partial group:
+                if (digits >= 2)
+                    *dst++ = (uint8_t)(n >> (6 * digits - 8));
+                if (digits == 3)
+                    *dst++ = (uint8_t)(n >> 2);
+                break;
+            }
+        }
+        return dst - (uint8_t*)dstStart;
+    }
+
+}
@@ -0,0 +1,48 @@
+//
+// Base64.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "slice.hh"
+#include "PlatformCompat.hh"
+
+
+namespace fleece {
+
+    // Standard (RFC 4648) Base64, with '=' padding and no line breaks. Large inputs are
+    // processed 12-48 bytes at a time with SSSE3 or NEON instructions where available.
+
+    /** Returns the length of the Base64 encoding of `dataSize` bytes. */
+    static inline size_t Base64EncodedSize(size_t dataSize) {
+        return (dataSize + 2) / 3 * 4;
+    }
+
+    /** Returns the maximum number of bytes that `base64Size` characters can decode to. */
+    static inline size_t Base64MaxDecodedSize(size_t base64Size) {
+        return (base64Size + 3) / 4 * 3;
+    }
+
+    /** Base64-encodes `data` to `dst`, which must have room for Base64EncodedSize(data.size)
+        bytes. Returns the number of bytes written. */
+    size_t EncodeBase64(slice data, void *dst NONNULL);
+
+    /** Decodes Base64 to `dst`, which must have room for Base64MaxDecodedSize(base64.size)
+        bytes. Returns the number of bytes written. As with libb64, characters that aren't part
+        of the Base64 alphabet (whitespace, '=' padding) are skipped. */
+    size_t DecodeBase64(slice base64, void *dst NONNULL);
+
+}
@@ -0,0 +1,114 @@
+//
+// BaseStringIndex.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BaseStringIndex.hh"
+#include "Array.hh"
+#include "Dict.hh"
+#include "Internal.hh"
+#include "Writer.hh"
+#include "FleeceException.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <vector>
+
+namespace fleece {
+    using namespace internal;
+
+
+    BaseStringIndex::BaseStringIndex(slice base)
+    :_base(base)
+    ,_strings(10)
+    {
+        auto root = Value::fromData(base);
+        throwIf(!root, InvalidData, "base is not valid Fleece data");
+        add(root);
+    }
+
+    BaseStringIndex::BaseStringIndex(slice base, slice indexData)
+    :_base(base)
+    ,_strings(10)
+    {
+        size_t offset = 0;
+        while (indexData.size > 0) {
+            uint64_t delta;
+            throwIf(!ReadUVarInt(&indexData, &delta), InvalidData, "invalid string index data");
+            offset += delta;
+            throwIf(offset + kNarrow > base.size, InvalidData, "string index doesn't match base");
+            slice str = ((const Value*)offsetby(base.buf, offset))->asString();
+            throwIf(!str.buf || str.end() > base.end(),
+                    InvalidData, "string index doesn't match base");
+            add(str, offset);
+        }
+    }
+
+    // Adds the strings in a Value and everything it contains, like Encoder::reuseBaseStrings.
+    void BaseStringIndex::add(const Value *value) {
+        switch (value->type()) {
+            case kString:
+                add(value->asString(), (size_t)value - (size_t)_base.buf);
+                break;
+            case kArray:
+                for (Array::iterator iter(value->asArray()); iter; ++iter)
+                    add(iter.value());
+                break;
+            case kDict:
+                for (Dict::iterator iter(value->asDict()); iter; ++iter) {
+                    add(iter.key());
+                    add(iter.value());
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void BaseStringIndex::add(slice str, size_t offset) {
+        if (str.size >= kNarrow && str.size <= kMaxSharedStringSize) {
+            auto &entry = _strings.find(str);
+            if (entry.first.buf == nullptr) {
+                StringTable::info i = {(uint32_t)offset};
+                _strings.addAt(entry, str, i);
+            }
+        }
+    }
+
+    ssize_t BaseStringIndex::find(slice str) const noexcept {
+        auto &entry = _strings.find(str);
+        return entry.first.buf ? (ssize_t)entry.second.offset : -1;
+    }
+
+    alloc_slice BaseStringIndex::data() const {
+        std::vector<uint32_t> offsets;
+        offsets.reserve(_strings.count());
+        for (auto i = _strings.begin(); i != _strings.end(); ++i) {
+            if (i->buf)
+                offsets.push_back(i.value().offset);
+        }
+        std::sort(offsets.begin(), offsets.end());
+
+        Writer out(offsets.size() * 2);
+        uint32_t prev = 0;
+        for (auto offset : offsets) {
+            uint8_t buf[kMaxVarintLen32];
+            out.write(buf, PutUVarInt(buf, offset - prev));
+            prev = offset;
+        }
+        return out.extractOutput();
+    }
+
+}
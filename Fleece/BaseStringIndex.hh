@@ -0,0 +1,66 @@
+//
+// BaseStringIndex.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "StringTable.hh"
+
+
+namespace fleece {
+    class Value;
+
+    /** An index of the strings in a Fleece document, used when encoding deltas against it
+        (see Encoder::setBase and Encoder::reuseBaseStrings.) Indexing a document walks all of it,
+        so when a base document gets many deltas it's much cheaper to build one index and attach
+        it to every Encoder than to have each one walk the base again.
+
+        The index can be saved, via data(), and reloaded later along with the same base data. */
+    class BaseStringIndex {
+    public:
+        /** Indexes the strings in a Fleece document. The data must remain valid, and unchanged,
+            as long as this object exists. */
+        explicit BaseStringIndex(slice base);
+
+        /** Reloads an index of `base` from data previously returned by data(). Throws InvalidData
+            if the index doesn't match the base. */
+        BaseStringIndex(slice base, slice indexData);
+
+        /** The base document that's indexed. */
+        slice base() const                      {return _base;}
+
+        /** The number of strings indexed. */
+        size_t count() const                    {return _strings.count();}
+
+        /** Returns the offset in the base of a string Value equal to `str`, or -1 if none. */
+        ssize_t find(slice str) const noexcept;
+
+        /** The index in compact form (varint deltas of sorted string offsets), to be saved
+            along with the base and passed to the constructor later. */
+        alloc_slice data() const;
+
+    private:
+        void add(const Value* NONNULL);
+        void add(slice str, size_t offset);
+
+        BaseStringIndex(const BaseStringIndex&) = delete;
+        BaseStringIndex& operator=(const BaseStringIndex&) = delete;
+
+        slice _base;
+        StringTable _strings;   // Maps each string to its offset in _base
+    };
+
+}
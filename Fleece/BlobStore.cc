@@ -0,0 +1,209 @@
+//
+// BlobStore.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "BlobStore.hh"
+#include "FleeceException.hh"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace fleece {
+
+
+#pragma mark - SHA-256:
+
+
+    // A straightforward SHA-256 (FIPS 180-4), so that blob keys don't need a crypto library.
+
+    static const uint32_t kSHA256Constants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2
+    };
+
+    static inline uint32_t rotr(uint32_t x, int n)     {return (x >> n) | (x << (32 - n));}
+
+    static void sha256Block(uint32_t state[8], const uint8_t block[64]) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i+1] << 16
+                 | (uint32_t)block[4*i+2] << 8 | block[4*i+3];
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+                 e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g))
+                        + kSHA256Constants[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    static void sha256(slice data, uint8_t digest[32]) {
+        uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        auto in = (const uint8_t*)data.buf;
+        size_t remaining = data.size;
+        for (; remaining >= 64; remaining -= 64, in += 64)
+            sha256Block(state, in);
+
+        // Pad the last block(s) with a 1 bit, zeroes, and the bit count:
+        uint8_t last[128] = {0};
+        memcpy(last, in, remaining);
+        last[remaining] = 0x80;
+        size_t lastSize = (remaining < 56) ? 64 : 128;
+        uint64_t bits = (uint64_t)data.size * 8;
+        for (int i = 0; i < 8; ++i)
+            last[lastSize - 1 - i] = (uint8_t)(bits >> (8 * i));
+        sha256Block(state, last);
+        if (lastSize == 128)
+            sha256Block(state, last + 64);
+
+        for (int i = 0; i < 8; ++i) {
+            digest[4*i]   = (uint8_t)(state[i] >> 24);
+            digest[4*i+1] = (uint8_t)(state[i] >> 16);
+            digest[4*i+2] = (uint8_t)(state[i] >> 8);
+            digest[4*i+3] = (uint8_t)state[i];
+        }
+    }
+
+
+#pragma mark - BLOBKEY:
+
+
+    BlobKey BlobKey::computeFrom(slice data) {
+        BlobKey key;
+        sha256(data, key.digest);
+        return key;
+    }
+
+    BlobKey BlobKey::fromDigest(slice digest) {
+        throwIf(digest.size != kDigestSize, InvalidData, "invalid blob digest");
+        BlobKey key;
+        memcpy(key.digest, digest.buf, kDigestSize);
+        return key;
+    }
+
+    std::string BlobKey::hexString() const {
+        static const char kHexDigits[] = "0123456789abcdef";
+        std::string hex(2 * kDigestSize, '\0');
+        for (size_t i = 0; i < kDigestSize; ++i) {
+            hex[2*i]   = kHexDigits[digest[i] >> 4];
+            hex[2*i+1] = kHexDigits[digest[i] & 0x0F];
+        }
+        return hex;
+    }
+
+
+#pragma mark - MEMORYBLOBSTORE:
+
+
+    void MemoryBlobStore::put(const BlobKey &key, slice contents) {
+        if (_blobs.find(key) == _blobs.end())
+            _blobs[key] = alloc_slice(contents);
+    }
+
+    alloc_slice MemoryBlobStore::get(const BlobKey &key) const {
+        auto i = _blobs.find(key);
+        return (i != _blobs.end()) ? i->second : alloc_slice();
+    }
+
+
+#pragma mark - DIRECTORYBLOBSTORE:
+
+
+    [[noreturn]] static void throwFileError(const char *what, const std::string &path) {
+        throw FleeceException(InternalError, std::string(what) + " " + path + ": "
+                                             + strerror(errno));
+    }
+
+    DirectoryBlobStore::DirectoryBlobStore(const std::string &dir)
+    :_dir(dir)
+    {
+        if (!_dir.empty() && _dir.back() != '/')
+            _dir += '/';
+    }
+
+    std::string DirectoryBlobStore::pathFor(const BlobKey &key) const {
+        return _dir + key.hexString() + ".blob";
+    }
+
+    bool DirectoryBlobStore::contains(const BlobKey &key) const {
+        FILE *f = fopen(pathFor(key).c_str(), "rb");
+        if (!f)
+            return false;
+        fclose(f);
+        return true;
+    }
+
+    void DirectoryBlobStore::put(const BlobKey &key, slice contents) {
+        if (contains(key))
+            return;
+        // Write to a temporary file, then rename it, so a blob file is never incomplete:
+        std::string path = pathFor(key), tmpPath = path + ".tmp";
+        FILE *f = fopen(tmpPath.c_str(), "wb");
+        if (!f)
+            throwFileError("Can't create", tmpPath);
+        bool ok = fwrite(contents.buf, 1, contents.size, f) == contents.size;
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            int err = errno;
+            remove(tmpPath.c_str());
+            errno = err;
+            throwFileError("Can't write", path);
+        }
+    }
+
+    alloc_slice DirectoryBlobStore::get(const BlobKey &key) const {
+        std::string path = pathFor(key);
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) {
+            if (errno == ENOENT)
+                return alloc_slice();
+            throwFileError("Can't open", path);
+        }
+        alloc_slice contents;
+        bool ok = fseek(f, 0, SEEK_END) == 0;
+        long size = ok ? ftell(f) : -1;
+        if (size >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+            contents = alloc_slice((size_t)size);
+            ok = fread((void*)contents.buf, 1, contents.size, f) == contents.size;
+        } else {
+            ok = false;
+        }
+        fclose(f);
+        if (!ok)
+            throwFileError("Can't read", path);
+        return contents;
+    }
+
+}
@@ -0,0 +1,97 @@
+//
+// BlobStore.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "slice.hh"
+#include <map>
+#include <string>
+
+
+namespace fleece {
+
+    /** Identifies a blob by the SHA-256 digest of its contents. */
+    struct BlobKey {
+        static const size_t kDigestSize = 32;
+
+        uint8_t digest[kDigestSize];
+
+        /** Computes the key of some data. */
+        static BlobKey computeFrom(slice data);
+
+        /** Creates a key from a digest (as returned by Value::asBlobRef.) */
+        static BlobKey fromDigest(slice digest);
+
+        slice asSlice() const                   {return slice(digest, kDigestSize);}
+
+        /** The digest in hex, as used for filenames. */
+        std::string hexString() const;
+
+        bool operator== (const BlobKey &k) const {return asSlice() == k.asSlice();}
+        bool operator< (const BlobKey &k) const  {return asSlice() < k.asSlice();}
+    };
+
+
+    /** Storage for blobs: binary data that's kept outside of Fleece documents, which refer to it
+        by its BlobKey and length (see Encoder::setBlobStore.) */
+    class BlobStore {
+    public:
+        virtual ~BlobStore() { }
+
+        /** Stores a blob. Does nothing if it's already stored. */
+        virtual void put(const BlobKey&, slice contents) =0;
+
+        /** Returns the contents of a blob, or a null slice if it's not stored. */
+        virtual alloc_slice get(const BlobKey&) const =0;
+
+        /** Returns true if a blob is stored. */
+        virtual bool contains(const BlobKey &key) const         {return get(key).buf != nullptr;}
+    };
+
+
+    /** A BlobStore that keeps blobs in memory. */
+    class MemoryBlobStore : public BlobStore {
+    public:
+        void put(const BlobKey&, slice contents) override;
+        alloc_slice get(const BlobKey&) const override;
+        bool contains(const BlobKey &key) const override         {return _blobs.count(key) > 0;}
+
+        size_t count() const                                    {return _blobs.size();}
+
+    private:
+        std::map<BlobKey, alloc_slice> _blobs;
+    };
+
+
+    /** A BlobStore that keeps each blob in a file in a local directory, named by its key, so
+        blobs can be streamed to and from files directly. The directory must already exist. */
+    class DirectoryBlobStore : public BlobStore {
+    public:
+        explicit DirectoryBlobStore(const std::string &dir);
+
+        void put(const BlobKey&, slice contents) override;
+        alloc_slice get(const BlobKey&) const override;
+        bool contains(const BlobKey &key) const override;
+
+        /** The path of the file a blob is (or would be) stored in. */
+        std::string pathFor(const BlobKey&) const;
+
+    private:
+        std::string _dir;
+    };
+
+}
@@ -19,12 +19,21 @@
 #include "Encoder.hh"
 #include "Fleece.hh"
 #include "SharedKeys.hh"
+#include "BaseStringIndex.hh"
+#include "StringCompressor.hh"
+#include "BlobStore.hh"
 #include "Endian.hh"
 #include "varint.hh"
 #include "FleeceException.hh"
 #include "PlatformCompat.hh"
 #include "TempArray.hh"
+#include "Path.hh"
+#include "NumConversion.hh"
+#include "UTF8.hh"
 #include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
 #include <assert.h>
 #include <cmath>
 #include <float.h>
@@ -38,6 +47,16 @@ namespace fleece {
 
     static constexpr size_t kInitialStackSize = 4;
 
+    // The type a value's bytes are counted under in Stats::bytesByType:
+    static inline valueType statsType(const Value *v) {
+        switch (auto type = v->type()) {
+            case kSharedString:
+            case kCompressedString: return kString;
+            case kBlobRef:          return kData;
+            default:                return type;
+        }
+    }
+
     Encoder::Encoder(size_t reserveSize)
     :_out(reserveSize),
      _stack(kInitialStackSize),
@@ -71,6 +90,36 @@ namespace fleece {
         _stackDepth = 0;
     }
 
+    Encoder::Savepoint Encoder::savepoint() const {
+        throwIf(!_items, EncodeError, "encoder has ended");
+        return {_out.length(), _stackDepth, _items->generation, _items->size(),
+                _items->keys.size(), _items->wide, _writingKey, _blockedOnKey, _stats};
+    }
+
+    void Encoder::rollbackTo(const Savepoint &sp) {
+        throwIf(!_items, EncodeError, "encoder has ended");
+        throwIf(_stackDepth < sp.stackDepth
+                    || _stack[sp.stackDepth - 1].generation != sp.generation
+                    || _stack[sp.stackDepth - 1].size() < sp.itemCount,
+                EncodeError, "collection open at savepoint has been closed");
+        throwIf(sp.outputLength < _out.flushedLength(),
+                EncodeError, "output since savepoint has been flushed");
+        while (_stackDepth > sp.stackDepth)
+            _stack[--_stackDepth].clear();
+        _items = &_stack[_stackDepth - 1];
+        _items->erase(_items->begin() + sp.itemCount, _items->end());
+        if (_items->keys.size() > sp.keyCount)
+            _items->keys.resize(sp.keyCount);
+        _items->wide = sp.wide;
+        _writingKey = sp.writingKey;
+        _blockedOnKey = sp.blockedOnKey;
+        if (_out.length() > sp.outputLength) {
+            _out.truncate(sp.outputLength);
+            _strings.removeFromOffset((uint32_t)(_base.size + sp.outputLength));
+        }
+        _stats = sp.stats;
+    }
+
     alloc_slice Encoder::extractOutput() {
         end();
         alloc_slice out = _out.extractOutput();
@@ -96,6 +145,7 @@ namespace fleece {
         push(kSpecialTag, 1);
         _strings.clear();
         _writingKey = _blockedOnKey = false;
+        _stats = Stats();
     }
 
 
@@ -131,9 +181,31 @@ namespace fleece {
             if (rawValue.size > 2)
                 _items->wide = true;
         } else {
+            if (_usuallyFalse(_streaming))
+                flushOutput();
             writePointer(nextWritePos());
             _out.write(rawValue.buf, rawValue.size);
+            _stats.bytesByType[statsType((const Value*)rawValue.buf)] += rawValue.size;
+        }
+    }
+
+    // When writing to a sink, passes the output to it once enough has accumulated. Strings in
+    // flushed output can't be looked up anymore, so they're removed from the string table, and
+    // keys of open dictionaries (needed for sorting) are copied first.
+    void Encoder::flushOutput() {
+        if (_out.length() - _out.flushedLength() < kSinkFlushSize)
+            return;
+        for (unsigned depth = 0; depth < _stackDepth; ++depth) {
+            auto &items = _stack[depth];
+            for (auto &key : items.keys) {
+                if (key.buf && _out.contains(key.buf)) {
+                    items.keyCopies.emplace_back(key);
+                    key = items.keyCopies.back();
+                }
+            }
         }
+        _out.flush();
+        _strings.removeFromOffset((uint32_t)_base.size);
     }
 
 
@@ -147,14 +219,7 @@ namespace fleece {
             addItem(Value(kShortIntTag, (i >> 8) & 0x0F, i & 0xFF));
         } else {
             byte buf[10];
-            size_t size = PutIntOfLength(&buf[1], i, isUnsigned);
-            buf[0] = (byte)size - 1;
-            if (isUnsigned)
-                buf[0] |= 0x08;
-            ++size;
-            if (size & 1)
-                buf[size++] = 0;  // pad to even size
-            writeValue(kIntTag, buf, size);
+            writeRawValue(slice(buf, encodeInt(buf, i, false, isUnsigned)));
         }
     }
 
@@ -162,36 +227,65 @@ namespace fleece {
     void Encoder::writeUInt(uint64_t i) {writeInt(i, (i < 2048),               true);}
 
     void Encoder::writeDouble(double n) {
+        writeDouble(n, FitsInFloat(n));
+    }
+
+    void Encoder::writeDouble(double n, bool fitsInFloat) {
+        byte buf[10];
+        writeRawValue(slice(buf, encodeDouble(buf, n, fitsInFloat)));
+    }
+
+    void Encoder::writeFloat(float n) {
+        byte buf[10];
+        writeRawValue(slice(buf, encodeFloat(buf, n)));
+    }
+
+    // These encode a number as a Value into `buf`, which must have room for 10 bytes, and
+    // return its size (which is always even.)
+
+    size_t Encoder::encodeInt(byte buf[], uint64_t i, bool isSmall, bool isUnsigned) {
+        if (isSmall) {
+            buf[0] = (byte)((kShortIntTag << 4) | ((i >> 8) & 0x0F));
+            buf[1] = (byte)(i & 0xFF);
+            return 2;
+        }
+        size_t size = PutIntOfLength(&buf[1], i, isUnsigned);
+        buf[0] = (byte)((kIntTag << 4) | (size - 1));
+        if (isUnsigned)
+            buf[0] |= 0x08;
+        ++size;
+        if (size & 1)
+            buf[size++] = 0;  // pad to even size
+        return size;
+    }
+
+    size_t Encoder::encodeDouble(byte buf[], double n, bool fitsInFloat) {
         throwIf(std::isnan(n), InvalidData, "Can't write NaN");
         if (n == floor(n) && n <= INT64_MAX && n >= INT64_MIN) {
-            return writeInt((int64_t)n);
-        } else if (fabs(n) <= FLT_MAX && n == (float)n) {
-            return _writeFloat((float)n);
+            auto i = (int64_t)n;
+            return encodeInt(buf, i, (i < 2048 && i >= -2048), false);
+        } else if (fitsInFloat) {
+            return encodeFloat(buf, (float)n);
         } else {
             littleEndianDouble swapped = n;
-            uint8_t buf[2 + sizeof(swapped)];
-            buf[0] = 0x08; // 'double' size flag
+            buf[0] = (kFloatTag << 4) | 0x08; // 'double' size flag
             buf[1] = 0;
             memcpy(&buf[2], &swapped, sizeof(swapped));
-            writeValue(kFloatTag, buf, sizeof(buf));
+            return 2 + sizeof(swapped);
         }
     }
 
-    void Encoder::writeFloat(float n) {
+    size_t Encoder::encodeFloat(byte buf[], float n) {
         throwIf(std::isnan(n), InvalidData, "Can't write NaN");
-        if (n == floorf(n) && n <= INT32_MAX && n >= INT32_MIN)
-            writeInt((int32_t)n);
-        else
-            _writeFloat(n);
-    }
-
-    void Encoder::_writeFloat(float n) {
+        if (n == floorf(n) && n <= INT32_MAX && n >= INT32_MIN) {
+            auto i = (int32_t)n;
+            return encodeInt(buf, i, (i < 2048 && i >= -2048), false);
+        }
         littleEndianFloat swapped = n;
-        uint8_t buf[2 + sizeof(swapped)];
-        buf[0] = 0x00; // 'float' size flag
+        buf[0] = (kFloatTag << 4) | 0x00; // 'float' size flag
         buf[1] = 0;
         memcpy(&buf[2], &swapped, sizeof(swapped));
-        writeValue(kFloatTag, buf, sizeof(buf));
+        return 2 + sizeof(swapped);
     }
 
 
@@ -217,8 +311,10 @@ namespace fleece {
                 buf[bufLen++] = 0;
             buf[0] |= tag << 4;
             writeRawValue({buf, bufLen}, false);       // write header/count
+            size_t bodyPos = _out.length();
             dst = _out.write(s.buf, s.size);
             _out.padToEvenLength();
+            _stats.bytesByType[tag == kStringTag ? kString : kData] += _out.length() - bodyPos;
         }
         return slice(dst, s.size);
     }
@@ -228,13 +324,21 @@ namespace fleece {
         // Check whether this string's already been written:
         if (_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= kMaxSharedStringSize)) {
             auto &entry = _strings.find(s);
-            if (entry.first.buf != nullptr) {
+            slice existing = entry.first;
+            ssize_t existingOffset = entry.second.offset;
+            if (!existing.buf && _baseIndex) {
+                // Not written yet, but it may be in the base:
+                existingOffset = _baseIndex->find(s);
+                if (existingOffset >= 0)
+                    existing = ((const Value*)offsetby(_base.buf, existingOffset))->asString();
+            }
+            if (existing.buf != nullptr) {
 //                fprintf(stderr, "Found `%.*s` --> %u\n", (int)s.size, s.buf, entry.second);
-                writePointer(entry.second.offset - _base.size);
-#ifndef NDEBUG
-                _numSavedStrings++;
-#endif
-                return entry.first;
+                writePointer(existingOffset - _base.size);
+                _stats.stringsReused++;
+                size_t countSize = (s.size >= 0x0F) ? SizeOfVarInt(s.size) : 0;
+                _stats.stringBytesSaved += (1 + countSize + s.size + 1) & ~1;
+                return existing;
             } else {
                 auto offset = _base.size + nextWritePos();
                 throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
@@ -265,25 +369,104 @@ namespace fleece {
         }
     }
 
+    void Encoder::checkUTF8(slice s) {
+        throwIf(!IsValidUTF8(s), InvalidData, "Invalid UTF-8 in string");
+    }
+
+    // Checks the strings, and string keys, in a value and everything it contains.
+    void Encoder::checkStringsUTF8(const Value *value) {
+        switch (value->type()) {
+            case kString:
+                checkUTF8(value->asString());
+                break;
+            case kArray:
+                for (Array::iterator iter(value->asArray()); iter; ++iter)
+                    checkStringsUTF8(iter.value());
+                break;
+            case kDict:
+                for (Dict::iterator iter(value->asDict()); iter; ++iter) {
+                    checkStringsUTF8(iter.key());
+                    checkStringsUTF8(iter.value());
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void Encoder::writeString(slice s) {
+        if (_validateUTF8)
+            checkUTF8(s);
+        int index;
+        if (_sharedValues && _sharedValues->encode(s, index) && index < kMaxSharedStrings) {
+            addItem(Value(kSpecialTag, kSpecialValueSharedString | (index >> 8), index & 0xFF));
+            return;
+        }
+        if (_stringCompressor && s.size >= kMinCompressedStringSize && writeCompressedString(s))
+            return;
+        (void)_writeString(s);
+    }
+
+    // Writes a string compressed by _stringCompressor, unless that doesn't make it smaller.
+    bool Encoder::writeCompressedString(slice s) {
+        TempArray(compressed, uint8_t, StringCompressor::maxCompressedSize(s.size));
+        size_t size = _stringCompressor->compress(s, compressed);
+        uint8_t header[2 + kMaxVarintLen32];
+        header[0] = (kSpecialTag << 4) | kSpecialValueCompressedString;
+        header[1] = 0;
+        size_t headerSize = 2 + PutUVarInt(&header[2], size);
+        if (headerSize + size >= 1 + SizeOfVarInt(s.size) + s.size)
+            return false;
+        writeRawValue({header, headerSize}, false);
+        size_t bodyPos = _out.length();
+        _out.write(compressed, size);
+        _out.padToEvenLength();
+        _stats.bytesByType[kString] += _out.length() - bodyPos;
+        return true;
+    }
+
     void Encoder::writeString(const std::string &s) {
-        _writeString(slice(s));
+        writeString(slice(s));
     }
 
     void Encoder::writeData(slice s) {
+        if (_blobStore && s.size >= _minBlobSize) {
+            auto key = BlobKey::computeFrom(s);
+            _blobStore->put(key, s);
+            writeBlobRef(key, s.size);
+            return;
+        }
         writeData(kBinaryTag, s);
     }
 
+    void Encoder::writeBlobRef(const BlobKey &key, uint64_t length) {
+        uint8_t buf[2 + kBlobRefDigestSize + kMaxVarintLen64];
+        buf[0] = (kSpecialTag << 4) | kSpecialValueBlobRef;
+        buf[1] = 0;
+        memcpy(&buf[2], key.digest, kBlobRefDigestSize);
+        size_t size = 2 + kBlobRefDigestSize + PutUVarInt(&buf[2 + kBlobRefDigestSize], length);
+        writeRawValue({buf, size}, false);
+        _out.padToEvenLength();
+    }
+
 
     void Encoder::reuseBaseStrings() {
         reuseBaseStrings(Value::fromTrustedData(_base));
     }
 
+    void Encoder::reuseBaseStrings(const BaseStringIndex &index) {
+        throwIf(index.base().buf != _base.buf || index.base().size != _base.size,
+                EncodeError, "string index is of a different base");
+        _baseIndex = &index;
+    }
+
     void Encoder::reuseBaseStrings(const Value *value) {
         switch (value->tag()) {
             case kStringTag:
                 cacheString(value->asString(), (size_t)value - (ssize_t)_base.buf);
                 break;
             case kArrayTag:
+            case kSpecialTag:       // might be a segmented array
                 for (Array::iterator iter(value->asArray()); iter; ++iter)
                     reuseBaseStrings(iter.value());
                 break;
@@ -320,7 +503,6 @@ namespace fleece {
             case kShortIntTag:
             case kIntTag:
             case kFloatTag:
-            case kSpecialTag:
                 writeRawValue(slice(value, value->dataSize()));
                 _out.padToEvenLength();
                 break;
@@ -330,7 +512,36 @@ namespace fleece {
             case kBinaryTag:
                 writeData(value->asData());
                 break;
+            case kSpecialTag:
+                if (_usuallyFalse(value->sharedStringIndex() >= 0)) {
+                    // The index only means something in the pool it was encoded with:
+                    auto pool = _sourceSharedValues ? _sourceSharedValues : _sharedValues;
+                    if (!pool || pool != _sharedValues) {
+                        writeString(value->asString(pool));
+                        break;
+                    }
+                } else if (_usuallyFalse(value->type() == kCompressedString)) {
+                    // Likewise, the payload can only be decompressed by its own compressor:
+                    auto compressor = _sourceStringCompressor ? _sourceStringCompressor
+                                                              : _stringCompressor;
+                    if (!compressor || compressor != _stringCompressor) {
+                        throwIf(!compressor, InvalidData,
+                                "Compressed string can't be copied without its compressor");
+                        writeString(compressor->decompress(value->asCompressedString()));
+                        break;
+                    }
+                }
+                if (_usuallyTrue(!value->segmentIndex())) {
+                    writeRawValue(slice(value, value->dataSize()));
+                    _out.padToEvenLength();
+                    break;
+                }
+                // A segmented array's index is only reachable within its own document, so it's
+                // copied as an ordinary array:
+                // fall through
             case kArrayTag: {
+                if (value->tag() == kArrayTag && !writeNestedValue && spliceValue(value, sk))
+                    break;
                 auto iter = value->asArray()->begin();
                 beginArray(iter.count());
                 for (; iter; ++iter) {
@@ -341,22 +552,13 @@ namespace fleece {
                 break;
             }
             case kDictTag: {
+                if (!writeNestedValue && spliceValue(value, sk))
+                    break;
                 auto iter = value->asDict()->begin();
                 beginDictionary(iter.count());
                 for (; iter; ++iter) {
                     if (!writeNestedValue || !(*writeNestedValue)(iter.key(), iter.value())) {
-                        if (iter.key()->isInteger()) {
-                            int intKey = (int)iter.key()->asInt();
-                            if (sk && sk != _sharedKeys) {
-                                slice keySlice = sk->decode(intKey);
-                                throwIf(!keySlice, InvalidData, "Unrecognized integer key");
-                                writeKey(keySlice);
-                            } else {
-                                writeKey(intKey);
-                            }
-                        } else {
-                            writeKey(iter.key()->asString());
-                        }
+                        writeKey(iter.key(), sk);
                         writeValue(iter.value(), sk, writeNestedValue);
                     }
                 }
@@ -369,6 +571,127 @@ namespace fleece {
     }
 
 
+#pragma mark - RELAYOUT:
+
+
+    // A node in the tree formed by relayout()'s hot paths.
+    class Encoder::HotPathNode {
+    public:
+        unsigned priority {0};      // 0 is cold; the first hot path has the highest priority
+
+        void add(const Path &path, unsigned pri) {
+            HotPathNode *node = this;
+            for (auto &elem : path.path()) {
+                auto &child = elem.isKey() ? node->_properties[(std::string)elem.key().string()]
+                                           : node->_indexes[elem.index()];
+                if (!child)
+                    child.reset(new HotPathNode);
+                node = child.get();
+                node->priority = std::max(node->priority, pri);
+            }
+        }
+
+        const HotPathNode* child(slice key) const {
+            auto i = _properties.find((std::string)key);
+            return (i != _properties.end()) ? i->second.get() : nullptr;
+        }
+
+        const HotPathNode* child(uint32_t index, uint32_t count) const {
+            auto i = _indexes.find((int32_t)index);
+            if (i == _indexes.end())
+                i = _indexes.find((int32_t)index - (int32_t)count);   // negative index
+            return (i != _indexes.end()) ? i->second.get() : nullptr;
+        }
+
+    private:
+        std::map<std::string, std::unique_ptr<HotPathNode>> _properties;
+        std::map<int32_t, std::unique_ptr<HotPathNode>> _indexes;
+    };
+
+
+    void Encoder::relayout(const Value *root, const LayoutPolicy &policy) {
+        HotPathNode hot;
+        if (policy.order == LayoutPolicy::kHotFirst) {
+            auto priority = (unsigned)policy.hotPaths.size();
+            for (auto &path : policy.hotPaths)
+                hot.add(Path(path), priority--);
+        }
+        relayout(root, policy, &hot);
+    }
+
+    void Encoder::relayout(const Value *value, const LayoutPolicy &policy, const HotPathNode *hot) {
+        auto tag = value->tag();
+        if (tag < kArrayTag) {
+            writeValue(value, policy.sharedKeys);
+            return;
+        }
+
+        // Collect the children and the hot-path nodes that apply to them:
+        bool isDict = (tag == kDictTag);
+        std::vector<const Value*> keys, values;
+        std::vector<const HotPathNode*> nodes;
+        if (isDict) {
+            Dict::iterator iter(value->asDict(), policy.sharedKeys);
+            keys.reserve(iter.count());
+            values.reserve(iter.count());
+            for (; iter; ++iter) {
+                keys.push_back(iter.key());
+                values.push_back(iter.value());
+                nodes.push_back(hot ? hot->child(iter.keyString()) : nullptr);
+            }
+        } else {
+            Array::iterator iter(value->asArray());
+            uint32_t count = iter.count();
+            values.reserve(count);
+            for (uint32_t i = 0; iter; ++iter, ++i) {
+                values.push_back(iter.value());
+                nodes.push_back(hot ? hot->child(i, count) : nullptr);
+            }
+        }
+
+        // Write colder children before hotter ones, and (at equal hotness) collections before
+        // scalars; whatever is written last ends up closest to this collection.
+        auto count = (uint32_t)values.size();
+        std::vector<uint32_t> order(count);
+        std::vector<unsigned> rank(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            order[i] = i;
+            rank[i] = 2 * (nodes[i] ? nodes[i]->priority : 0) + (values[i]->tag() < kArrayTag);
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [&](uint32_t a, uint32_t b) {return rank[a] < rank[b];});
+
+        if (isDict) {
+            beginDictionary(count);
+            for (auto i : order) {
+                writeKey(keys[i], policy.sharedKeys);
+                relayout(values[i], policy, nodes[i]);
+            }
+            if (!_sortKeys)
+                reorderItems(order, 2);
+            endDictionary();
+        } else {
+            beginArray(count);
+            for (auto i : order)
+                relayout(values[i], policy, nodes[i]);
+            reorderItems(order, 1);
+            endArray();
+        }
+    }
+
+    // Puts the current collection's items, which were added in the order given by `writeOrder`
+    // (a list of logical indexes), back into their logical order.
+    void Encoder::reorderItems(const std::vector<uint32_t> &writeOrder, size_t valuesPerItem) {
+        if (std::is_sorted(writeOrder.begin(), writeOrder.end()))
+            return;
+        std::vector<Value> written(_items->begin(), _items->end());
+        for (size_t k = 0; k < writeOrder.size(); ++k) {
+            for (size_t j = 0; j < valuesPerItem; ++j)
+                (*_items)[writeOrder[k] * valuesPerItem + j] = written[k * valuesPerItem + j];
+        }
+    }
+
+
 #pragma mark - POINTERS:
 
 
@@ -388,22 +711,149 @@ namespace fleece {
         addItem(Value(_base.size + p, kWide));
     }
 
-    // Check whether any pointers in _items can't fit in a narrow Value:
-    void Encoder::checkPointerWidths(valueArray *items, size_t base) {
+    // Decides whether the Values in `items` are written narrow or wide, by comparing the real
+    // sizes of both layouts. A narrow collection can still hold a 3- or 4-byte value by moving it
+    // out of line, and a string that's out of range of a narrow pointer by writing a new copy of
+    // it nearby. If that costs fewer bytes than making every item wide, the moved values are
+    // written to the output here (ahead of the collection, which will start at `writePos`) and
+    // `items` is updated to point to them.
+    void Encoder::checkPointerWidths(valueArray *items, size_t writePos) {
         if (!items->wide) {
+            // Quick check whether all the pointers are in narrow range:
+            size_t pos = writePos;
             for (auto v = items->begin(); v != items->end(); ++v) {
                 if (v->isPointer()) {
-                    ssize_t pos = v->pointerValue<true>() - _base.size;
-                    if (base - pos >= 0x10000) {
+                    ssize_t target = v->pointerValue<true>() - _base.size;
+                    if (pos - target >= 0x10000) {
                         items->wide = true;
                         break;
                     }
                 }
-                base += kNarrow;
+                pos += kNarrow;
+            }
+            if (!items->wide)
+                return;
+        }
+
+        // Find the number of extra bytes a narrow layout needs. Moving values out of line pushes
+        // the items further away from their pointers' targets, so repeat until it's stable:
+        size_t n = items->size(), wideSize = kWide * n;
+        size_t extra = 0;
+        for (;;) {
+            size_t newExtra = 0, pos = writePos + extra;
+            for (auto v = items->begin(); v != items->end(); ++v) {
+                size_t size = narrowExtraSize(*v, pos);
+                if (size == SIZE_MAX)
+                    return;                             // this item has to be wide
+                newExtra += size;
+                if (kNarrow * n + newExtra >= wideSize)
+                    return;                             // wide layout is no bigger
+                pos += kNarrow;
+            }
+            if (newExtra == extra)
+                break;
+            extra = newExtra;
+        }
+
+        // Make sure the moved values themselves are in range of narrow pointers:
+        size_t movedPos = nextWritePos(), pos = writePos + extra;
+        for (auto v = items->begin(); v != items->end(); ++v) {
+            size_t size = narrowExtraSize(*v, pos);
+            if (size > 0) {
+                if (pos - movedPos >= 0x10000)
+                    return;
+                movedPos += size;
             }
+            pos += kNarrow;
+        }
+
+        // Narrow wins; write the moved values:
+        pos = writePos + extra;
+        for (auto v = items->begin(); v != items->end(); ++v) {
+            if (narrowExtraSize(*v, pos) > 0) {
+                size_t newPos;
+                if (v->isPointer()) {
+                    ssize_t target = v->pointerValue<true>() - _base.size;
+                    newPos = copyString(target, stringSizeAt(target));
+                } else {
+                    newPos = nextWritePos();
+                    _out.write(&*v, kWide);
+                    _stats.bytesByType[statsType(&*v)] += kWide;
+                }
+                *v = Value(_base.size + newPos, kWide);
+                _stats.movedValues++;
+            }
+            pos += kNarrow;
+        }
+        assert(nextWritePos() == movedPos);
+        items->wide = false;
+    }
+
+    // Returns the number of bytes that have to be written out of line for `item` to be stored
+    // as a narrow Value at position `itemPos`, or SIZE_MAX if that's not possible.
+    size_t Encoder::narrowExtraSize(const Value &item, size_t itemPos) {
+        if (item.isPointer()) {
+            ssize_t target = item.pointerValue<true>() - _base.size;
+            if (itemPos - target < 0x10000)
+                return 0;
+            size_t size = stringSizeAt(target);
+            return size ? size : SIZE_MAX;
+        } else if (item.tag() < kArrayTag && item.dataSize() > kNarrow) {
+            return kWide;                               // 3-4 byte inline value
+        } else {
+            return 0;
+        }
+    }
+
+    // Returns the encoded (padded) size of the Value at `pos` if it's a string, else 0.
+    // A negative `pos` is in the base.
+    size_t Encoder::stringSizeAt(ssize_t pos) {
+        if (pos < 0) {
+            auto value = (const Value*)offsetby(_base.end(), pos);
+            if (value->tag() != kStringTag)
+                return 0;
+            return (value->dataSize() + 1) & ~1;
+        } else if ((size_t)pos < _out.flushedLength()) {
+            return 0;                   // It's been flushed to the sink, so it can't be copied
+        } else {
+            uint8_t header[1 + kMaxVarintLen32];
+            size_t headerSize = std::min(sizeof(header), _out.length() - pos);
+            _out.copyOutput(pos, header, headerSize);
+            if ((header[0] >> 4) != kStringTag)
+                return 0;
+            size_t size = header[0] & 0x0F;
+            size_t sizeLen = 0;
+            if (size == 0x0F) {
+                uint32_t realSize;
+                sizeLen = GetUVarInt32(slice(&header[1], headerSize - 1), &realSize);
+                if (sizeLen == 0)
+                    return 0;
+                size = realSize;
+            }
+            return (1 + sizeLen + size + 1) & ~1;
         }
     }
 
+    // Writes a copy of the string Value at `pos` (of encoded size `size`) to the output, and
+    // returns the position of the copy. Later references to the string will use the copy.
+    size_t Encoder::copyString(ssize_t pos, size_t size) {
+        size_t newPos = nextWritePos();
+        const void *dst;
+        if (pos < 0) {
+            dst = _out.write(offsetby(_base.end(), pos), size);
+        } else {
+            dst = _out.reserveSpace(size);
+            _out.copyOutput(pos, (void*)dst, size);
+        }
+        _stats.bytesByType[kString] += size;
+        if (_uniqueStrings) {
+            auto &entry = _strings.find(((const Value*)dst)->asString());
+            if (entry.first.buf)
+                _strings.setOffset(entry, (uint32_t)(_base.size + newPos));
+        }
+        return newPos;
+    }
+
     // Convert absolute offsets to relative in _items:
     void Encoder::fixPointers(valueArray *items) {
         size_t base = nextWritePos();
@@ -414,6 +864,10 @@ namespace fleece {
                 assert(pos < (ssize_t)base);
                 pos = base - pos;
                 *v = Value(pos, width);
+                unsigned bucket = 0;
+                for (size_t d = (size_t)pos >> 4; d && bucket < Stats::kPointerBuckets-1; d >>= 4)
+                    ++bucket;
+                _stats.pointers[bucket]++;
             }
             base += width;
         }
@@ -436,6 +890,8 @@ namespace fleece {
     }
 
     void Encoder::writeKey(slice s) {
+        if (_validateUTF8)
+            checkUTF8(s);
         int encoded;
         if (_sharedKeys && _sharedKeys->encodeAndAdd(s, encoded)) {
             writeKey(encoded);
@@ -455,7 +911,14 @@ namespace fleece {
         slice str = key->asString();
         if (str) {
             addingKey();
-            writeValue(key, nullptr);
+            if (valueIsInBase(key) && !isNarrowValue(key)) {
+                writePointer( (ssize_t)key - (ssize_t)_base.end() );
+            } else {
+                // Not writeString(), since keys are never pooled or compressed:
+                if (_validateUTF8)
+                    checkUTF8(str);
+                _writeString(str);
+            }
             addedKey(str);
         } else {
             throwIf(!key->isInteger(), InvalidData, "Key must be a string or integer");
@@ -464,13 +927,17 @@ namespace fleece {
         }
     }
 
-    void Encoder::writeKey(const Value *key, SharedKeys *sk) {
+    void Encoder::writeKey(const Value *key, const SharedKeys *sk) {
         if (key->isInteger()) {
             int intKey = (int)key->asInt();
             if (sk && sk != _sharedKeys) {
-                slice keySlice = sk->decode(intKey);
-                throwIf(!keySlice, InvalidData, "Unrecognized integer key");
-                writeKey(keySlice);
+                if (_sharedKeys) {
+                    writeKeyFrom(intKey, sk);
+                } else {
+                    slice keySlice = sk->decode(intKey);
+                    throwIf(!keySlice, InvalidData, "Unrecognized integer key");
+                    writeKey(keySlice);
+                }
             } else {
                 writeKey(intKey);
             }
@@ -479,8 +946,45 @@ namespace fleece {
         }
     }
 
+    // Writes an integer key from another SharedKeys mapping, translated to _sharedKeys. The
+    // translations are cached in _keyMap, which is invalidated if either mapping's count changes
+    // behind our back (as by a revert), so most keys cost just a vector lookup.
+    void Encoder::writeKeyFrom(int key, const SharedKeys *sk) {
+        static const int kNotCached = -1, kNotShared = -2;
+        if (_usuallyFalse(sk != _keyMapSource || sk->count() != _keyMapSourceCount
+                                              || _sharedKeys->count() != _keyMapTargetCount)) {
+            _keyMap.clear();
+            _keyMapSource = sk;
+            _keyMapSourceCount = sk->count();
+            _keyMapTargetCount = _sharedKeys->count();
+        }
+
+        int mapped = kNotCached;
+        if (key >= 0 && (size_t)key < _keyMap.size())
+            mapped = _keyMap[key];
+        if (_usuallyFalse(mapped == kNotCached)) {
+            slice keySlice = sk->decode(key);
+            throwIf(!keySlice, InvalidData, "Unrecognized integer key");
+            int encoded;
+            mapped = _sharedKeys->encodeAndAdd(keySlice, encoded) ? encoded : kNotShared;
+            if ((size_t)key >= _keyMap.size())
+                _keyMap.resize(key + 1, kNotCached);
+            _keyMap[key] = mapped;
+            // Those calls may have grown the mappings, which leaves existing entries valid:
+            _keyMapSourceCount = sk->count();
+            _keyMapTargetCount = _sharedKeys->count();
+        }
+
+        if (mapped >= 0) {
+            writeKey(mapped);
+        } else {
+            addingKey();
+            addedKey(_writeString(sk->decode(key)));
+        }
+    }
+
     void Encoder::addedKey(slice str) {
-        if (_usuallyTrue(_sortKeys))
+        if (_usuallyTrue(_sortKeys && !_items->keysSorted))
             _items->keys.push_back(str);
     }
 
@@ -489,6 +993,7 @@ namespace fleece {
             _stack.resize(2*_stackDepth);
         _items = &_stack[_stackDepth++];
         _items->reset(tag);
+        _items->generation = ++_generation;
         if (reserve > 0) {
             _items->reserve(reserve);
             if (_usuallyTrue(tag == kDictTag)) {
@@ -509,8 +1014,194 @@ namespace fleece {
         _writingKey = _blockedOnKey = true;
     }
 
+    void Encoder::beginSortedDictionary(size_t reserve) {
+        beginDictionary(reserve);
+        _items->keysSorted = true;
+    }
+
     void Encoder::endArray() {
-        endCollection(internal::kArrayTag);
+        if (_usuallyFalse(_items->appendTo != nullptr))
+            endSegmentedArray();
+        else
+            endCollection(internal::kArrayTag);
+    }
+
+    void Encoder::beginAppendingArray(const Value *array, size_t reserve) {
+        auto items = array->asArray();
+        throwIf(!items, EncodeError, "not an array");
+        beginArray(reserve);
+        if (valueIsInBase(array)) {
+            _items->appendTo = array;
+        } else {
+            for (Array::iterator iter(items); iter; ++iter)
+                writeValue(iter.value());
+        }
+    }
+
+    // Removes the Value that endCollection just added to the enclosing collection.
+    Value Encoder::popItem() {
+        Value item = _items->back();
+        _items->pop_back();
+        _writingKey = _blockedOnKey = false;
+        return item;
+    }
+
+    // Ends an array begun by beginAppendingArray. The new items are written as a new segment,
+    // followed by an index pointing to the base array's segments and the new one. To keep the
+    // index short, trailing segments no bigger than the new one are merged into it, like carries
+    // in a binary counter: that keeps the number of segments logarithmic in the count, and over
+    // a series of appends each item is copied into a bigger segment only that many times.
+    void Encoder::endSegmentedArray() {
+        const Value *baseArray = _items->appendTo;
+        _items->appendTo = nullptr;
+
+        if (_items->empty()) {
+            // Nothing was appended, so the result is the base array:
+            endCollection(kArrayTag);
+            popItem();
+            writeValue(baseArray);
+            return;
+        }
+
+        std::vector<const Array*> segments;
+        if (auto index = baseArray->segmentIndex()) {
+            for (Array::iterator iter(index); iter; ++iter) {
+                if (!iter.value()->countIsZero())
+                    segments.push_back(iter.value()->asArray());
+            }
+        } else if (!baseArray->countIsZero()) {
+            segments.push_back(baseArray->asArray());
+        }
+
+        auto segmentCount = (uint32_t)_items->size();
+        auto totalCount = segmentCount;
+        for (auto segment : segments)
+            totalCount += segment->count();
+        size_t nKept = segments.size();
+        while (nKept > 0 && segments[nKept - 1]->count() <= segmentCount)
+            segmentCount += segments[--nKept]->count();
+
+        if (nKept < segments.size()) {
+            // Put the merged segments' items ahead of the new ones:
+            std::vector<Value> newItems(_items->begin(), _items->end());
+            bool newItemsWide = _items->wide;
+            _items->clear();
+            _items->reserve(segmentCount);
+            for (size_t i = nKept; i < segments.size(); ++i) {
+                for (Array::iterator iter(segments[i]); iter; ++iter)
+                    writeValue(iter.value());
+            }
+            _items->insert(_items->end(), newItems.begin(), newItems.end());
+            _items->wide |= newItemsWide;
+        }
+        endCollection(kArrayTag);
+        if (nKept == 0)
+            return;                         // Merged everything, so it's an ordinary array
+        Value segment = popItem();
+
+        push(kArrayTag, nKept + 1);
+        for (size_t i = 0; i < nKept; ++i)
+            writeValue(segments[i]);
+        addItem(segment);
+        endCollection(kArrayTag);
+        Value index = popItem();
+
+        // Write the header, with a wide pointer back to the index:
+        size_t indexPos = index.pointerValue<true>() - _base.size;
+        uint8_t buf[2 + kWide + kMaxVarintLen32];
+        buf[0] = (kSpecialTag << 4) | kSpecialValueSegmentedArray;
+        buf[1] = 0;
+        Value indexPtr(nextWritePos() + 2 - indexPos, kWide);
+        memcpy(&buf[2], &indexPtr, kWide);
+        size_t size = 2 + kWide + PutUVarInt(&buf[2 + kWide], totalCount);
+        writeRawValue({buf, size}, false);
+        _out.padToEvenLength();
+    }
+
+    void Encoder::appendArrayItems(slice data) {
+        throwIf(_items->tag != kArrayTag, EncodeError, "not writing an array");
+        auto array = Value::fromTrustedData(data);
+        throwIf(!array || array->tag() != kArrayTag, InvalidData, "data is not an array");
+        if (_validateUTF8)
+            checkStringsUTF8(array);        // since its strings are copied without being written
+
+        // Everything before the array header is the items' data; copy it as-is:
+        size_t headerPos = (size_t)array - (size_t)data.buf;
+        if (_usuallyFalse(_streaming))
+            flushOutput();
+        size_t dataPos = nextWritePos();
+        _out.write(data.buf, headerPos);
+
+        // Then add the items, rebasing the pointers:
+        bool wide = array->isWideArray();
+        auto item = offsetby(array, array->dataSize());
+        for (uint32_t n = array->asArray()->count(); n > 0; --n) {
+            if (item->isPointer()) {
+                size_t target = (size_t)Value::derefPointer(item, wide) - (size_t)data.buf;
+                assert(target < headerPos);
+                writePointer(dataPos + target);
+            } else {
+                writeRawValue(slice(item, item->dataSize()));
+            }
+            item = item->next(wide);
+        }
+    }
+
+    // Writes an entire array of scalars, each encoded by `encode` (see encodeInt.) The items go
+    // straight into the new array, or into the output if they don't fit inline, bypassing the
+    // per-item checks of addItem().
+    template <class T, class ENCODE>
+    void Encoder::writeScalarArray(const T *values, size_t count, ENCODE encode) {
+        beginArray(count);
+        valueArray &items = *_items;
+        byte buf[10];
+        for (size_t i = 0; i < count; ++i) {
+            size_t size = encode(buf, values[i]);
+            if (size <= kWide) {
+                if (size > kNarrow)
+                    items.wide = true;
+                memset(&buf[size], 0, kWide - size);
+                items.push_back(*(Value*)buf);
+            } else {
+                if (_usuallyFalse(_streaming))
+                    flushOutput();
+                items.push_back(Value(_base.size + nextWritePos(), kWide));
+                _out.write(buf, size);
+                _stats.bytesByType[statsType((const Value*)buf)] += size;
+            }
+        }
+        endArray();
+    }
+
+    void Encoder::writeArray(const int64_t *values, size_t count) {
+        writeScalarArray(values, count, [](byte *buf, int64_t i) {
+            return encodeInt(buf, i, (i < 2048 && i >= -2048), false);
+        });
+    }
+
+    void Encoder::writeArray(const double *values, size_t count) {
+        writeScalarArray(values, count, [](byte *buf, double d) {
+            return encodeDouble(buf, d, FitsInFloat(d));
+        });
+    }
+
+    void Encoder::writeArray(const float *values, size_t count) {
+        writeScalarArray(values, count, &encodeFloat);
+    }
+
+    void Encoder::writeArray(const bool *values, size_t count) {
+        writeScalarArray(values, count, [](byte *buf, bool b) {
+            buf[0] = (kSpecialTag << 4) | (b ? kSpecialValueTrue : kSpecialValueFalse);
+            buf[1] = 0;
+            return kNarrow;
+        });
+    }
+
+    void Encoder::writeArray(const slice *values, size_t count) {
+        beginArray(count);
+        for (size_t i = 0; i < count; ++i)
+            writeString(values[i]);
+        endArray();
     }
 
     void Encoder::endDictionary() {
@@ -532,7 +1223,7 @@ namespace fleece {
         _items = &_stack[_stackDepth - 1];
         _writingKey = _blockedOnKey = false;
 
-        if (_sortKeys && tag == kDictTag)
+        if (_sortKeys && tag == kDictTag && !items->keysSorted)
             sortDict(*items);
 
         auto nValues = items->size();    // includes keys if this is a dict!
@@ -574,15 +1265,15 @@ namespace fleece {
             }
         }
 
-#ifndef NDEBUG
+        _stats.bytesByType[tag == kDictTag ? kDict : kArray] += nValues * (items->wide ? kWide
+                                                                                        : kNarrow);
         if (items->wide) {
-            _numWide++;
-            _wideCount += count;
+            _stats.wideCollections++;
+            _stats.wideItems += count;
         } else {
-            _numNarrow++;
-            _narrowCount += count;
+            _stats.narrowCollections++;
+            _stats.narrowItems += count;
         }
-#endif
 
         items->clear();
     }
@@ -608,6 +1299,9 @@ namespace fleece {
         size_t n = keys.size();
         if (n < 2)
             return;
+        std::chrono::steady_clock::time_point startTime;
+        if (_usuallyFalse(_timeSorting))
+            startTime = std::chrono::steady_clock::now();
 
         // Fill in the pointers of any keys that refer to inline strings:
         for (unsigned i = 0; i < n; i++) {
@@ -639,7 +1333,226 @@ namespace fleece {
                 items[2*i+1] = old[2*j+1];
             }
         }
+        if (_usuallyFalse(_timeSorting))
+            _stats.sortNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                            std::chrono::steady_clock::now() - startTime).count();
     }
 
-}
 
+#pragma mark - SPLICING:
+
+
+    // Collections from other documents are copied verbatim, instead of being re-encoded value
+    // by value, if their data spans at least this many bytes:
+    static const size_t kMinSpliceSize = 256;
+
+    // What scanSubtree() finds out about the data a collection depends on.
+    struct Encoder::SpliceScan {
+        struct Block {
+            const Value *value;     // Start of a value stored out of line
+            size_t size;            // Its size; a collection's includes its items
+            bool isLeaf;            // False if it's a collection
+        };
+        struct Pointer {
+            const Value *item;      // A pointer item in a collection
+            const Value *target;    // What it points to
+            bool wide;
+        };
+        std::vector<Block> blocks;
+        std::vector<Pointer> pointers;
+    };
+
+    static inline size_t itemCount(const Value *coll) {
+        if (coll->type() == kDict)
+            return 2 * (size_t)coll->asDict()->count();
+        else
+            return coll->asArray()->count();
+    }
+
+    // Walks a collection, recording every value and pointer it depends on. Returns false if
+    // re-encoding the collection would produce different keys or key order than copying it.
+    bool Encoder::scanSubtree(const Value *coll, const SharedKeys *sk, SpliceScan &scan) {
+        bool isDict = (coll->tag() == kDictTag);
+        bool wide = coll->isWideArray();
+        size_t nItems = itemCount(coll);
+        scan.blocks.push_back({coll, coll->dataSize() + nItems * (wide ? kWide : kNarrow), false});
+
+        slice prevKey;
+        auto item = offsetby(coll, coll->dataSize());
+        for (size_t i = 0; i < nItems; ++i, item = item->next(wide)) {
+            const Value *value = item;
+            if (item->isPointer()) {
+                value = Value::derefPointer(item, wide);
+                if (value->isPointer() || value->segmentIndex())
+                    return false;
+                scan.pointers.push_back({item, value, wide});
+                if (value->tag() >= kArrayTag) {
+                    if (!scanSubtree(value, sk, scan))
+                        return false;
+                } else {
+                    scan.blocks.push_back({value, value->dataSize(), true});
+                }
+            }
+
+            auto type = value->type();
+            if (type == kSharedString || type == kCompressedString)
+                return false;           // may have to be resolved or decompressed
+            if (_validateUTF8 && type == kString)
+                checkUTF8(value->asString());   // as writeString would
+
+            if (isDict && (i % 2) == 0) {
+                // Keys have to come out just as writeKey(const Value*, sk) would write them:
+                slice key;
+                if (value->isInteger()) {
+                    if (sk && sk != _sharedKeys)
+                        return false;
+                    key = slice(nullptr, (size_t)value->asInt());
+                } else {
+                    key = value->asString();
+                    if (!key || _sharedKeys)
+                        return false;
+                }
+                if (_sortKeys && i > 0 && !compareKeysByIndex(&prevKey, &key))
+                    return false;
+                prevKey = key;
+            }
+        }
+        return true;
+    }
+
+    // Copies a collection from another document by splicing its encoded data into the output,
+    // which is much faster than re-encoding it. Values it shares with the rest of its document
+    // (such as de-duplicated strings) are copied or reused, and the pointers to them fixed up.
+    // Returns false, without writing anything, if the collection is small or can't be copied
+    // as-is.
+    bool Encoder::spliceValue(const Value *coll, const SharedKeys *sk) {
+        // A verbatim copy would bypass pooling or compressing its strings, or externalizing blobs:
+        if (_sharedValues || _stringCompressor || _blobStore)
+            return false;
+        // Estimate the size of the subtree from the lowest address its items point to:
+        bool wide = coll->isWideArray();
+        auto first = offsetby(coll, coll->dataSize());
+        auto end = offsetby(first, itemCount(coll) * (wide ? kWide : kNarrow));
+        const Value *start = coll;
+        for (auto item = first; item < end; item = item->next(wide)) {
+            if (item->isPointer())
+                start = std::min(start, Value::derefPointer(item, wide));
+        }
+        if ((size_t)end - (size_t)start < kMinSpliceSize)
+            return false;
+
+        SpliceScan scan;
+        if (!scanSubtree(coll, sk, scan))
+            return false;
+
+        // Find the contiguous run of data that ends with the collection. Leaf values outside
+        // it get copied separately, before it:
+        std::sort(scan.blocks.begin(), scan.blocks.end(),
+                  [](const SpliceScan::Block &a, const SpliceScan::Block &b) {
+                      return a.value > b.value;
+                  });
+        start = coll;
+        std::vector<const SpliceScan::Block*> outside;
+        for (auto &block : scan.blocks) {
+            if (block.value >= start)
+                continue;
+            if ((size_t)block.value + block.size + 1 >= (size_t)start) { // allow for padding
+                start = block.value;
+            } else if (!block.isLeaf) {
+                return false;
+            } else if (outside.empty() || outside.back()->value != block.value) {
+                outside.push_back(&block);
+            }
+        }
+        size_t spanSize = (size_t)end - (size_t)start;
+        if (spanSize < kMinSpliceSize)
+            return false;
+
+        // Flush before looking up strings and positions, since the writes below bypass
+        // writeRawValue:
+        if (_usuallyFalse(_streaming))
+            flushOutput();
+
+        // Work out where everything will go. Strings already in the output (or base) are
+        // reused if the pointers to them can reach; other leaf values are copied before the span.
+        struct Placement {
+            ssize_t pos {0};
+            size_t maxNarrowOffset {0};  // Offset in span of furthest narrow pointer to it
+            bool hasNarrow {false};
+            bool copy {true};
+        };
+        std::map<const Value*, Placement> placements;
+        for (auto &ptr : scan.pointers) {
+            if (ptr.target < start && !ptr.wide) {
+                auto &p = placements[ptr.target];
+                p.hasNarrow = true;
+                p.maxNarrowOffset = std::max(p.maxNarrowOffset, (size_t)ptr.item - (size_t)start);
+            }
+        }
+        size_t maxSpanPos = nextWritePos();
+        for (auto block : outside)
+            maxSpanPos += block->size + (block->size & 1);
+        size_t pos = nextWritePos();
+        for (auto block : outside) {
+            auto &p = placements[block->value];
+            slice str = block->value->asString();
+            if (str && _uniqueStrings && str.size >= kNarrow && str.size <= kMaxSharedStringSize) {
+                auto &entry = _strings.find(str);
+                if (entry.first.buf) {
+                    ssize_t existingPos = (ssize_t)entry.second.offset - (ssize_t)_base.size;
+                    if (!p.hasNarrow || maxSpanPos + p.maxNarrowOffset - existingPos < 0x10000) {
+                        p.pos = existingPos;
+                        p.copy = false;
+                        continue;
+                    }
+                }
+            }
+            p.pos = pos;
+            pos += block->size + (block->size & 1);
+        }
+        size_t spanPos = pos;
+        for (auto &entry : placements) {
+            auto &p = entry.second;
+            if (p.copy && p.hasNarrow && spanPos + p.maxNarrowOffset - p.pos >= 0x10000)
+                return false;
+        }
+
+        // Now write it all:
+        for (auto block : outside) {
+            auto &p = placements[block->value];
+            if (!p.copy) {
+                _stats.stringsReused++;
+                _stats.stringBytesSaved += block->size;
+                continue;
+            }
+            auto dst = (const Value*)_out.write(block->value, block->size);
+            _out.padToEvenLength();
+            _stats.bytesByType[statsType(dst)] += block->size;
+            slice str = dst->asString();
+            if (str && _uniqueStrings && str.size >= kNarrow && str.size <= kMaxSharedStringSize) {
+                // Later strings can point to this copy:
+                auto &entry = _strings.find(str);
+                if (entry.first.buf) {
+                    _strings.setOffset(entry, (uint32_t)(_base.size + p.pos));
+                } else {
+                    StringTable::info i = {(uint32_t)(_base.size + p.pos)};
+                    _strings.addAt(entry, str, i);
+                }
+            }
+        }
+        auto dst = _out.write(start, spanSize);
+        _stats.bytesByType[statsType(coll)] += spanSize;
+        for (auto &ptr : scan.pointers) {
+            if (ptr.target < start) {
+                size_t itemOffset = (size_t)ptr.item - (size_t)start;
+                size_t width = ptr.wide ? kWide : kNarrow;
+                Value fixed(spanPos + itemOffset - placements[ptr.target].pos, (int)width);
+                _out.rewrite(offsetby(dst, itemOffset), slice(&fixed, width));
+            }
+        }
+        writePointer(spanPos + ((size_t)coll - (size_t)start));
+        _stats.splicedCollections++;
+        return true;
+    }
+
+}
@@ -23,11 +23,16 @@
 #include "StringTable.hh"
 #include <array>
 #include "function_ref.hh"
+#include <string>
 #include <vector>
 
 
 namespace fleece {
     class SharedKeys;
+    class BaseStringIndex;
+    class StringCompressor;
+    class BlobStore;
+    struct BlobKey;
 
 
     /** Generates Fleece-encoded data. */
@@ -39,18 +44,35 @@ namespace fleece {
         /** Sets the uniqueStrings property. If true (the default), the encoder tries to write
             each unique string only once. This saves space but makes the encoder slightly slower. */
         void uniqueStrings(bool b)      {_uniqueStrings = b;}
+        bool uniqueStrings() const      {return _uniqueStrings;}
 
         /** Sets the sortKeys property. If true (the default), dictionary keys will be written in
             sorted order. This makes dict::get faster but makes the encoder slightly slower. */
         void sortKeys(bool b)           {_sortKeys = b;}
+        bool sortKeys() const           {return _sortKeys;}
+
+        /** Sets the validateUTF8 property. If true (the default is false), writing a string or
+            key that isn't well-formed UTF-8 throws an InvalidData exception. */
+        void validateUTF8(bool b)       {_validateUTF8 = b;}
+        bool validateUTF8() const       {return _validateUTF8;}
+
+        /** Sets the timeSorting property. If true (the default is false), the time spent sorting
+            dictionary keys is measured, in Stats::sortNanoseconds. This reads the clock twice
+            per dictionary, so it's off unless you need it. */
+        void timeSorting(bool b)        {_timeSorting = b;}
 
         /** Sets the base Fleece data that the encoded data will be appended to.
             Any writeValue() calls whose Value points into the base data will be written as
             pointers. */
-        void setBase(slice base)        {_base = base;}
+        void setBase(slice base)        {_base = base; _baseIndex = nullptr;}
 
         void reuseBaseStrings();
 
+        /** Like reuseBaseStrings(), but looks up strings in a prebuilt index of the base instead
+            of walking the base now. The index must be of the same base data, and must remain
+            valid as long as this Encoder uses it. */
+        void reuseBaseStrings(const BaseStringIndex&);
+
         bool isEmpty() const            {return _out.length() == 0 && _stackDepth == 1 && _items->empty();}
         size_t bytesWritten() const     {return _out.length();} // may be an underestimate
 
@@ -60,10 +82,59 @@ namespace fleece {
         /** Returns the encoded data. This implicitly calls end(). */
         alloc_slice extractOutput();
 
+        /** Makes the encoder pass its output to a sink as it goes (every kSinkFlushSize bytes or
+            so), so that memory use doesn't grow with the size of the document. Pointers only
+            point back to earlier data, so the output is valid; but strings are only de-duplicated
+            within each flushed piece, and a savepoint can't be rolled back past a flush.
+            extractOutput() writes the rest of the output to the sink and returns null.
+            Must be called before anything is written. */
+        void setOutputSink(Writer::Sink sink)   {_out.setSink(std::move(sink), false);
+                                                 _streaming = true;}
+
+        static const size_t kSinkFlushSize = 64 * 1024;
+
         /** Resets the encoder so it can be used again. This creates a new empty Writer,
             which can be accessed via the writer() method. */
         void reset();
 
+        /** Counters describing the data encoded so far, for tuning encoder options. They're
+            cheap enough to be kept in all builds, and are cleared by reset(). */
+        struct Stats {
+            static const unsigned kPointerBuckets = 8;
+
+            size_t   bytesByType[kDict+1];  // Bytes written per valueType; an inline value
+                                            // counts as part of its array/dict
+            unsigned stringsReused;         // Strings written as pointers to an earlier copy
+            size_t   stringBytesSaved;      // Bytes those strings would otherwise have taken
+            unsigned narrowCollections, wideCollections;    // Arrays/dicts of each width
+            size_t   narrowItems, wideItems;                // Items in those arrays/dicts
+            unsigned movedValues;           // Values moved out of line to keep arrays narrow
+            unsigned splicedCollections;    // Collections copied verbatim from other data
+            unsigned pointers[kPointerBuckets]; // Pointers by distance: bucket i < 16^(i+1) bytes
+            uint64_t sortNanoseconds;       // Time spent sorting dict keys (if timeSorting)
+        };
+
+        const Stats& stats() const      {return _stats;}
+
+        /** The state of an Encoder at some point, which it can later be rolled back to. */
+        struct Savepoint {
+            size_t outputLength;
+            unsigned stackDepth;
+            uint64_t generation;            // Identifies the collection open at the savepoint
+            size_t itemCount, keyCount;
+            bool wide, writingKey, blockedOnKey;
+            Stats stats;
+        };
+
+        /** Returns a Savepoint representing the current state. */
+        Savepoint savepoint() const;
+
+        /** Discards everything written since the savepoint was made, including any arrays and
+            dictionaries begun since then, and restores the stats. The array or dictionary that
+            was open at the savepoint must still be open. (Keys added to SharedKeys aren't
+            removed.) */
+        void rollbackTo(const Savepoint&);
+
         /////// Writing data:
 
         void writeNull();
@@ -74,11 +145,20 @@ namespace fleece {
         void writeFloat(float);
         void writeDouble(double);
 
+        /** Writes a double whose exact representability as a float is already known, as from
+            ParseDouble, instead of testing it again. */
+        void writeDouble(double, bool fitsInFloat);
+
         void writeString(const std::string&);
-        void writeString(slice s)           {(void)_writeString(s);}
+        void writeString(slice s);
 
         void writeData(slice s);
 
+        /** Writes a reference to a blob stored outside the document (see setBlobStore.) */
+        void writeBlobRef(const BlobKey&, uint64_t length);
+
+        /** Writes a copy of a Value. Large arrays and dictionaries from other documents are
+            spliced in by copying their encoded data, rather than being re-encoded. */
         void writeValue(const Value* NONNULL v,
                         const SharedKeys *sk =nullptr)      {writeValue(v, sk, nullptr);}
 
@@ -91,6 +171,26 @@ namespace fleece {
                         const SharedKeys *sk,
                         WriteValueFunc fn)                  {writeValue(v, sk, &fn);}
 
+        /** Controls how relayout() arranges values in the output. */
+        struct LayoutPolicy {
+            enum Order {
+                kDepthFirst,    ///< Each collection's contents are written contiguously before it
+                kHotFirst,      ///< Values on `hotPaths` are written closest to their parents
+            };
+            Order order {kDepthFirst};
+            std::vector<std::string> hotPaths;  ///< Paths (see Path) of often-read values,
+                                                ///< hottest first; used by kHotFirst
+            const SharedKeys *sharedKeys {nullptr}; ///< SharedKeys the source was encoded with
+        };
+
+        /** Writes a copy of the Value tree `root`, arranged for locality of reference rather than
+            in the order it was originally written. Nested collections are written before a
+            collection's scalar values, so the latter stay within narrow-pointer range of it; with
+            kHotFirst, the values along the hot paths are written after their colder siblings,
+            ending up next to their parents and to the root. The logical contents are unchanged. */
+        void relayout(const Value* NONNULL root, const LayoutPolicy&);
+        void relayout(const Value* NONNULL root)        {relayout(root, LayoutPolicy());}
+
 #ifdef __OBJC__
         /** Writes an Objective-C object. Supported classes are the ones allowed by
             NSJSONSerialization, as well as NSData. */
@@ -109,6 +209,28 @@ namespace fleece {
             the next outermost collection (or made the root if there is no collection active.) */
         void endArray();
 
+        /** Begins creating an array that starts with the items of `array`, followed by the values
+            written before endArray is called. If `array` is in the base (see setBase), it isn't
+            copied: the new values are written as a new segment of a segmented array, which
+            refers to the existing items in the base, so that appending to a large array in a
+            delta costs about as much as the values appended. */
+        void beginAppendingArray(const Value* NONNULL array, size_t reserve =0);
+
+        /** Adds the items of an array encoded by a different Encoder (without a base) to the
+            current array. The data before that array is copied verbatim, since its internal
+            pointers are relative; only the root array's items are rebased. This is used to
+            stitch together pieces of a big array that were encoded separately. If validateUTF8
+            is set, the strings in the array are checked. */
+        void appendArrayItems(slice encodedArray);
+
+        /** Writes an entire array of numbers, booleans or strings in one call. This produces the
+            same output as beginArray, a write call per item, and endArray, but faster. */
+        void writeArray(const int64_t *values, size_t count);
+        void writeArray(const double *values, size_t count);
+        void writeArray(const float *values, size_t count);
+        void writeArray(const bool *values, size_t count);
+        void writeArray(const slice *values, size_t count);
+
         //////// Writing dictionaries:
 
         /** Begins creating a dictionary. Until endDict is called, values written to the encoder
@@ -118,6 +240,11 @@ namespace fleece {
                             effect on the output but can speed up encoding slightly. */
         void beginDictionary(size_t reserve =0);
 
+        /** Like beginDictionary, but the caller promises to write the keys in the order they'll
+            be stored in: integer (shared) keys first, in increasing order, then string keys in
+            lexicographic order. That saves the encoder from having to sort them. */
+        void beginSortedDictionary(size_t reserve =0);
+
         /** Ends creating a dictionary. The dict is written to the output and added as a value to
             the next outermost collection (or made the root if there is no collection active.) */
         void endDictionary();
@@ -132,11 +259,47 @@ namespace fleece {
 
         /** Writes a string Value as a key to the current dictionary. */
         void writeKey(const Value* NONNULL);
-        void writeKey(const Value* NONNULL, SharedKeys*);
+        void writeKey(const Value* NONNULL, const SharedKeys*);
 
         /** Associates a SharedKeys object with this Encoder. The writeKey() methods that take
             strings will consult this object to possibly map the key to an integer. */
-        void setSharedKeys(SharedKeys *s) {_sharedKeys = s;}
+        void setSharedKeys(SharedKeys *s) {_sharedKeys = s; _keyMapSource = nullptr;}
+        SharedKeys* sharedKeys() const    {return _sharedKeys;}
+
+        /** Associates a pool of common string values with this Encoder. A string value found in
+            the pool (among its first kMaxSharedStrings entries) is written as a 2-byte reference
+            to it instead of its characters. The pool isn't modified; add strings to it yourself.
+            Readers must call Value::asString(const SharedKeys*) with the same pool. */
+        void setSharedValues(const SharedKeys *s) {_sharedValues = s;}
+        const SharedKeys* sharedValues() const    {return _sharedValues;}
+
+        /** Sets the pool that shared strings in Values given to writeValue() were encoded with,
+            if it isn't sharedValues(). Their indexes are then resolved and the strings written
+            anew. Copying a shared string without knowing its pool throws InvalidData. */
+        void setSourceSharedValues(const SharedKeys *s) {_sourceSharedValues = s;}
+
+        /** Associates a StringCompressor with this Encoder. String values at least
+            kMinCompressedStringSize bytes long will be written compressed, if that makes them
+            smaller. Readers must use the same compressor (see Value::asCompressedString.) */
+        void setStringCompressor(const StringCompressor *c) {_stringCompressor = c;}
+        const StringCompressor* stringCompressor() const    {return _stringCompressor;}
+
+        /** Sets the compressor that compressed strings in Values given to writeValue() were
+            written with, if it isn't stringCompressor(). They're then decompressed and written
+            anew. Copying a compressed string without knowing its compressor throws InvalidData. */
+        void setSourceStringCompressor(const StringCompressor *c) {_sourceStringCompressor = c;}
+
+        static const size_t kMinCompressedStringSize = 32;
+
+        /** Associates a BlobStore with this Encoder. Binary data values at least `minSize` bytes
+            long will be put in the store, and written as blob references (see writeBlobRef)
+            instead of being embedded in the document. */
+        void setBlobStore(BlobStore *store, size_t minSize =kDefaultMinBlobSize) {
+            _blobStore = store; _minBlobSize = minSize;
+        }
+        BlobStore* blobStore() const            {return _blobStore;}
+
+        static const size_t kDefaultMinBlobSize = 1024;
 
         //////// "<<" convenience operators;
 
@@ -164,14 +327,20 @@ namespace fleece {
         class valueArray : public std::vector<Value> {
         public:
             valueArray()                    { }
-            void reset(internal::tags t)    {tag = t; wide = false; keys.clear();}
+            void reset(internal::tags t)    {tag = t; wide = false; keysSorted = false; keys.clear();
+                                             appendTo = nullptr; keyCopies.clear();}
             internal::tags tag;
+            uint64_t generation;            // Distinguishes it from others opened at its depth
             bool wide;
+            bool keysSorted;
             std::vector<slice> keys;
+            const Value *appendTo;          // Base array being appended to (beginAppendingArray)
+            std::vector<alloc_slice> keyCopies; // Copies of keys whose output has been flushed
         };
 
         void addItem(Value v);
         void writeRawValue(slice rawValue, bool canInline =true);
+        void flushOutput();
         void writeValue(internal::tags, uint8_t buf[], size_t size, bool canInline =true);
         bool valueIsInBase(const Value *value NONNULL) const;
         void reuseBaseStrings(const Value* NONNULL);
@@ -180,18 +349,37 @@ namespace fleece {
         void writePointer(ssize_t pos);
         void writeSpecial(uint8_t special);
         void writeInt(uint64_t i, bool isShort, bool isUnsigned);
-        void _writeFloat(float);
+        static size_t encodeInt(uint8_t buf[], uint64_t i, bool isSmall, bool isUnsigned);
+        static size_t encodeDouble(uint8_t buf[], double, bool fitsInFloat);
+        static size_t encodeFloat(uint8_t buf[], float);
+        template <class T, class ENCODE>
+            void writeScalarArray(const T *values, size_t count, ENCODE encode);
         slice writeData(internal::tags, slice s);
         slice _writeString(slice);
+        bool writeCompressedString(slice);
+        void checkUTF8(slice);
+        void checkStringsUTF8(const Value* NONNULL);
         void addingKey();
         void addedKey(slice str);
+        void writeKeyFrom(int key, const SharedKeys* NONNULL);
         size_t nextWritePos();
         void sortDict(valueArray &items);
         void checkPointerWidths(valueArray *items NONNULL, size_t writePos);
+        size_t narrowExtraSize(const Value &item, size_t itemPos);
+        size_t stringSizeAt(ssize_t pos);
+        size_t copyString(ssize_t pos, size_t size);
         void fixPointers(valueArray *items NONNULL);
         void endCollection(internal::tags tag);
+        void endSegmentedArray();
+        Value popItem();
         void push(internal::tags tag, size_t reserve);
         void writeValue(const Value* NONNULL, const SharedKeys*, const WriteValueFunc*);
+        class HotPathNode;
+        void relayout(const Value* NONNULL, const LayoutPolicy&, const HotPathNode*);
+        void reorderItems(const std::vector<uint32_t> &writeOrder, size_t valuesPerItem);
+        struct SpliceScan;
+        bool spliceValue(const Value* NONNULL, const SharedKeys*);
+        bool scanSubtree(const Value* NONNULL, const SharedKeys*, SpliceScan&);
 
         Encoder(const Encoder&) = delete;
         Encoder& operator=(const Encoder&) = delete;
@@ -202,20 +390,31 @@ namespace fleece {
         valueArray *_items;     // Values of the currently-open array/dict; == &_stack[_stackDepth]
         std::vector<valueArray> _stack; // Stack of open arrays/dicts
         unsigned _stackDepth {0};    // Current depth of _stack
+        uint64_t _generation {0};    // Number of arrays/dicts begun, for Savepoint checks
         StringTable _strings;        // Maps strings to the offsets where they appear as values
         bool _uniqueStrings {true};  // Should strings be uniqued before writing?
+        bool _validateUTF8 {false};  // Should strings be checked for valid UTF-8?
         SharedKeys *_sharedKeys {nullptr};  // Client-provided key-to-int mapping
+        const SharedKeys *_sharedValues {nullptr}; // Client-provided pool of string values
+        const SharedKeys *_sourceSharedValues {nullptr}; // Pool of values given to writeValue
+        const StringCompressor *_stringCompressor {nullptr}; // Compresses long string values
+        const StringCompressor *_sourceStringCompressor {nullptr}; // Of values to writeValue
+        bool _streaming {false};     // Is output going to a sink (setOutputSink)?
+        BlobStore *_blobStore {nullptr};   // Where large binary data values are put
+        size_t _minBlobSize {kDefaultMinBlobSize}; // Min size of data to put in _blobStore
+        const SharedKeys *_keyMapSource {nullptr}; // Other mapping that _keyMap translates from
+        std::vector<int> _keyMap;    // Cached _keyMapSource keys -> _sharedKeys keys
+        size_t _keyMapSourceCount {0}, _keyMapTargetCount {0}; // Counts when _keyMap was valid
         slice _base;                 // Base Fleece data being appended to (if any)
+        const BaseStringIndex *_baseIndex {nullptr}; // Index of strings in _base (if any)
         bool _sortKeys      {true};  // Should dictionary keys be sorted?
+        bool _timeSorting   {false}; // Should sorting time be added to _stats?
         bool _writingKey    {false}; // True if Value being written is a key
         bool _blockedOnKey  {false}; // True if writes should be refused
 
+        Stats _stats {};             // Statistics, returned by stats()
+
         friend class EncoderTests;
-#ifndef NDEBUG
-    public: // Statistics for use in tests
-        unsigned _numNarrow {0}, _numWide {0}, _narrowCount {0}, _wideCount {0},
-                 _numSavedStrings {0};
-#endif
     };
 
 }
@@ -49,6 +49,7 @@ extern "C" {
     typedef struct _FLSharedKeys*  FLSharedKeys;    ///< A reference to a shared-keys mapping
     typedef struct _FLKeyPath*     FLKeyPath;       ///< A reference to a key path
     typedef struct _FLDeepIterator* FLDeepIterator; ///< A reference to a deep iterator
+    typedef struct _FLBaseStringIndex* FLBaseStringIndex; ///< An index of a delta base's strings
 #endif
 
     /** A simple reference to a block of memory. Does not imply ownership. */
@@ -108,7 +109,24 @@ extern "C" {
     int FLSlice_Compare(FLSlice, FLSlice);
 
 
-    /** Types of Fleece values. Basically JSON, with the addition of Data (raw blob). */
+    /** Custom memory allocation functions; see FLSetAllocator. Each is passed `context`, and
+        the size of the block. `allocate` and `reallocate` return NULL on failure. */
+    typedef struct {
+        void *context;
+        void* (*allocate)(void *context, size_t size);
+        void* (*reallocate)(void *context, void *ptr, size_t oldSize, size_t newSize);
+        void (*deallocate)(void *context, void *ptr, size_t size);
+    } FLAllocator;
+
+    /** Makes Fleece allocate its buffers (FLSliceResults, encoder output, hash tables) with
+        the given functions, or with malloc again if `allocator` is NULL. The struct is copied.
+        Memory is always freed through the functions that allocated it, so they must remain
+        usable until all of it has been freed. */
+    void FLSetAllocator(const FLAllocator *allocator);
+
+
+    /** Types of Fleece values. Basically JSON, with the addition of Data (raw blob), and of
+        values whose contents are stored outside the document. */
     typedef enum {
         kFLUndefined = -1,  // Type of a nullptr FLValue (i.e. no such value)
         kFLNull = 0,
@@ -117,7 +135,10 @@ extern "C" {
         kFLString,
         kFLData,
         kFLArray,
-        kFLDict
+        kFLDict,
+        kFLSharedString,    // A string in an external pool; see FLValue_AsSharedString
+        kFLCompressedString,// A string compressed with an external table (C++ API only)
+        kFLBlobRef,         // A reference to binary data stored elsewhere; see FLValue_AsBlobRef
     } FLValueType;
 
 
@@ -219,9 +240,19 @@ extern "C" {
     /** Returns the exact contents of a string value, or null for all other types. */
     FLString FLValue_AsString(FLValue);
 
-    /** Returns the exact contents of a data value, or null for all other types. */
+    /** Returns the contents of a kFLSharedString value, looked up in the pool of string values
+        it was encoded with; or null if it's some other type, or isn't in the pool. */
+    FLString FLValue_AsSharedString(FLValue, FLSharedKeys pool);
+
+    /** Returns the exact contents of a data value, or null for all other types (including
+        kFLBlobRef.) */
     FLSlice FLValue_AsData(FLValue);
 
+    /** If the value is a blob reference (kFLBlobRef), sets `digest` to the SHA-256 digest of the
+        blob's contents and `length` to its size in bytes, and returns true. The blob itself is
+        stored outside the document. Otherwise returns false. */
+    bool FLValue_AsBlobRef(FLValue, FLSlice *digest, uint64_t *length);
+
     /** If a FLValue represents an array, returns it cast to FLArray, else nullptr. */
     FLArray FLValue_AsArray(FLValue);
 
@@ -485,6 +516,16 @@ extern "C" {
     /** Tells the encoder to use a shared-keys mapping when encoding dictionary keys. */
     void FLEncoder_SetSharedKeys(FLEncoder, FLSharedKeys);
 
+    /** Tells a Fleece encoder to check that strings and keys are valid UTF-8; writing (or
+        converting JSON containing) one that isn't fails with kFLInvalidData. Off by default.
+        Has no effect on JSON encoders. */
+    void FLEncoder_SetValidateUTF8(FLEncoder, bool validate);
+
+    /** Tells a Fleece encoder to measure the time it spends sorting dictionary keys, reported
+        by FLEncoder_GetStats. Off by default, since it reads the clock for every dictionary.
+        Has no effect on JSON encoders. */
+    void FLEncoder_SetTimeSorting(FLEncoder, bool timeSorting);
+
     /** Associates an arbitrary user-defined value with the encoder. */
     void FLEncoder_SetExtraInfo(FLEncoder e, void *info);
 
@@ -500,6 +541,24 @@ extern "C" {
         be used by first appending it to the base data. */
     void FLEncoder_MakeDelta(FLEncoder e, FLSlice base, bool reuseStrings);
 
+    /** Like FLEncoder_MakeDelta with `reuseStrings` true, but instead of scanning the base for
+        strings it uses an index of them, which can be shared by any number of encoders. This is
+        much faster when the same base gets many deltas. The index must not be freed while the
+        encoder is in use. */
+    void FLEncoder_MakeDeltaWithIndex(FLEncoder e, FLBaseStringIndex);
+
+    /** Indexes the strings in a Fleece document, for use with FLEncoder_MakeDeltaWithIndex.
+        If `indexData` is non-null, it must be the result of FLBaseStringIndex_GetData for the same
+        base, and the index is reloaded from it instead of scanning the base.
+        The base data must remain valid, and unchanged, until the index is freed. */
+    FLBaseStringIndex FLBaseStringIndex_New(FLSlice base, FLSlice indexData, FLError *error);
+
+    /** Returns the index in a compact form that can be saved along with the base document. */
+    FLSliceResult FLBaseStringIndex_GetData(FLBaseStringIndex);
+
+    /** Frees an index created by FLBaseStringIndex_New. */
+    void FLBaseStringIndex_Free(FLBaseStringIndex);
+
     /** Resets the state of an encoder without freeing it. It can then be reused to encode
         another value. */
     void FLEncoder_Reset(FLEncoder);
@@ -566,6 +625,12 @@ extern "C" {
     /** Ends writing an array value; pops back the previous encoding state. */
     bool FLEncoder_EndArray(FLEncoder);
 
+    /** Begins writing an array that starts with the items of an existing array, followed by the
+        values written before FLEncoder_EndArray is called. When making a delta
+        (FLEncoder_MakeDelta) from a base that contains the array, only the new values are
+        written, so appending to a large array costs about as much as the values appended. */
+    bool FLEncoder_BeginAppendingArray(FLEncoder, FLValue array, size_t reserveCount);
+
 
     /** Begins writing a dictionary value to an encoder. This pushes a new state where each
         subsequent key and value written are added to the dictionary, until FLEncoder_EndDict is
@@ -600,6 +665,27 @@ extern "C" {
     /** Returns the number of bytes encoded so far. */
     size_t FLEncoder_BytesWritten(FLEncoder e);
 
+    /** Statistics about the data an encoder has written, for tuning its options. */
+    typedef struct {
+        uint64_t bytesByType[kFLDict+1];    ///< Bytes written per FLValueType (inline values
+                                            ///< count as part of their array/dict)
+        uint64_t stringsReused;             ///< Strings written as pointers to an earlier copy
+        uint64_t stringBytesSaved;          ///< Bytes those strings would otherwise have taken
+        uint64_t narrowCollections;         ///< Arrays/dicts with 2-byte items
+        uint64_t wideCollections;           ///< Arrays/dicts with 4-byte items
+        uint64_t narrowItems;               ///< Total items in narrow arrays/dicts
+        uint64_t wideItems;                 ///< Total items in wide arrays/dicts
+        uint64_t movedValues;               ///< Values moved out of line to keep arrays narrow
+        uint64_t splicedCollections;        ///< Collections copied verbatim from other data
+        uint64_t pointers[8];               ///< Pointers by distance: [i] is < 16^(i+1) bytes
+        uint64_t sortNanoseconds;           ///< Time spent sorting dictionary keys
+                                            ///< (only measured if FLEncoder_SetTimeSorting)
+    } FLEncoderStats;
+
+    /** Fills in statistics about the data encoded since the encoder was created or reset.
+        Returns false (leaving `stats` alone) if the encoder isn't generating Fleece. */
+    bool FLEncoder_GetStats(FLEncoder e, FLEncoderStats *stats);
+
     /** Ends encoding; if there has been no error, it returns the encoded data, else null.
         This does not free the FLEncoder; call FLEncoder_Free (or FLEncoder_Reset) next. */
     FLSliceResult FLEncoder_Finish(FLEncoder, FLError*);
@@ -22,9 +22,13 @@
 #error Using Fleece C++ API from C code. Please include Fleece.h instead.
 #endif
 
+#include "Allocator.hh"
 #include "Value.hh"
 #include "Array.hh"
 #include "Dict.hh"
 #include "Encoder.hh"
 #include "JSONConverter.hh"
 #include "SharedKeys.hh"
+#include "BaseStringIndex.hh"
+#include "StringCompressor.hh"
+#include "BlobStore.hh"
@@ -19,6 +19,7 @@
 #include "Fleece_C_impl.hh"
 #include "Fleece.h"
 #include "JSON5.hh"
+#include "Allocator.hh"
 
 
 namespace fleece {
@@ -28,6 +29,24 @@ namespace fleece {
             *outError = (FLError) FleeceException::getCode(x);
     }
 
+
+    // Adapts an FLAllocator to the Allocator interface.
+    class CAllocator : public Allocator {
+    public:
+        CAllocator(const FLAllocator &a)        :_a(a) { }
+        void* allocate(size_t size) override {
+            return _a.allocate(_a.context, size);
+        }
+        void* reallocate(void *ptr, size_t oldSize, size_t newSize) override {
+            return _a.reallocate(_a.context, ptr, oldSize, newSize);
+        }
+        void deallocate(void *ptr, size_t size) noexcept override {
+            _a.deallocate(_a.context, ptr, size);
+        }
+    private:
+        FLAllocator const _a;
+    };
+
 }
 
 
@@ -35,6 +54,12 @@ bool FLSlice_Equal(FLSlice a, FLSlice b)        {return (slice)a == (slice)b;}
 int FLSlice_Compare(FLSlice a, FLSlice b)       {return ((slice)a).compare((slice)b); }
 
 
+void FLSetAllocator(const FLAllocator *allocator) {
+    // Never deleted, since blocks it allocated may outlive the next call:
+    Allocator::setCurrent(allocator ? new CAllocator(*allocator) : nullptr);
+}
+
+
 static FLSliceResult toSliceResult(alloc_slice &&s) {
     s.retain();
     return {(void*)s.buf, s.size};
@@ -60,6 +85,24 @@ float FLValue_AsFloat(FLValue v)                {return v ? v->asFloat() : 0.0;}
 double FLValue_AsDouble(FLValue v)              {return v ? v->asDouble() : 0.0;}
 FLString FLValue_AsString(FLValue v)            {return v ? (FLString)v->asString() : kFLSliceNull;}
 FLSlice FLValue_AsData(FLValue v)               {return v ? (FLSlice)v->asData() : kFLSliceNull;}
+
+bool FLValue_AsBlobRef(FLValue v, FLSlice *digest, uint64_t *length) {
+    slice d;
+    if (!v || !v->asBlobRef(d, *length))
+        return false;
+    *digest = d;
+    return true;
+}
+
+FLString FLValue_AsSharedString(FLValue v, FLSharedKeys pool) {
+    if (v && pool && v->type() == kSharedString) {
+        try {
+            return (FLString)v->asString(pool);
+        } catchError(nullptr)
+    }
+    return kFLSliceNull;
+}
+
 FLArray FLValue_AsArray(FLValue v)              {return v ? v->asArray() : nullptr;}
 FLDict FLValue_AsDict(FLValue v)                {return v ? v->asDict() : nullptr;}
 
@@ -128,26 +171,26 @@ bool FLArray_IsEmpty(FLArray a)                      {return a ? a->empty() : tr
 FLValue FLArray_Get(FLArray a, uint32_t index)       {return a ? a->get(index) : nullptr;}
 
 void FLArrayIterator_Begin(FLArray a, FLArrayIterator* i) {
-    static_assert(sizeof(FLArrayIterator) >= sizeof(Array::iterator),"FLArrayIterator is too small");
-    new (i) Array::iterator(a);
+    static_assert(sizeof(FLArrayIterator) >= sizeof(Array::compactIterator),"FLArrayIterator is too small");
+    new (i) Array::compactIterator(a);
     // Note: this is safe even if a is null.
 }
 
 uint32_t FLArrayIterator_GetCount(const FLArrayIterator* i) {
-    return ((Array::iterator*)i)->count();
+    return ((Array::compactIterator*)i)->count();
 }
 
 FLValue FLArrayIterator_GetValue(const FLArrayIterator* i) {
-    return ((Array::iterator*)i)->value();
+    return ((Array::compactIterator*)i)->value();
 }
 
 FLValue FLArrayIterator_GetValueAt(const FLArrayIterator *i, uint32_t offset) {
-    return (*(Array::iterator*)i)[offset];
+    return (*(Array::compactIterator*)i)[offset];
 }
 
 bool FLArrayIterator_Next(FLArrayIterator* i) {
     try {
-        auto& iter = *(Array::iterator*)i;
+        auto& iter = *(Array::compactIterator*)i;
         ++iter;                 // throws if iterating past end
         return (bool)iter;
     } catchError(nullptr)
@@ -331,6 +374,16 @@ void FLEncoder_SetSharedKeys(FLEncoder e, FLSharedKeys sk) {
     ENCODER_DO(e, setSharedKeys(sk));
 }
 
+void FLEncoder_SetValidateUTF8(FLEncoder e, bool validate) {
+    if (e->isFleece())
+        e->fleeceEncoder->validateUTF8(validate);
+}
+
+void FLEncoder_SetTimeSorting(FLEncoder e, bool timeSorting) {
+    if (e->isFleece())
+        e->fleeceEncoder->timeSorting(timeSorting);
+}
+
 void FLEncoder_MakeDelta(FLEncoder e, FLSlice base, bool reuseStrings) {
     if (e->isFleece()) {
         e->fleeceEncoder->setBase(base);
@@ -339,10 +392,63 @@ void FLEncoder_MakeDelta(FLEncoder e, FLSlice base, bool reuseStrings) {
     }
 }
 
+void FLEncoder_MakeDeltaWithIndex(FLEncoder e, FLBaseStringIndex index) {
+    if (e->isFleece()) {
+        e->fleeceEncoder->setBase(index->base());
+        e->fleeceEncoder->reuseBaseStrings(*index);
+    }
+}
+
+FLBaseStringIndex FLBaseStringIndex_New(FLSlice base, FLSlice indexData, FLError *outError) {
+    try {
+        if (indexData.buf)
+            return new BaseStringIndex(base, indexData);
+        else
+            return new BaseStringIndex(base);
+    } catchError(outError)
+    return nullptr;
+}
+
+FLSliceResult FLBaseStringIndex_GetData(FLBaseStringIndex index) {
+    try {
+        return toSliceResult(index->data());
+    } catchError(nullptr)
+    return {};
+}
+
+void FLBaseStringIndex_Free(FLBaseStringIndex index) {
+    delete index;
+}
+
 size_t FLEncoder_BytesWritten(FLEncoder e) {
     return ENCODER_DO(e, bytesWritten());
 }
 
+bool FLEncoder_GetStats(FLEncoder e, FLEncoderStats *out) {
+    if (!e->isFleece())
+        return false;
+    auto &stats = e->fleeceEncoder->stats();
+    static_assert(sizeof(out->bytesByType) / sizeof(out->bytesByType[0]) == kDict+1,
+                  "FLEncoderStats.bytesByType is the wrong size");
+    static_assert(sizeof(out->pointers) / sizeof(out->pointers[0])
+                        == Encoder::Stats::kPointerBuckets,
+                  "FLEncoderStats.pointers is the wrong size");
+    for (int i = 0; i <= kDict; ++i)
+        out->bytesByType[i] = stats.bytesByType[i];
+    out->stringsReused = stats.stringsReused;
+    out->stringBytesSaved = stats.stringBytesSaved;
+    out->narrowCollections = stats.narrowCollections;
+    out->wideCollections = stats.wideCollections;
+    out->narrowItems = stats.narrowItems;
+    out->wideItems = stats.wideItems;
+    out->movedValues = stats.movedValues;
+    out->splicedCollections = stats.splicedCollections;
+    for (unsigned i = 0; i < Encoder::Stats::kPointerBuckets; ++i)
+        out->pointers[i] = stats.pointers[i];
+    out->sortNanoseconds = stats.sortNanoseconds;
+    return true;
+}
+
 bool FLEncoder_WriteNull(FLEncoder e)                    {ENCODER_TRY(e, writeNull());}
 bool FLEncoder_WriteBool(FLEncoder e, bool b)            {ENCODER_TRY(e, writeBool(b));}
 bool FLEncoder_WriteInt(FLEncoder e, int64_t i)          {ENCODER_TRY(e, writeInt(i));}
@@ -355,6 +461,8 @@ bool FLEncoder_WriteRaw(FLEncoder e, FLSlice r)          {ENCODER_TRY(e, writeRa
 
 bool FLEncoder_BeginArray(FLEncoder e, size_t reserve)   {ENCODER_TRY(e, beginArray(reserve));}
 bool FLEncoder_EndArray(FLEncoder e)                     {ENCODER_TRY(e, endArray());}
+bool FLEncoder_BeginAppendingArray(FLEncoder e, FLValue array, size_t reserve)
+                                                         {ENCODER_TRY(e, beginAppendingArray(array, reserve));}
 bool FLEncoder_BeginDict(FLEncoder e, size_t reserve)    {ENCODER_TRY(e, beginDictionary(reserve));}
 bool FLEncoder_WriteKey(FLEncoder e, FLSlice s)          {ENCODER_TRY(e, writeKey(s));}
 bool FLEncoder_EndDict(FLEncoder e)                      {ENCODER_TRY(e, endDictionary());}
@@ -21,6 +21,7 @@
 #include "JSONEncoder.hh"
 #include "Path.hh"
 #include "DeepIterator.hh"
+#include "BaseStringIndex.hh"
 #include "FleeceException.hh"
 using namespace fleece;
 
@@ -36,6 +37,7 @@ typedef FLEncoderImpl* FLEncoder;
 typedef SharedKeys* FLSharedKeys;
 typedef Path*       FLKeyPath;
 typedef DeepIterator* FLDeepIterator;
+typedef BaseStringIndex* FLBaseStringIndex;
 
 #include "Fleece.h" /* the C header */
 
@@ -31,6 +31,10 @@
  0001uccc iiiiiiii...    long integer (u = unsigned?; ccc = byte count - 1) LE integer follows
  0010s--- --------...    floating point (s = 0:float, 1:double). LE float data follows.
  0011ss-- --------       special (s = 0:null, 1:false, 2:true)
+ 001111ii iiiiiiii       shared string (i = 10-bit index into an external SharedKeys pool)
+ 00110001 -------- ...   compressed string (varint byte count, then StringCompressor output)
+ 00110010 -------- ...   blob reference (32-byte SHA-256 digest, then varint byte count)
+ 00110011 -------- ...   segmented array (wide pointer to array of segment arrays, then varint count)
  0100cccc ssssssss...    string (cccc is byte count, or if it’s 15 then count follows as varint)
  0101cccc dddddddd...    binary data (same as string)
  0110wccc cccccccc...    array (c = 11-bit item count, if 2047 then count follows as varint;
@@ -68,15 +72,25 @@ namespace fleece {
         // Interpretation of ss-- in a special value:
         enum {
             kSpecialValueNull = 0x00,       // 0000
+            kSpecialValueCompressedString = 0x01, // 0001
+            kSpecialValueBlobRef = 0x02,    // 0010
+            kSpecialValueSegmentedArray = 0x03, // 0011
             kSpecialValueFalse= 0x04,       // 0100
             kSpecialValueTrue = 0x08,       // 1000
+            kSpecialValueSharedString = 0x0C, // 11ii
         };
 
+        // Number of distinct indexes a shared string value can hold
+        static const int kMaxSharedStrings = 1024;
+
         // Min/max length of string that will be considered for sharing
         // (not part of the format, just a heuristic used by the encoder & Obj-C decoder)
         static const size_t kMinSharedStringSize =  2;
         static const size_t kMaxSharedStringSize = 15;
 
+        // Size of the digest in a blob reference
+        static const size_t kBlobRefDigestSize = 32;
+
         // Minimum array count that has to be stored outside the header
         static const uint32_t kLongArrayCount = 0x07FF;
 
@@ -17,41 +17,28 @@
 //
 
 #include "JSONConverter.hh"
+#include "Array.hh"
+#include "NumConversion.hh"
+#include "TempArray.hh"
 #include "jsonsl.h"
 #include <map>
+#include <algorithm>
+#include <system_error>
+#include <thread>
 
 namespace fleece {
 
-    static int errorCallback(struct jsonsl_st * jsn,
-                             jsonsl_error_t err,
-                             struct jsonsl_state_st *state,
-                             char *errat) noexcept;
-    static void writePushCallback(struct jsonsl_st * jsn,
-                                  jsonsl_action_t action,
-                                  struct jsonsl_state_st *state,
-                                  const char *buf) noexcept;
-    static void writePopCallback(struct jsonsl_st * jsn,
-                                 jsonsl_action_t action,
-                                 struct jsonsl_state_st *state,
-                                 const char *buf) noexcept;
-
     JSONConverter::JSONConverter(Encoder &e) noexcept
     :_encoder(e),
-     _jsn(jsonsl_new(50)),      // never returns nullptr, according to source code
      _jsonError(JSONSL_ERROR_SUCCESS),
      _errorPos(0)
-    {
-        _jsn->data = this;
-    }
+    { }
 
-    JSONConverter::~JSONConverter() {
-        jsonsl_destroy(_jsn);
-    }
+    JSONConverter::~JSONConverter() =default;
 
     void JSONConverter::reset() {
-        jsonsl_reset(_jsn);
-        _jsonError = JSONSL_ERROR_SUCCESS;
-        _errorPos = 0;
+        startDocument();
+        _feeding = false;
     }
 
     const char* JSONConverter::errorMessage() noexcept {
@@ -66,29 +53,236 @@ namespace fleece {
     }
 
 
-    bool JSONConverter::encodeJSON(slice json) {
-        _input = json;
+    void JSONConverter::startDocument() {
         _errorMessage.clear();
         _errorCode = NoError;
         _jsonError = JSONSL_ERROR_SUCCESS;
         _errorPos = 0;
+        _state = kValue;
+        _depth = 0;
+        _inputStart = 0;
+        _pending.clear();
+        _stringResume = 0;
+        _stringEscaped = false;
+    }
+
+
+    bool JSONConverter::encodeJSON(slice json) {
+        startDocument();
+        _feeding = false;
+        return parseChunk(json, true);
+    }
+
+
+    bool JSONConverter::feed(slice chunk) {
+        if (!_feeding) {
+            startDocument();
+            _feeding = true;
+        } else if (_jsonError) {
+            return false;
+        }
+        if (_pending.empty())
+            return parseChunk(chunk, false);
+        _pending.append((const char*)chunk.buf, chunk.size);
+        return parseChunk(slice(_pending), false);
+    }
+
+
+    bool JSONConverter::finish() {
+        if (!_feeding)
+            startDocument();
+        _feeding = false;
+        if (_jsonError)
+            return false;
+        return parseChunk(slice(_pending), true);
+    }
+
+
+    // Parses `input`, which is the entire rest of the document if `final` is true. Otherwise
+    // the incomplete token at the end, if any, is saved in _pending.
+    bool JSONConverter::parseChunk(slice input, bool final) {
+        _input = input;
+        _final = final;
+        _index.start(input);
+        size_t consumed;
+        if (!parse(consumed))
+            return false;
+        if (final) {
+            _pending.clear();
+        } else {
+            _inputStart += consumed;
+            if (input.buf == _pending.data())
+                _pending.erase(0, consumed);
+            else
+                _pending.assign((const char*)input.buf + consumed, input.size - consumed);
+        }
+        return true;
+    }
+
+
+#pragma mark - PARALLEL CONVERSION:
+
+
+    // Each thread gets at least this much JSON to convert:
+    static const size_t kMinParallelChunkSize = 256 * 1024;
+
+    static inline bool isJSONWhitespace(char c) {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    // Quickly scans a JSON array, without validating it, and picks up to `nChunks` runs of
+    // elements of roughly equal size. On success, `bounds` holds the position of the opening
+    // '[', then those of the commas that separate the runs, then that of the closing ']'.
+    static bool splitJSONArray(slice json, size_t nChunks, std::vector<size_t> &bounds) {
+        auto s = (const char*)json.buf;
+        size_t size = json.size, i = 0;
+        while (i < size && isJSONWhitespace(s[i]))
+            ++i;
+        if (i >= size || s[i] != '[')
+            return false;
+        bounds.push_back(i);
+        size_t chunkSize = (size - i) / nChunks;
+        size_t nextSplit = i + chunkSize;
+        int depth = 0;
+        for (++i; i < size; ++i) {
+            switch (s[i]) {
+                case '"':
+                    for (++i; i < size && s[i] != '"'; ++i) {
+                        if (s[i] == '\\')
+                            ++i;
+                    }
+                    break;
+                case '[':
+                case '{':
+                    ++depth;
+                    break;
+                case ']':
+                case '}':
+                    if (--depth < 0) {
+                        bounds.push_back(i);
+                        for (++i; i < size; ++i)
+                            if (!isJSONWhitespace(s[i]))
+                                return false;
+                        return true;
+                    }
+                    break;
+                case ',':
+                    if (depth == 0 && i >= nextSplit) {
+                        bounds.push_back(i);
+                        nextSplit = i + chunkSize;
+                    }
+                    break;
+            }
+        }
+        return false;
+    }
 
-        _jsn->data = this;
-        _jsn->action_callback_PUSH = writePushCallback;
-        _jsn->action_callback_POP  = writePopCallback;
-        _jsn->error_callback = errorCallback;
-        jsonsl_enable_all_callbacks(_jsn);
+    namespace {
+        // The result of converting one run of array elements on a worker thread.
+        struct ConvertedChunk {
+            alloc_slice fleece;
+            int jsonError {0};
+            ErrorCode errorCode {NoError};
+            std::string errorMessage;
+            size_t errorPos {0};
+
+            // Encodes the JSON array elements in `json`, with the same options as `like`.
+            void convert(slice json, const Encoder *like) {
+                // Wrap the elements in brackets to make a JSON array:
+                std::string buf;
+                buf.reserve(json.size + 2);
+                buf += '[';
+                buf.append((const char*)json.buf, json.size);
+                buf += ']';
+                try {
+                    Encoder enc(json.size);
+                    enc.uniqueStrings(like->uniqueStrings());
+                    enc.sortKeys(like->sortKeys());
+                    enc.validateUTF8(like->validateUTF8());
+                    JSONConverter cvt(enc);
+                    if (cvt.encodeJSON(slice(buf))) {
+                        fleece = enc.extractOutput();
+                    } else {
+                        jsonError = cvt.jsonError();
+                        errorCode = cvt.errorCode();
+                        errorMessage = cvt.errorMessage();
+                        errorPos = cvt.errorPos();
+                    }
+                } catch (const FleeceException &x) {
+                    jsonError = JSONConverter::kErrExceptionThrown;
+                    errorCode = x.code;
+                    errorMessage = x.what();
+                } catch (...) {
+                    jsonError = JSONConverter::kErrExceptionThrown;
+                    errorCode = InternalError;
+                    errorMessage = "Unexpected C++ exception";
+                }
+            }
+        };
+    }
+
+    bool JSONConverter::encodeJSONParallel(slice json, unsigned maxThreads) {
+        if (maxThreads == 0)
+            maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        size_t nChunks = std::min((size_t)maxThreads, json.size / kMinParallelChunkSize);
+        std::vector<size_t> bounds;
+        // Pieces are stitched together verbatim, which doesn't work if their strings or keys
+        // would have to be put in a pool or store shared with this encoder:
+        if (nChunks < 2 || _encoder.sharedKeys() || _encoder.sharedValues()
+                        || _encoder.stringCompressor() || _encoder.blobStore()
+                        || !splitJSONArray(json, nChunks, bounds) || bounds.size() < 3)
+            return encodeJSON(json);
+
+        // Convert each run of elements on its own thread (the first one on this thread):
+        nChunks = bounds.size() - 1;
+        std::vector<ConvertedChunk> chunks(nChunks);
+        std::vector<std::thread> threads;
+        auto runOf = [&](size_t i) {
+            return slice(offsetby(json.buf, bounds[i] + 1), bounds[i+1] - bounds[i] - 1);
+        };
+        threads.reserve(nChunks - 1);
+        size_t nStarted = 1;
+        try {
+            for (; nStarted < nChunks; ++nStarted)
+                threads.emplace_back(&ConvertedChunk::convert, &chunks[nStarted], runOf(nStarted),
+                                     &_encoder);
+        } catch (const std::system_error&) {
+            // Couldn't start another thread; the runs left over are converted on this one.
+        }
+        chunks[0].convert(runOf(0), &_encoder);
+        for (size_t i = nStarted; i < nChunks; ++i)
+            chunks[i].convert(runOf(i), &_encoder);
+        for (auto &thread : threads)
+            thread.join();
 
-        jsonsl_feed(_jsn, (char*)json.buf, json.size);
-        if (_jsn->level > 0 && !_jsonError) {
-            // Input is valid JSON so far, but truncated:
-            _jsonError = kErrTruncatedJSON;
-            _errorPos = json.size;
+        _input = json;
+        _errorMessage.clear();
+        _errorCode = NoError;
+        _jsonError = JSONSL_ERROR_SUCCESS;
+        _errorPos = 0;
+        for (size_t i = 0; i < nChunks; ++i) {
+            auto &chunk = chunks[i];
+            if (chunk.jsonError) {
+                _jsonError = chunk.jsonError;
+                _errorCode = chunk.errorCode;
+                _errorMessage = chunk.errorMessage;
+                _errorPos = bounds[i] + chunk.errorPos;   // chunk's '[' is at bounds[i]
+                return false;
+            }
         }
-        jsonsl_reset(_jsn);
-        return (_jsonError == JSONSL_ERROR_SUCCESS);
+
+        // Stitch the pieces together:
+        size_t count = 0;
+        for (auto &chunk : chunks)
+            count += Value::fromTrustedData(chunk.fleece)->asArray()->count();
+        _encoder.beginArray(count);
+        for (auto &chunk : chunks)
+            _encoder.appendArrayItems(chunk.fleece);
+        _encoder.endArray();
+        return true;
     }
 
+
     /*static*/ alloc_slice JSONConverter::convertJSON(slice json, SharedKeys *sk) {
         Encoder enc;
         enc.setSharedKeys(sk);
@@ -97,136 +291,325 @@ namespace fleece {
         return enc.extractOutput();
     }
 
-    inline void JSONConverter::push(struct jsonsl_state_st *state) {
-        switch (state->type) {
-            case JSONSL_T_LIST:
-                _encoder.beginArray();
-                break;
-            case JSONSL_T_OBJECT:
-                _encoder.beginDictionary();
-                break;
+
+#pragma mark - PARSING:
+
+
+    // True if `c` may follow a number or true/false/null.
+    static inline bool isDelimiter(char c) {
+        switch (c) {
+            case ' ': case '\t': case '\n': case '\r':
+            case ',': case ':': case '[': case ']': case '{': case '}':
+                return true;
+            default:
+                return false;
         }
     }
 
-    inline void JSONConverter::pop(struct jsonsl_state_st *state) {
-        switch (state->type) {
-            case JSONSL_T_SPECIAL: {
-                unsigned f = state->special_flags;
-                if (f & JSONSL_SPECIALf_FLOAT) {
-                    char *start = (char*)&_input[state->pos_begin];
-                    char *end;
-                    double n = ::strtod(start, &end);
-                    _encoder.writeDouble(n);
-                } else if (f & JSONSL_SPECIALf_UNSIGNED) {
-                    _encoder.writeUInt(state->nelem);
-                } else if (f & JSONSL_SPECIALf_SIGNED) {
-                    _encoder.writeInt(-(int64_t)state->nelem);
-                } else if (f & JSONSL_SPECIALf_TRUE) {
-                    _encoder.writeBool(true);
-                } else if (f & JSONSL_SPECIALf_FALSE) {
-                    _encoder.writeBool(false);
-                } else if (f & JSONSL_SPECIALf_NULL) {
-                    _encoder.writeNull();
-                }
-                break;
-            }
-            case JSONSL_T_STRING:
-            case JSONSL_T_HKEY: {
-                slice str(&_input[state->pos_begin + 1],
-                          state->pos_cur - state->pos_begin - 1);
-                char *buf = nullptr;
-                bool mallocedBuf = false;
-                if (state->nescapes > 0) {
-                    // De-escape str:
-                    mallocedBuf = str.size > 100;
-                    buf = (char*)(mallocedBuf ? malloc(str.size) : alloca(str.size));
-                    jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
-                    const char *errat;
-                    auto size = jsonsl_util_unescape_ex((const char*)str.buf, buf, str.size,
-                                                        nullptr, nullptr, &err, &errat);
-                    if (err) {
-                        errorCallback(_jsn, err, state, (char*)errat);
-                        if (mallocedBuf)
-                            free(buf);
-                        return;
+    static inline bool isDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static inline bool isNumberChar(char c) {
+        return isDigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+    }
+
+
+    // Walks the structural index, parsing each token and writing it to the encoder. Parse
+    // state lives in member variables, so that if the input isn't final, parsing can stop
+    // before an incomplete token at the end and resume with the next chunk. On return,
+    // `consumed` is the number of bytes of input fully parsed.
+    bool JSONConverter::parse(size_t &consumed) {
+        auto s = (const char*)_input.buf;
+        const size_t size = _input.size;
+        size_t pos = 0;
+        try {
+            for (pos = _index.next(); pos < size; pos = _index.next()) {
+                const char c = s[pos];
+                bool ok = true;
+                switch (_state) {
+                    case kValueOrEnd:
+                        if (c == ']') {
+                            _encoder.endArray();
+                            --_depth;
+                            _state = kNext;
+                            break;
+                        }
+                        // fall through
+                    case kValue:
+                        ok = parseValue(pos);
+                        break;
+                    case kKeyOrEnd:
+                        if (c == '}') {
+                            _encoder.endDictionary();
+                            --_depth;
+                            _state = kNext;
+                            break;
+                        }
+                        // fall through
+                    case kKey:
+                        if (_usuallyFalse(c != '"'))
+                            ok = unexpected(pos);
+                        else if ((ok = parseString(pos, true)))
+                            _state = kColon;
+                        break;
+                    case kColon:
+                        if (_usuallyFalse(c != ':'))
+                            ok = gotError(JSONSL_ERROR_MISSING_TOKEN, pos);
+                        else
+                            _state = kValue;
+                        break;
+                    case kNext: {
+                        if (_usuallyFalse(_depth == 0)) {
+                            ok = gotError(JSONSL_ERROR_GARBAGE_TRAILING, pos);
+                            break;
+                        }
+                        char open = _containers[_depth - 1];
+                        if (c == ',') {
+                            _state = (open == '[') ? kValue : kKey;
+                        } else if (c == open + 2) {     // ']' is '[' + 2, '}' is '{' + 2
+                            if (open == '[')
+                                _encoder.endArray();
+                            else
+                                _encoder.endDictionary();
+                            --_depth;
+                        } else {
+                            ok = unexpected(pos);
+                        }
+                        break;
                     }
-                    str = slice(buf, size);
                 }
-                if (state->type == JSONSL_T_STRING)
-                    _encoder.writeString(str);
-                else
-                    _encoder.writeKey(str);
-                if (mallocedBuf)
-                    free(buf);
-                break;
+                if (_usuallyFalse(!ok)) {
+                    if (_jsonError)
+                        return false;
+                    consumed = pos;             // incomplete token; resume here next time
+                    return true;
+                }
             }
-            case JSONSL_T_LIST:
-                _encoder.endArray();
+        } catch (const FleeceException &x) {
+            gotException(x.code, x.what(), pos);
+            return false;
+        } catch (...) {
+            gotException(InternalError, nullptr, pos);
+            return false;
+        }
+
+        consumed = size;
+        if (!_final || (_depth == 0 && (_state == kNext || _state == kValue)))
+            return true;                        // (kValue at depth 0 means empty input)
+        return gotError(kErrTruncatedJSON, size);
+    }
+
+
+    // Parses the value starting at `pos`. Returns false on error, or without setting an error
+    // if the value is incomplete.
+    bool JSONConverter::parseValue(size_t pos) {
+        switch (((const char*)_input.buf)[pos]) {
+            case '[':
+                if (_usuallyFalse(_depth == kMaxDepth))
+                    return gotError(JSONSL_ERROR_LEVELS_EXCEEDED, pos);
+                _encoder.beginArray();
+                _containers[_depth++] = '[';
+                _state = kValueOrEnd;
+                return true;
+            case '{':
+                if (_usuallyFalse(_depth == kMaxDepth))
+                    return gotError(JSONSL_ERROR_LEVELS_EXCEEDED, pos);
+                _encoder.beginDictionary();
+                _containers[_depth++] = '{';
+                _state = kKeyOrEnd;
+                return true;
+            case '"':
+                if (!parseString(pos, false))
+                    return false;
+                break;
+            case 't': case 'f': case 'n':
+                if (!parseLiteral(pos))
+                    return false;
                 break;
-            case JSONSL_T_OBJECT:
-                _encoder.endDictionary();
+            case '-': case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                if (!parseNumber(pos))
+                    return false;
                 break;
+            default:
+                return unexpected(pos);
         }
+        _state = kNext;
+        return true;
     }
 
-    int JSONConverter::gotError(int err, size_t pos) noexcept {
-        _jsonError = err;
-        _errorPos = pos;
-        _errorCode = JSONError;
-        jsonsl_stop(_jsn);
-        return 0;
-    }
 
-    int JSONConverter::gotError(int err, const char *errat) noexcept {
-        return gotError(err, errat - (char*)_input.buf);
-    }
+    bool JSONConverter::parseString(size_t pos, bool isKey) {
+        auto start = (const uint8_t*)_input.buf + pos + 1, end = (const uint8_t*)_input.end();
+        auto p = start + _stringResume;         // (skip what an earlier chunk already scanned)
+        bool escaped = _stringEscaped;
+        for (;;) {
+            p = StructuralIndex::findQuoteOrBackslash(p, end);
+            if (p < end && *p == '"')
+                break;
+            if (p == end || end - p < 2) {
+                // The string isn't terminated (yet):
+                if (_final)
+                    return gotError(kErrTruncatedJSON, _input.size);
+                _stringResume = p - start;
+                _stringEscaped = escaped;
+                return false;
+            }
+            escaped = true;
+            p += 2;
+        }
+        _stringResume = 0;
+        _stringEscaped = false;
+        slice str(start, p);
 
-    void JSONConverter::gotException(ErrorCode code, const char *what, size_t pos) noexcept {
-        gotError(kErrExceptionThrown, pos);
-        _errorCode = code;
-        _errorMessage = what;
+        if (_usuallyFalse(escaped)) {
+            TempArray(buf, char, str.size);
+            jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+            const char *errat;
+            auto size = jsonsl_util_unescape_ex((const char*)str.buf, buf, str.size,
+                                                nullptr, nullptr, &err, &errat);
+            if (err)
+                return gotError(err, errat - (const char*)_input.buf);
+            str = slice(buf, size);
+            if (isKey)
+                _encoder.writeKey(str);
+            else
+                _encoder.writeString(str);
+        } else {
+            if (isKey)
+                _encoder.writeKey(str);
+            else
+                _encoder.writeString(str);
+        }
+        return true;
     }
 
-    // Callbacks:
 
-    static inline JSONConverter* converter(jsonsl_t jsn) noexcept {
-        return (JSONConverter*)jsn->data;
+    bool JSONConverter::parseNumber(size_t pos) {
+        auto s = (const char*)_input.buf;
+        const char *start = s + pos, *p = start, *end = (const char*)_input.end();
+        if (!_final) {
+            // If the number runs to the end of the input, more digits may be in the next chunk:
+            auto tokenEnd = start;
+            while (tokenEnd < end && isNumberChar(*tokenEnd))
+                ++tokenEnd;
+            if (tokenEnd == end)
+                return false;
+        }
+        bool negative = (*p == '-');
+        if (negative)
+            ++p;
+        if (p == end || !isDigit(*p))
+            return gotError(JSONSL_ERROR_INVALID_NUMBER, p - s);
+
+        // Integer part (no leading zeroes), accumulated while it fits in 64 bits:
+        uint64_t n = 0;
+        bool overflow = false;
+        if (*p == '0') {
+            ++p;
+        } else {
+            for (; p < end && isDigit(*p); ++p) {
+                unsigned digit = *p - '0';
+                if (n > (UINT64_MAX - digit) / 10)
+                    overflow = true;
+                n = 10 * n + digit;
+            }
+        }
+        bool isFloat = false;
+        if (p < end && *p == '.') {
+            isFloat = true;
+            if (++p == end || !isDigit(*p))
+                return gotError(JSONSL_ERROR_INVALID_NUMBER, p - s);
+            while (p < end && isDigit(*p))
+                ++p;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            isFloat = true;
+            if (++p < end && (*p == '+' || *p == '-'))
+                ++p;
+            if (p == end || !isDigit(*p))
+                return gotError(JSONSL_ERROR_INVALID_NUMBER, p - s);
+            while (p < end && isDigit(*p))
+                ++p;
+        }
+        if (p < end && !isDelimiter(*p))
+            return gotError(JSONSL_ERROR_INVALID_NUMBER, p - s);
+
+        if (!isFloat && !overflow) {
+            if (!negative)
+                _encoder.writeUInt(n);
+            else if (n <= (uint64_t)INT64_MAX)
+                _encoder.writeInt(-(int64_t)n);
+            else if (n == (uint64_t)INT64_MAX + 1)
+                _encoder.writeInt(INT64_MIN);
+            else
+                isFloat = true;
+        }
+        if (isFloat || overflow) {
+            bool fitsInFloat;
+            double d = ParseDouble(slice(start, p), &fitsInFloat);
+            _encoder.writeDouble(d, fitsInFloat);
+        }
+        return true;
     }
-    
-    static void writePushCallback(jsonsl_t jsn,
-                                  jsonsl_action_t action,
-                                  struct jsonsl_state_st *state,
-                                  const char *buf) noexcept
-    {
-        try {
-            converter(jsn)->push(state);
-        } catch (const FleeceException &x) {
-            converter(jsn)->gotException(x.code, x.what(), state->pos_begin);
-        } catch (...) {
-            converter(jsn)->gotException(InternalError, nullptr, state->pos_begin);
+
+
+    bool JSONConverter::parseLiteral(size_t pos) {
+        auto s = (const char*)_input.buf;
+        slice literal;
+        switch (s[pos]) {
+            case 't':   literal = "true"_sl; break;
+            case 'f':   literal = "false"_sl; break;
+            default:    literal = "null"_sl; break;
+        }
+        const size_t avail = _input.size - pos;
+        if (memcmp(s + pos, literal.buf, std::min(literal.size, avail)) != 0)
+            return gotError(JSONSL_ERROR_SPECIAL_EXPECTED, pos);
+        if (avail <= literal.size) {
+            if (!_final)
+                return false;                   // the rest may be in the next chunk
+            if (avail < literal.size)
+                return gotError(JSONSL_ERROR_SPECIAL_EXPECTED, pos);
+        } else if (!isDelimiter(s[pos + literal.size])) {
+            return gotError(JSONSL_ERROR_SPECIAL_EXPECTED, pos);
         }
+        switch (s[pos]) {
+            case 't':   _encoder.writeBool(true); break;
+            case 'f':   _encoder.writeBool(false); break;
+            default:    _encoder.writeNull(); break;
+        }
+        return true;
     }
 
-    static void writePopCallback(jsonsl_t jsn,
-                                 jsonsl_action_t action,
-                                 struct jsonsl_state_st *state,
-                                 const char *buf) noexcept
-    {
-        try {
-            converter(jsn)->pop(state);
-        } catch (const FleeceException &x) {
-            converter(jsn)->gotException(x.code, x.what(), state->pos_begin);
-        } catch (...) {
-            converter(jsn)->gotException(InternalError, nullptr, state->pos_begin);
+
+    // Reports an unexpected token at `pos`.
+    bool JSONConverter::unexpected(size_t pos) {
+        if (_input[pos] == '"') {
+            // If it's a string that runs off the end, the JSON was truncated (or, if more input
+            // is coming, it's too soon to tell):
+            auto p = (const uint8_t*)_input.buf + pos + 1, end = (const uint8_t*)_input.end();
+            while ((p = StructuralIndex::findQuoteOrBackslash(p, end)) < end && *p != '"')
+                p += 2;
+            if (p >= end)
+                return _final ? gotError(kErrTruncatedJSON, _input.size) : false;
         }
+        return gotError(JSONSL_ERROR_STRAY_TOKEN, pos);
     }
 
-    static int errorCallback(jsonsl_t jsn,
-                             jsonsl_error_t err,
-                             struct jsonsl_state_st *state,
-                             char *errat) noexcept
-    {
-        return converter(jsn)->gotError(err, errat);
+
+    bool JSONConverter::gotError(int err, size_t pos) noexcept {
+        _jsonError = err;
+        _errorPos = _inputStart + pos;
+        _errorCode = JSONError;
+        return false;
+    }
+
+    void JSONConverter::gotException(ErrorCode code, const char *what, size_t pos) noexcept {
+        gotError(kErrExceptionThrown, pos);
+        _errorCode = code;
+        if (what)
+            _errorMessage = what;
     }
 
 }
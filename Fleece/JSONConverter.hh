@@ -20,27 +20,48 @@
 
 #include "Encoder.hh"
 #include "FleeceException.hh"
+#include "StructuralIndex.hh"
 #include "slice.hh"
 #include <vector>
 #include <map>
 
-extern "C" {
-    struct jsonsl_state_st;
-    struct jsonsl_st;
-}
-
 namespace fleece {
 
-    /** Parses JSON data and writes the values in it to a Fleece encoder. */
+    /** Parses JSON data and writes the values in it to a Fleece encoder.
+        The parser first finds the positions of all structural characters and tokens using
+        SIMD instructions (see StructuralIndex), then walks those positions, parsing each token
+        and calling the encoder directly. */
     class JSONConverter {
     public:
         JSONConverter(Encoder&) noexcept;
         ~JSONConverter();
 
         /** Parses JSON data and writes the values to the encoder.
+            If the encoder validates UTF-8 (Encoder::validateUTF8), a string that isn't valid
+            UTF-8 fails with error code InvalidData at the string's position.
             @return  True if parsing succeeded, false if the JSON is invalid. */
         bool encodeJSON(slice json);
 
+        /** Parses the next piece of a JSON document that's arriving incrementally, as from a
+            socket or file, and writes the values completed so far to the encoder. Pieces can
+            be split anywhere, even inside a string or number: the incomplete token at the end
+            is copied, and completed by the next piece. Call finish() after the last piece.
+            @return  False if the JSON is invalid. */
+        bool feed(slice chunk);
+
+        /** Completes the document begun by feed() calls.
+            @return  True if the JSON was valid and complete, false if not. */
+        bool finish();
+
+        /** Like encodeJSON, but if the JSON is a large array, it's split into runs of elements
+            that are converted on separate threads and then stitched together. Any other JSON is
+            converted serially, as is everything if the Encoder has SharedKeys, shared values, a
+            StringCompressor or a BlobStore (since the pieces are stitched together verbatim.)
+            The Encoder's uniqueStrings, sortKeys and validateUTF8 options apply to every piece.
+            @param maxThreads  The maximum number of threads to use; 0 means one per CPU core.
+            @return  True if parsing succeeded, false if the JSON is invalid. */
+        bool encodeJSONParallel(slice json, unsigned maxThreads =0);
+
         /** See jsonsl_error_t for error codes, plus a few more defined below. */
         int jsonError() noexcept                {return _jsonError;}
         ErrorCode errorCode() noexcept          {return _errorCode;}
@@ -61,23 +82,49 @@ namespace fleece {
         /** Convenience method to convert JSON to Fleece data. Throws FleeceException on error. */
         static alloc_slice convertJSON(slice json, SharedKeys *sk =nullptr);
 
-    //private:
-        void push(struct jsonsl_state_st *state NONNULL);
-        void pop(struct jsonsl_state_st *state NONNULL);
-        int gotError(int err, size_t pos) noexcept;
-        int gotError(int err, const char *errat NONNULL) noexcept;
-        void gotException(ErrorCode code, const char *what NONNULL, size_t pos) noexcept;
+        /** The maximum nesting depth of arrays and objects. */
+        static const unsigned kMaxDepth = 50;
 
     private:
         typedef std::map<size_t, uint64_t> startToLengthMap;
 
+        // What the parser expects next:
+        enum State : uint8_t {
+            kValue,                         // a value
+            kValueOrEnd,                    // a value or ']'
+            kKey,                           // a key
+            kKeyOrEnd,                      // a key or '}'
+            kColon,                         // ':' after a key
+            kNext,                          // ',' or the end of the container, after a value
+        };
+
+        void startDocument();
+        bool parseChunk(slice input, bool final);
+        bool parse(size_t &consumed);
+        bool parseValue(size_t pos);
+        bool parseString(size_t pos, bool isKey);
+        bool parseNumber(size_t pos);
+        bool parseLiteral(size_t pos);
+        bool unexpected(size_t pos);
+        bool gotError(int err, size_t pos) noexcept;
+        void gotException(ErrorCode code, const char *what, size_t pos) noexcept;
+
         Encoder &_encoder;                  // encoder to write to
-        struct jsonsl_st * _jsn {nullptr};  // JSON parser
-        int _jsonError {0};                 // Parse error from jsonsl
+        StructuralIndex _index;             // Finds structural characters & tokens in _input
+        int _jsonError {0};                 // Parse error (jsonsl_error_t or kErr...)
         ErrorCode _errorCode {NoError};
         std::string _errorMessage;
         size_t _errorPos {0};               // Byte index where parse error occurred
         slice _input;                       // Current JSON being parsed
+        bool _final {true};                 // True if _input extends to the end of the JSON
+        bool _feeding {false};              // True between the first feed() and finish()
+        State _state {kValue};
+        unsigned _depth {0};                // Number of open containers
+        char _containers[kMaxDepth];        // '[' or '{' for each open container
+        size_t _inputStart {0};             // Offset of _input in the whole document
+        std::string _pending;               // Incomplete token carried over to the next feed()
+        size_t _stringResume {0};           // Where to resume scanning an incomplete string
+        bool _stringEscaped {false};        // True if that string has escape sequences
     };
 
 }
@@ -18,45 +18,53 @@
 
 #include "JSONEncoder.hh"
 #include "Fleece.hh"
+#include "StructuralIndex.hh"
 #include <algorithm>
 
 namespace fleece {
 
+    // The escape sequence for each ASCII character, or an empty one if it isn't escaped.
+    struct Escape {
+        uint8_t size;
+        char chars[7];
+    };
+
+    static const Escape* escapeTable() {
+        static Escape sTable[128];
+        static const char kHexDigits[] = "0123456789abcdef";
+        for (unsigned ch = 0; ch < 128; ++ch) {
+            if (ch < 32 || ch == 127) {
+                Escape &e = sTable[ch];
+                e.size = 6;
+                memcpy(e.chars, "\\u00", 4);
+                e.chars[4] = kHexDigits[ch >> 4];
+                e.chars[5] = kHexDigits[ch & 0xF];
+            }
+        }
+        sTable[(uint8_t)'"']  = {2, "\\\""};
+        sTable[(uint8_t)'\\'] = {2, "\\\\"};
+        sTable[(uint8_t)'\r'] = {2, "\\r"};
+        sTable[(uint8_t)'\n'] = {2, "\\n"};
+        sTable[(uint8_t)'\t'] = {2, "\\t"};
+        return sTable;
+    }
+
     void JSONEncoder::writeString(slice str) {
+        static const Escape *sEscapes = escapeTable();
         comma();
         _out << '"';
-        auto start = (const uint8_t*)str.buf;
+        auto p = (const uint8_t*)str.buf;
         auto end = (const uint8_t*)str.end();
-        for (auto p = start; p < end; p++) {
-            uint8_t ch = *p;
-            if (ch == '"' || ch == '\\' || ch < 32 || ch == 127) {
-                // Write characters from start up to p-1:
-                _out.write({start, p});
-                start = p + 1;
-                switch (ch) {
-                    case '"':
-                    case '\\':
-                        _out << '\\';
-                        --start; // ch will be written in next pass
-                        break;
-                    case '\r':
-                        _out.write("\\r"_sl);
-                        break;
-                    case '\n':
-                        _out.write("\\n"_sl);
-                        break;
-                    case '\t':
-                        _out.write("\\t"_sl);
-                        break;
-                    default: {
-                        char buf[7];
-                        _out.write(buf, sprintf(buf, "\\u%04x", (unsigned)ch));
-                        break;
-                    }
-                }
-            }
+        while (true) {
+            // Copy the run of characters that don't need escaping, then escape the next one:
+            auto next = StructuralIndex::findCharToEscape(p, end);
+            _out.write({p, next});
+            if (next == end)
+                break;
+            const Escape &escape = sEscapes[*next];
+            _out.write(escape.chars, escape.size);
+            p = next + 1;
         }
-        _out.write({start, end});
         _out << '"';
     }
 
@@ -121,6 +129,31 @@ namespace fleece {
     }
 
 
+    void JSONEncoder::beginAppendingArray(const Value *array, size_t) {
+        auto items = array->asArray();
+        throwIf(!items, EncodeError, "not an array");
+        beginArray();
+        for (auto iter = items->begin(); iter; ++iter)
+            writeValue(iter.value());
+    }
+
+
+    // A blob reference is written as a JSON object, in the form Couchbase Lite uses for blobs.
+    void JSONEncoder::writeBlobRef(slice digest, uint64_t length) {
+        beginDictionary();
+        writeKey("@type"_sl);
+        writeString("blob"_sl);
+        writeKey("digest"_sl);
+        comma();
+        _out << slice("\"sha256-");
+        _out.writeBase64(digest);
+        _out << '"';
+        writeKey("length"_sl);
+        writeUInt(length);
+        endDictionary();
+    }
+
+
     void JSONEncoder::writeValue(const Value *v, SharedKeys *sk) {
         auto savedSK = _sharedKeys;
         if (sk)
@@ -149,9 +182,24 @@ namespace fleece {
             case kString:
                 writeString(v->asString());
                 break;
+            case kCompressedString:
+                throwIf(!_stringCompressor, InvalidData,
+                        "Compressed string can't be read without its compressor");
+                writeString(_stringCompressor->decompress(v->asCompressedString()));
+                break;
+            case kSharedString:
+                writeString(v->asString(_sharedValues));
+                break;
             case kData:
                 writeData(v->asData());
                 break;
+            case kBlobRef: {
+                slice digest;
+                uint64_t length;
+                throwIf(!v->asBlobRef(digest, length), InvalidData, "Invalid blob reference");
+                writeBlobRef(digest, length);
+                break;
+            }
             case kArray:
                 beginArray();
                 for (auto iter = v->asArray()->begin(); iter; ++iter)
@@ -21,11 +21,13 @@
 #include "Writer.hh"
 #include "Value.hh"
 #include "FleeceException.hh"
+#include "NumConversion.hh"
 
 
 namespace fleece {
 
     class SharedKeys;
+    class StringCompressor;
 
     /** Generates JSON-encoded data. */
     class JSONEncoder {
@@ -44,21 +46,31 @@ namespace fleece {
         /** Returns the encoded data. */
         alloc_slice extractOutput()             {return _out.extractOutput();}
 
+        /** Makes the encoder pass its output to a sink whenever a chunk fills up, instead of
+            keeping it all in memory. extractOutput() then writes the rest and returns null. */
+        void setOutputSink(Writer::Sink sink)   {_out.setSink(std::move(sink));}
+
         /** Resets the encoder so it can be used again. */
         void reset()                            {_out.reset(); _first = true;}
 
         /** Associates a SharedKeys object with this Encoder, for use by writeValue(). */
         void setSharedKeys(const SharedKeys *s) {_sharedKeys = s;}
 
+        /** Associates a pool of shared string values, used by writeValue() to resolve them. */
+        void setSharedValues(const SharedKeys *s) {_sharedValues = s;}
+
+        /** Associates a StringCompressor, used by writeValue() to decompress strings. */
+        void setStringCompressor(const StringCompressor *c) {_stringCompressor = c;}
+
         /////// Writing data:
 
         void writeNull()                        {comma(); _out << slice("null");}
         void writeBool(bool b)                  {comma(); _out.write(b ? "true"_sl : "false"_sl);}
 
-        void writeInt(int64_t i)                {writef("%lld", i);}
-        void writeUInt(uint64_t i)              {writef("%llu", i);}
-        void writeFloat(float f)                {writef("%.6g", f);}
-        void writeDouble(double d)              {writef("%.16g", d);}
+        void writeInt(int64_t i)                {writeNumber(WriteInt, i);}
+        void writeUInt(uint64_t i)              {writeNumber(WriteUInt, i);}
+        void writeFloat(float f)                {writeNumber(WriteFloat, f);}
+        void writeDouble(double d)              {writeNumber(WriteDouble, d);}
 
         void writeString(const std::string &s)  {writeString(slice(s));}
         void writeString(slice s);
@@ -67,6 +79,9 @@ namespace fleece {
                                                           _out << '"';}
         void writeValue(const Value *v, SharedKeys *sk =nullptr);
 
+        /** Writes a blob reference's digest and length as a `{"@type":"blob", ...}` object. */
+        void writeBlobRef(slice digest, uint64_t length);
+
         void writeJSON(slice json)              {comma(); _out << json;}
         void writeRaw(slice raw)                {_out << raw;}
 
@@ -78,6 +93,7 @@ namespace fleece {
         //////// Writing arrays:
 
         void beginArray()                       {comma(); _out << '['; _first = true;}
+        void beginAppendingArray(const Value *array, size_t reserve =0);
         void endArray()                         {_out << ']'; _first = false;}
 
         //////// Writing dictionaries:
@@ -117,11 +133,12 @@ namespace fleece {
                 _out << ',';
         }
 
+        // Formats a number directly into the output, then gives back the unused space.
         template <class T>
-        void writef(const char *fmt, T t) {
+        void writeNumber(size_t (*format)(T, char*), T n) {
             comma();
-            char str[32];
-            _out.write(str, sprintf(str, fmt, t));
+            auto dst = (char*)_out.reserveSpace(kMaxNumberLength);
+            _out.truncate(_out.length() - kMaxNumberLength + format(n, dst));
         }
 
         Writer _out;
@@ -129,6 +146,8 @@ namespace fleece {
         bool _canonical {false};
         bool _first {true};
         const SharedKeys *_sharedKeys {nullptr};
+        const SharedKeys *_sharedValues {nullptr};
+        const StringCompressor *_stringCompressor {nullptr};
     };
 
 }
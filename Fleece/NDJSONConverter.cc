@@ -0,0 +1,235 @@
+//
+// NDJSONConverter.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "NDJSONConverter.hh"
+#include "SharedKeys.hh"
+#include <algorithm>
+#include <atomic>
+#include <system_error>
+#include <thread>
+
+namespace fleece {
+
+    // Each batch of lines handed to a worker is about this big (unless the input is small):
+    static const size_t kBatchSize = 64 * 1024;
+
+
+    // A worker's private copy of the shared key mapping, which its Encoder uses. Keys already
+    // in the copy are looked up without locking. Other keys are looked up in, or added to,
+    // the real SharedKeys under the mutex; then any keys that other workers have added
+    // meanwhile are copied too, so the numbering always matches the real mapping.
+    class NDJSONConverter::KeyMirror : public SharedKeys {
+    public:
+        KeyMirror(SharedKeys &master, std::mutex &mutex)
+        :_master(master), _mutex(mutex)
+        {
+            // The master enforces the limits:
+            setMaxCount(SIZE_MAX);
+            setMaxKeyLength(SIZE_MAX);
+        }
+
+        // Re-copies the master mapping, which may have changed since the last convert().
+        void sync() {
+            revertToCount(0);
+            catchUp();
+        }
+
+        virtual bool isEligibleToEncode(slice) override {
+            return true;                    // (the master decides)
+        }
+
+    protected:
+        virtual int add(slice str) override {
+            std::lock_guard<std::mutex> lock(_mutex);
+            int key;
+            if (!_master.encodeAndAdd(str, key))
+                return -1;
+            catchUp();
+            return key;
+        }
+
+    private:
+        void catchUp() {
+            auto &keys = _master.byKey();
+            for (size_t i = count(); i < keys.size(); ++i)
+                SharedKeys::add(keys[i]);
+        }
+
+        SharedKeys &_master;
+        std::mutex &_mutex;
+    };
+
+
+    // A reusable Encoder and JSONConverter.
+    struct NDJSONConverter::Worker {
+        Worker(SharedKeys *sharedKeys, std::mutex &mutex)
+        :converter(encoder)
+        {
+            if (sharedKeys) {
+                keys.reset(new KeyMirror(*sharedKeys, mutex));
+                encoder.setSharedKeys(keys.get());
+            }
+        }
+
+        std::unique_ptr<KeyMirror> keys;
+        Encoder encoder;
+        JSONConverter converter;
+    };
+
+
+    // A run of lines, and the result of converting them.
+    struct NDJSONConverter::Batch {
+        slice lines;
+        std::vector<alloc_slice> documents;
+        int jsonError {0};
+        ErrorCode errorCode {NoError};
+        std::string errorMessage;
+        size_t errorPos {0};                // Offset in the input
+
+        void convert(Worker &worker, const void *inputStart) {
+            auto &encoder = worker.encoder;
+            auto &converter = worker.converter;
+            auto p = (const char*)lines.buf, end = (const char*)lines.end();
+            try {
+                while (p < end) {
+                    auto eol = (const char*)memchr(p, '\n', end - p);
+                    if (!eol)
+                        eol = end;
+                    slice line(p, eol);
+                    if (!isBlank(line)) {
+                        if (!converter.encodeJSON(line)) {
+                            jsonError = converter.jsonError();
+                            errorCode = converter.errorCode();
+                            errorMessage = converter.errorMessage();
+                            errorPos = (p - (const char*)inputStart) + converter.errorPos();
+                            encoder.reset();
+                            return;
+                        }
+                        documents.push_back(encoder.extractOutput());
+                        encoder.reset();
+                    }
+                    p = eol + 1;
+                }
+            } catch (const FleeceException &x) {
+                jsonError = JSONConverter::kErrExceptionThrown;
+                errorCode = x.code;
+                errorMessage = x.what();
+                errorPos = p - (const char*)inputStart;
+                encoder.reset();
+            } catch (...) {
+                jsonError = JSONConverter::kErrExceptionThrown;
+                errorCode = InternalError;
+                errorMessage = "Unexpected C++ exception";
+                errorPos = p - (const char*)inputStart;
+                encoder.reset();
+            }
+        }
+
+        static bool isBlank(slice line) {
+            for (size_t i = 0; i < line.size; ++i)
+                if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+                    return false;
+            return true;
+        }
+    };
+
+
+    NDJSONConverter::NDJSONConverter(SharedKeys *sharedKeys, unsigned maxThreads)
+    :_sharedKeys(sharedKeys)
+    ,_maxThreads(maxThreads ? maxThreads : std::max(std::thread::hardware_concurrency(), 1u))
+    { }
+
+    NDJSONConverter::~NDJSONConverter() =default;
+
+
+    bool NDJSONConverter::convert(slice ndjson, std::vector<alloc_slice> &documents) {
+        _jsonError = 0;
+        _errorCode = NoError;
+        _errorMessage.clear();
+        _errorPos = _errorLine = 0;
+
+        // Split the input into batches of whole lines:
+        std::vector<Batch> batches;
+        auto start = (const char*)ndjson.buf, end = (const char*)ndjson.end();
+        size_t batchSize = std::max(kBatchSize, ndjson.size / (8 * _maxThreads));
+        for (auto p = start; p < end; ) {
+            auto next = p + std::min(batchSize, size_t(end - p));
+            if (next < end) {
+                next = (const char*)memchr(next, '\n', end - next);
+                next = next ? next + 1 : end;
+            }
+            batches.emplace_back();
+            batches.back().lines = slice(p, next);
+            p = next;
+        }
+
+        // Get the workers ready:
+        auto nThreads = (unsigned)std::min((size_t)_maxThreads, batches.size());
+        while (_workers.size() < nThreads)
+            _workers.emplace_back(new Worker(_sharedKeys, _sharedKeysMutex));
+        for (auto &worker : _workers) {
+            worker->encoder.validateUTF8(_validateUTF8);
+            if (_sharedKeys)
+                worker->keys->sync();
+        }
+
+        // Each thread converts the next unclaimed batch until there are none left, or until a
+        // batch fails (after which only earlier batches matter):
+        std::atomic<size_t> nextBatch {0}, firstFailed {batches.size()};
+        auto work = [&](Worker *worker) {
+            size_t i;
+            while ((i = nextBatch++) < firstFailed) {
+                auto &batch = batches[i];
+                batch.convert(*worker, ndjson.buf);
+                if (batch.jsonError) {
+                    size_t failed = firstFailed;
+                    while (i < failed && !firstFailed.compare_exchange_weak(failed, i))
+                        ;
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(nThreads);
+        try {
+            for (unsigned t = 1; t < nThreads; ++t)
+                threads.emplace_back(work, _workers[t].get());
+        } catch (const std::system_error&) {
+            // Couldn't start another thread; the ones already running, and this one, will
+            // claim all the batches between them.
+        }
+        if (nThreads > 0)
+            work(_workers[0].get());
+        for (auto &thread : threads)
+            thread.join();
+
+        // Collect the documents in order, up to the first error:
+        for (auto &batch : batches) {
+            documents.insert(documents.end(), batch.documents.begin(), batch.documents.end());
+            if (batch.jsonError) {
+                _jsonError = batch.jsonError;
+                _errorCode = batch.errorCode;
+                _errorMessage = batch.errorMessage;
+                _errorPos = batch.errorPos;
+                _errorLine = 1 + std::count(start, start + batch.errorPos, '\n');
+                return false;
+            }
+        }
+        return true;
+    }
+
+}
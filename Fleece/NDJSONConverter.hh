@@ -0,0 +1,85 @@
+//
+// NDJSONConverter.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+
+#include "JSONConverter.hh"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fleece {
+
+    class SharedKeys;
+
+    /** Converts newline-delimited JSON (one JSON value per line) to Fleece, producing a separate
+        document for each line. Batches of lines are converted in parallel by a pool of
+        Encoder/JSONConverter pairs, which are kept for reuse by later calls.
+
+        If a SharedKeys is given, every document's keys are encoded with it. Each worker keeps a
+        private copy of the mapping, so keys it has seen before are looked up without locking;
+        other keys are looked up in, or added to, the SharedKeys under a mutex. (So the number a
+        new key gets depends on thread timing.) Nothing else may use the SharedKeys while
+        convert() is running. */
+    class NDJSONConverter {
+    public:
+        /** @param sharedKeys  The key mapping to encode keys with, or nullptr for none.
+            @param maxThreads  The maximum number of threads to use; 0 means one per CPU core. */
+        explicit NDJSONConverter(SharedKeys *sharedKeys =nullptr, unsigned maxThreads =0);
+        ~NDJSONConverter();
+
+        /** Converts each line of `ndjson` and appends the resulting documents, in order, to
+            `documents`. Blank lines are skipped. If a line isn't valid JSON, conversion stops
+            there, but the documents of the lines before it are still appended.
+            @return  True on success, false if a line is invalid. */
+        bool convert(slice ndjson, std::vector<alloc_slice> &documents);
+
+        /** If true, a line containing a string that isn't valid UTF-8 is an error, as with
+            Encoder::validateUTF8. Defaults to false. */
+        void validateUTF8(bool b)                       {_validateUTF8 = b;}
+
+        /** Error information about the first invalid line, as from JSONConverter. */
+        int jsonError() const noexcept                  {return _jsonError;}
+        ErrorCode errorCode() const noexcept            {return _errorCode;}
+        const char* errorMessage() const noexcept       {return _errorMessage.c_str();}
+
+        /** Byte offset in the input where the error occurred. */
+        size_t errorPos() const noexcept                {return _errorPos;}
+
+        /** The line number (starting at 1) of the invalid line. */
+        size_t errorLine() const noexcept               {return _errorLine;}
+
+    private:
+        class KeyMirror;
+        struct Worker;
+        struct Batch;
+
+        SharedKeys* const _sharedKeys;
+        std::mutex _sharedKeysMutex;                    // Protects _sharedKeys during convert()
+        unsigned _maxThreads;
+        bool _validateUTF8 {false};
+        std::vector<std::unique_ptr<Worker>> _workers;  // Pool of reusable converters
+        int _jsonError {0};
+        ErrorCode _errorCode {NoError};
+        std::string _errorMessage;
+        size_t _errorPos {0};
+        size_t _errorLine {0};
+    };
+
+}
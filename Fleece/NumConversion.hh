@@ -0,0 +1,71 @@
+//
+// NumConversion.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "slice.hh"
+#include <string.h>
+
+
+namespace fleece {
+
+    /** Parses a number in JSON syntax, which the caller must already have validated, to the
+        nearest double (rounding ties to even.) Unlike strtod this doesn't depend on the C
+        locale and doesn't need a NUL-terminated string. Uses the Eisel-Lemire algorithm, with
+        an exact but slower decimal conversion for numbers having more than 19 significant
+        digits that it can't round on its own.
+        If `fitsInFloat` is non-null, it's set to whether the result can be stored as a float
+        with no loss of precision. */
+    double ParseDouble(slice str, bool *fitsInFloat =nullptr) noexcept;
+
+    /** Returns true if `d` can be converted to a float and back without changing its value.
+        Infinities and NaNs return false. */
+    static inline bool FitsInFloat(double d) noexcept {
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        int exp = (int)((bits >> 52) & 0x7FF) - 1023;
+        uint64_t mantissa = bits & ((1ull << 52) - 1);
+        if (exp > 127)
+            return false;                           // too big, infinite or NaN
+        else if (exp >= -126)
+            return (mantissa & ((1ull << 29) - 1)) == 0;    // 23 bits of float mantissa
+        else if (exp >= -149)
+            return (mantissa & ((1ull << (52 - (exp + 149))) - 1)) == 0;    // float denormal
+        else
+            return exp == -1023 && mantissa == 0;   // zero
+    }
+
+
+    /** The most characters that WriteInt, WriteUInt, WriteDouble or WriteFloat will write. */
+    static const size_t kMaxNumberLength = 32;
+
+    /** Writes an integer in decimal to `dst` and returns the number of characters written.
+        No NUL terminator is written. */
+    size_t WriteInt(int64_t, char *dst NONNULL) noexcept;
+    size_t WriteUInt(uint64_t, char *dst NONNULL) noexcept;
+
+    /** Writes the shortest decimal string that ParseDouble (or strtod) will convert back to
+        exactly the same value, using the Ryu algorithm, and returns its length. It's laid out
+        like printf's "%.17g": exponential notation is used only for exponents below -4 or
+        above 16. Infinities and NaN are written as "inf", "-inf" and "nan".
+        Unlike printf this doesn't depend on the C locale. No NUL terminator is written. */
+    size_t WriteDouble(double, char *dst NONNULL) noexcept;
+
+    /** Like WriteDouble, but writes the shortest string that converts back to the same float. */
+    size_t WriteFloat(float, char *dst NONNULL) noexcept;
+
+}
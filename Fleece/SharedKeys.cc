@@ -45,7 +45,7 @@ namespace fleece {
             return false;
         // OK, add to table:
         key = add(str);
-        return true;
+        return key >= 0;
     }
 
 
@@ -82,11 +82,13 @@ namespace fleece {
         void setPlatformStringForKey(int key, PlatformString) const;
         PlatformString platformStringForKey(int key) const;
 
+    protected:
+        /** Adds a string to the mapping and returns its key, or -1 if it can't be added. */
+        virtual int add(slice string);
+
     private:
         friend class PersistentSharedKeys;
 
-        virtual int add(slice string);
-
         fleece::StringTable _table;                     // Hash table mapping slice->int
         std::vector<alloc_slice> _byKey;                // Reverse mapping, int->slice
         std::vector<PlatformString> _platformStringsByKey; // Reverse mapping, int->platform key
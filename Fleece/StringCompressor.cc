@@ -0,0 +1,267 @@
+//
+// StringCompressor.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "StringCompressor.hh"
+#include "FleeceException.hh"
+#include "PlatformCompat.hh"
+#include "varint.hh"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+namespace fleece {
+
+    // Compressed data is a varint giving the decompressed length, followed by codes. A code is
+    // the index of a symbol, or kEscapeCode followed by a literal byte.
+
+    const size_t StringCompressor::kMaxSymbols, StringCompressor::kMaxSymbolLength;
+
+    // Training only looks at this many bytes of the samples:
+    static const size_t kMaxSampleSize = 64 * 1024;
+
+    // Number of rounds of refining the symbol table during training:
+    static const int kTrainingRounds = 5;
+
+
+#pragma mark - TRAINING:
+
+
+    // Builds the table the way FSST does: starting from an empty table, it repeatedly compresses
+    // the sample, counts how often each symbol (or escaped byte) is used and how often each pair
+    // of consecutive symbols occurs, and then keeps the candidates that would save the most bytes.
+    StringCompressor::StringCompressor(const std::vector<slice> &samples) {
+        std::vector<slice> sample;
+        size_t sampleSize = 0;
+        for (auto s : samples) {
+            if (sampleSize + s.size > kMaxSampleSize)
+                s.setSize(kMaxSampleSize - sampleSize);
+            if (s.size > 0)
+                sample.push_back(s);
+            sampleSize += s.size;
+            if (sampleSize >= kMaxSampleSize)
+                break;
+        }
+
+        std::unordered_map<std::string, size_t> counts;
+        for (int round = 0; round < kTrainingRounds; ++round) {
+            counts.clear();
+            for (auto s : sample) {
+                auto in = (const uint8_t*)s.buf, end = (const uint8_t*)s.end();
+                std::string prev;
+                while (in < end) {
+                    int code;
+                    size_t len = longestMatch(in, end - in, code);
+                    std::string cur((const char*)in, len);
+                    ++counts[cur];
+                    if (!prev.empty())
+                        ++counts[(prev + cur).substr(0, kMaxSymbolLength)];
+                    prev = std::move(cur);
+                    in += len;
+                }
+            }
+
+            // Rank the candidates by the number of bytes they'd cover:
+            std::vector<std::pair<size_t, const std::string*>> ranked;
+            ranked.reserve(counts.size());
+            for (auto &entry : counts)
+                ranked.emplace_back(entry.second * entry.first.size(), &entry.first);
+            auto n = std::min(ranked.size(), kMaxSymbols);
+            std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+                              [](const std::pair<size_t, const std::string*> &a,
+                                 const std::pair<size_t, const std::string*> &b) {
+                                  if (a.first != b.first)
+                                      return a.first > b.first;
+                                  return *a.second < *b.second;     // make it deterministic
+                              });
+            std::vector<Symbol> symbols(n);
+            for (size_t i = 0; i < n; ++i) {
+                auto &str = *ranked[i].second;
+                memcpy(symbols[i].bytes, str.data(), str.size());
+                symbols[i].length = (uint8_t)str.size();
+            }
+            setSymbols(std::move(symbols));
+        }
+    }
+
+    void StringCompressor::setSymbols(std::vector<Symbol> &&symbols) {
+        _symbols = std::move(symbols);
+        for (auto &codes : _byFirstByte)
+            codes.clear();
+        for (size_t code = 0; code < _symbols.size(); ++code)
+            _byFirstByte[_symbols[code].bytes[0]].push_back((uint8_t)code);
+        for (auto &codes : _byFirstByte) {
+            std::stable_sort(codes.begin(), codes.end(), [&](uint8_t a, uint8_t b) {
+                return _symbols[a].length > _symbols[b].length;
+            });
+        }
+    }
+
+
+#pragma mark - PERSISTENCE:
+
+
+    // The table is saved as a count byte, then each symbol as a length byte followed by its bytes.
+
+    alloc_slice StringCompressor::data() const {
+        alloc_slice result(1 + _symbols.size() * (1 + kMaxSymbolLength));
+        auto dst = (uint8_t*)result.buf;
+        *dst++ = (uint8_t)_symbols.size();
+        for (auto &sym : _symbols) {
+            *dst++ = sym.length;
+            memcpy(dst, sym.bytes, sym.length);
+            dst += sym.length;
+        }
+        result.shorten(dst - (uint8_t*)result.buf);
+        return result;
+    }
+
+    StringCompressor StringCompressor::fromData(slice data) {
+        throwIf(data.size == 0, InvalidData, "empty string compressor data");
+        size_t n = data[0];
+        data.moveStart(1);
+        std::vector<Symbol> symbols(n);
+        for (auto &sym : symbols) {
+            throwIf(data.size == 0, InvalidData, "truncated string compressor data");
+            sym.length = data[0];
+            throwIf(sym.length == 0 || sym.length > kMaxSymbolLength
+                                    || data.size < 1 + (size_t)sym.length,
+                    InvalidData, "invalid string compressor data");
+            memcpy(sym.bytes, &data[1], sym.length);
+            data.moveStart(1 + sym.length);
+        }
+        throwIf(data.size > 0, InvalidData, "invalid string compressor data");
+        StringCompressor compressor;
+        compressor.setSymbols(std::move(symbols));
+        return compressor;
+    }
+
+
+#pragma mark - COMPRESSION:
+
+
+    // Finds the longest symbol that matches the input, returning its length and setting `code`.
+    // If there's none, returns 1 and sets `code` to kEscapeCode.
+    size_t StringCompressor::longestMatch(const uint8_t *in, size_t avail,
+                                          int &code) const noexcept {
+        for (uint8_t c : _byFirstByte[in[0]]) {
+            auto &sym = _symbols[c];
+            if (sym.length <= avail && memcmp(sym.bytes, in, sym.length) == 0) {
+                code = c;
+                return sym.length;
+            }
+        }
+        code = kEscapeCode;
+        return 1;
+    }
+
+    size_t StringCompressor::maxCompressedSize(size_t size) {
+        return kMaxVarintLen64 + 2 * size;
+    }
+
+    size_t StringCompressor::compress(slice str, void *dst) const noexcept {
+        auto out = (uint8_t*)dst;
+        out += PutUVarInt(out, str.size);
+        auto in = (const uint8_t*)str.buf, end = (const uint8_t*)str.end();
+        while (in < end) {
+            int code;
+            size_t len = longestMatch(in, end - in, code);
+            *out++ = (uint8_t)code;
+            if (_usuallyFalse(code == kEscapeCode))
+                *out++ = *in;
+            in += len;
+        }
+        return out - (uint8_t*)dst;
+    }
+
+    alloc_slice StringCompressor::compress(slice str) const {
+        alloc_slice result(maxCompressedSize(str.size));
+        result.shorten(compress(str, (void*)result.buf));
+        return result;
+    }
+
+
+#pragma mark - DECOMPRESSION:
+
+
+    size_t StringCompressor::decompressedSize(slice compressed) {
+        uint64_t size;
+        throwIf(!ReadUVarInt(&compressed, &size), InvalidData, "invalid compressed string");
+        return (size_t)size;
+    }
+
+    alloc_slice StringCompressor::decompress(slice compressed) const {
+        uint64_t size;
+        throwIf(!ReadUVarInt(&compressed, &size) || size > compressed.size * kMaxSymbolLength,
+                InvalidData, "invalid compressed string");
+        alloc_slice result((size_t)size);
+        auto out = (uint8_t*)result.buf, outEnd = out + size;
+        auto in = (const uint8_t*)compressed.buf, end = (const uint8_t*)compressed.end();
+        while (in < end) {
+            uint8_t code = *in++;
+            if (_usuallyFalse(code == kEscapeCode)) {
+                throwIf(in == end || out == outEnd, InvalidData, "invalid compressed string");
+                *out++ = *in++;
+            } else {
+                throwIf(code >= _symbols.size(), InvalidData, "invalid compressed string");
+                auto &sym = _symbols[code];
+                throwIf(sym.length > (size_t)(outEnd - out),
+                        InvalidData, "invalid compressed string");
+                memcpy(out, sym.bytes, sym.length);
+                out += sym.length;
+            }
+        }
+        throwIf(out != outEnd, InvalidData, "invalid compressed string");
+        return result;
+    }
+
+    bool StringCompressor::equals(slice compressed, slice str) const noexcept {
+        return compareWith(compressed, str, false);
+    }
+
+    bool StringCompressor::hasPrefix(slice compressed, slice prefix) const noexcept {
+        return compareWith(compressed, prefix, true);
+    }
+
+    bool StringCompressor::compareWith(slice compressed, slice str,
+                                       bool prefixOnly) const noexcept {
+        uint64_t size;
+        if (!ReadUVarInt(&compressed, &size) || (prefixOnly ? size < str.size : size != str.size))
+            return false;
+        auto in = (const uint8_t*)compressed.buf, end = (const uint8_t*)compressed.end();
+        auto s = (const uint8_t*)str.buf, sEnd = (const uint8_t*)str.end();
+        while (s < sEnd) {
+            if (_usuallyFalse(in == end))
+                return false;
+            uint8_t code = *in++;
+            if (_usuallyFalse(code == kEscapeCode)) {
+                if (in == end || *in++ != *s++)
+                    return false;
+            } else {
+                if (code >= _symbols.size())
+                    return false;
+                auto &sym = _symbols[code];
+                size_t n = std::min((size_t)sym.length, (size_t)(sEnd - s));
+                if (memcmp(sym.bytes, s, n) != 0)
+                    return false;
+                s += n;
+            }
+        }
+        return true;
+    }
+
+}
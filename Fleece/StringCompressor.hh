@@ -0,0 +1,93 @@
+//
+// StringCompressor.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "slice.hh"
+#include <vector>
+
+
+namespace fleece {
+
+    /** Compresses strings with a static table of up to 255 symbols (substrings of 1-8 bytes),
+        each of which is replaced by a one-byte code; other bytes are escaped. This is the
+        FSST scheme: it does well on short and medium-length text, and every string is
+        compressed independently, so a single one can be decompressed without touching any
+        others.
+
+        The table is built once from sample strings and can be saved with data(). Compression
+        is deterministic, so two strings compressed with the same table are equal if and only if
+        their compressed forms are.
+
+        An Encoder can be told to compress long string values with one of these (see
+        Encoder::setStringCompressor); such values are read with Value::asCompressedString and
+        decompress(). */
+    class StringCompressor {
+    public:
+        static const size_t kMaxSymbols = 255;
+        static const size_t kMaxSymbolLength = 8;
+
+        /** Builds a symbol table that works well for strings like the samples. */
+        explicit StringCompressor(const std::vector<slice> &samples);
+
+        /** Reloads a symbol table previously returned by data(). Throws InvalidData if the data
+            isn't a valid table. */
+        static StringCompressor fromData(slice data);
+
+        /** The symbol table in a compact form, to be saved and passed to fromData later. */
+        alloc_slice data() const;
+
+        /** The number of symbols in the table. */
+        size_t count() const                    {return _symbols.size();}
+
+        /** The largest size that compressing a string of `size` bytes can produce. */
+        static size_t maxCompressedSize(size_t size);
+
+        /** Compresses a string into `dst`, which must have room for maxCompressedSize bytes,
+            and returns the compressed size. */
+        size_t compress(slice str, void *dst) const noexcept;
+        alloc_slice compress(slice str) const;
+
+        /** Returns the length of the string that `compressed` decompresses to. */
+        static size_t decompressedSize(slice compressed);
+
+        /** Decompresses a string. Throws InvalidData if the data is corrupt. */
+        alloc_slice decompress(slice compressed) const;
+
+        /** Compares a compressed string with an uncompressed one, decompressing only as far as
+            the first difference, and without allocating memory. */
+        bool equals(slice compressed, slice str) const noexcept;
+        bool hasPrefix(slice compressed, slice prefix) const noexcept;
+
+    private:
+        struct Symbol {
+            uint8_t bytes[kMaxSymbolLength];
+            uint8_t length;
+        };
+
+        StringCompressor() { }
+        void setSymbols(std::vector<Symbol>&&);
+        size_t longestMatch(const uint8_t *in, size_t avail, int &code) const noexcept;
+        bool compareWith(slice compressed, slice str, bool prefixOnly) const noexcept;
+
+        static const uint8_t kEscapeCode = 255;
+
+        std::vector<Symbol> _symbols;                // Indexed by code
+        std::vector<uint8_t> _byFirstByte[256];      // Codes by first byte, longest first
+    };
+
+}
@@ -17,10 +17,12 @@
 //
 
 #include "StringTable.hh"
+#include "Allocator.hh"
 #include "PlatformCompat.hh"
 #include <algorithm>
 #include <assert.h>
 #include <stdlib.h>
+#include <vector>
 
 namespace fleece {
 
@@ -37,13 +39,14 @@ namespace fleece {
     }
 
     StringTable::~StringTable() {
-        if (_table != _initialTable)
-            ::free(_table);
+        freeTable(_table, _size, _allocator);
     }
 
     void StringTable::clear() noexcept {
         ::memset(_table, 0, _size * sizeof(slot));
         _count = 0;
+        _added.clear();
+        _unloggedEnd = 0;
     }
 
     StringTable::slot& StringTable::find(fleece::slice key, uint32_t hash) const noexcept {
@@ -75,19 +78,90 @@ namespace fleece {
         }
     }
 
-    void StringTable::addAt(slot& s, slice key, const info& n) noexcept {
+    void StringTable::addAt(slot& s, slice key, const info& n) {
         assert(key.buf != nullptr);
         assert(s.first.buf == nullptr);
         s.first = key;
         auto hash = s.second.hash;
         s.second = n;
         s.second.hash = hash;
+        added(s.second);
         incCount();
     }
 
     void StringTable::add(fleece::slice key, const info& n) {
-        if (_add(key, key.hash(), n))
+        auto hash = key.hash();
+        if (_add(key, hash, n)) {
+            added({n.offset, hash});
             incCount();
+        }
+    }
+
+    void StringTable::setOffset(slot &s, uint32_t offset) {
+        assert(s.first.buf != nullptr);
+        s.second.offset = offset;
+        added(s.second);
+    }
+
+    // Records a new entry (or offset) in _added, so removeFromOffset can find it quickly.
+    // An entry that's out of order isn't; removeFromOffset will have to scan for it.
+    void StringTable::added(const info &i) {
+        if (_usuallyTrue(_added.empty() || i.offset >= _added.back().offset))
+            _added.push_back(i);
+        else
+            _unloggedEnd = std::max(_unloggedEnd, i.offset + 1);
+    }
+
+    // Empties a slot, moving later entries of its probe sequence back to fill the gap.
+    void StringTable::removeAt(size_t index) noexcept {
+        size_t mask = _size - 1;
+        for (size_t next = (index + 1) & mask; _table[next].first.buf; next = (next + 1) & mask) {
+            // An entry can move back to `index` unless its home slot is in (index, next]:
+            size_t home = _table[next].second.hash & mask;
+            if (index <= next ? (index < home && home <= next) : (index < home || home <= next))
+                continue;
+            _table[index] = _table[next];
+            index = next;
+        }
+        _table[index] = slot();
+        --_count;
+    }
+
+    void StringTable::removeFromOffset(uint32_t minOffset) {
+        if (_usuallyTrue(minOffset >= _unloggedEnd)) {
+            // All entries to remove are at the end of _added; look each one up by hash & offset:
+            size_t mask = _size - 1;
+            while (!_added.empty() && _added.back().offset >= minOffset) {
+                info i = _added.back();
+                _added.pop_back();
+                for (size_t index = i.hash & mask; _table[index].first.buf;
+                                                   index = (index + 1) & mask) {
+                    auto &entry = _table[index].second;
+                    if (entry.offset == i.offset && entry.hash == i.hash) {
+                        removeAt(index);
+                        break;
+                    }
+                }
+            }
+            return;
+        }
+
+        // Otherwise scan the whole table, re-adding the remaining entries to an empty table:
+        while (!_added.empty() && _added.back().offset >= minOffset)
+            _added.pop_back();
+        _unloggedEnd = std::min(_unloggedEnd, minOffset);
+        std::vector<slot> kept;
+        kept.reserve(_count);
+        for (auto s = _table; s < &_table[_size]; ++s) {
+            if (s->first.buf != nullptr && s->second.offset < minOffset)
+                kept.push_back(*s);
+        }
+        if (kept.size() == _count)
+            return;
+        ::memset(_table, 0, _size * sizeof(slot));
+        for (auto &s : kept)
+            _add(s.first, s.second.hash, s.second);
+        _count = kept.size();
     }
 
     void StringTable::allocTable(size_t size) {
@@ -97,24 +171,30 @@ namespace fleece {
             memset(table, 0, sizeof(_initialTable));
             size = kInitialTableSize;
         } else {
-            table = (slot*)::calloc(size, sizeof(slot));
-            if (!table)
-                throw std::bad_alloc();
+            _allocator = &Allocator::current();
+            table = (slot*)_allocator->allocateOrThrow(size * sizeof(slot));
+            memset(table, 0, size * sizeof(slot));
         }
         _table = table;
         _size = size;
         _maxCount = (size_t)(size * kMaxLoad);
     }
 
+    void StringTable::freeTable(slot *table, size_t size, Allocator *allocator) noexcept {
+        if (table != _initialTable)
+            allocator->deallocate(table, size * sizeof(slot));
+    }
+
     void StringTable::grow() {
         slot *oldTable = _table, *end = &_table[_size];
+        size_t oldSize = _size;
+        Allocator *oldAllocator = _allocator;
         allocTable(2*_size);
         for (auto s = oldTable; s < end; ++s) {
             if (s->first.buf != nullptr)
                 _add(s->first, s->second.hash, s->second);
         }
-        if (oldTable != _initialTable)
-            ::free(oldTable);
+        freeTable(oldTable, oldSize, oldAllocator);
     }
 
 }
@@ -19,8 +19,10 @@
 #pragma once
 
 #include "slice.hh"
+#include <vector>
 
 namespace fleece {
+    class Allocator;
 
     /** Internal hash table mapping strings (slices) to offsets (uint32_t). */
     class StringTable {
@@ -44,7 +46,15 @@ namespace fleece {
 
         void add(slice, const info&);
 
-        void addAt(slot&, slice key, const info&) noexcept;
+        void addAt(slot&, slice key, const info&);
+
+        /** Changes the offset of an existing entry (from find). */
+        void setOffset(slot&, uint32_t offset);
+
+        /** Removes all entries whose offset is at least `minOffset`. If entries have been added
+            in order of increasing offset (apart from ones below `minOffset`), this only takes
+            time proportional to the number removed. */
+        void removeFromOffset(uint32_t minOffset);
 
         class iterator {
         public:
@@ -66,8 +76,11 @@ namespace fleece {
 
     private:
         void allocTable(size_t size);
+        void freeTable(slot*, size_t size, Allocator*) noexcept;
         slot& find(fleece::slice key, uint32_t hash) const noexcept;
         bool _add(slice, uint32_t h, const info&) noexcept;
+        void added(const info&);
+        void removeAt(size_t index) noexcept;
         void incCount()                             {if (++_count > _maxCount) grow();}
         void grow();
 
@@ -75,8 +88,11 @@ namespace fleece {
 
         slot *_table;
         size_t _size;
+        Allocator *_allocator {nullptr};      // allocated _table, unless it's _initialTable
         size_t _count;
         size_t _maxCount;
+        std::vector<info> _added;             // Entries added, in increasing order of offset
+        uint32_t _unloggedEnd {0};            // Max offset of entries not in _added, plus 1
         slot _initialTable[kInitialTableSize];
     };
 
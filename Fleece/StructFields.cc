@@ -0,0 +1,68 @@
+//
+// StructFields.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "StructFields.hh"
+#include <algorithm>
+
+namespace fleece {
+
+    FieldKeys::FieldKeys(const std::vector<slice> &names, SharedKeys *sk)
+    :_names(names)
+    ,_codes(names.size(), -1)
+    ,_sharedKeys(sk)
+    {
+        if (sk) {
+            for (size_t i = 0; i < names.size(); ++i) {
+                int code;
+                if (sk->encodeAndAdd(names[i], code))
+                    _codes[i] = code;
+            }
+            _sharedKeysCount = sk->count();
+        }
+
+        // Sort the fields the way Encoder::sortDict would: integer keys first, then strings:
+        _order.resize(names.size());
+        for (unsigned i = 0; i < _order.size(); ++i)
+            _order[i] = i;
+        std::sort(_order.begin(), _order.end(), [&](unsigned a, unsigned b) {
+            if (_codes[a] >= 0 || _codes[b] >= 0) {
+                if (_codes[a] < 0 || _codes[b] < 0)
+                    return _codes[a] >= 0;
+                return _codes[a] < _codes[b];
+            }
+            return _names[a].compare(_names[b]) < 0;
+        });
+    }
+
+
+    FieldLookup::FieldLookup(const std::vector<slice> &names, SharedKeys *sk)
+    :_sharedKeys(sk)
+    {
+        // The multi-key Dict::get requires the keys to be sorted by name:
+        _fields.resize(names.size());
+        for (unsigned i = 0; i < _fields.size(); ++i)
+            _fields[i] = i;
+        std::sort(_fields.begin(), _fields.end(), [&](unsigned a, unsigned b) {
+            return names[a].compare(names[b]) < 0;
+        });
+        _keys.reserve(names.size());
+        for (unsigned field : _fields)
+            _keys.emplace_back(names[field], sk);
+    }
+
+}
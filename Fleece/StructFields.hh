@@ -0,0 +1,320 @@
+//
+// StructFields.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "Dict.hh"
+#include "Encoder.hh"
+#include "SharedKeys.hh"
+#include "TempArray.hh"
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/** Binds the named fields of a struct to the keys of an encoded Dict, so that the struct can be
+    written with encodeStruct() and read with decodeStruct(). Use it at namespace scope, in the
+    same namespace as the struct, e.g.:
+        struct Person {std::string name; int age; std::vector<std::string> tags;};
+        FLEECE_FIELDS(Person, name, age, tags)
+    Supported field types are bool, integers, float, double, std::string, std::vector of a
+    supported type, and other structs bound with FLEECE_FIELDS. (Up to 32 fields.) */
+#define FLEECE_FIELDS(STRUCT, ...) \
+    inline const std::vector<fleece::FieldBinding<STRUCT>>& fleeceFields(const STRUCT*) { \
+        typedef STRUCT _FleeceStruct; \
+        static const std::vector<fleece::FieldBinding<STRUCT>> sFields { \
+            _FLEECE_FOREACH(_FLEECE_FIELD, __VA_ARGS__) \
+        }; \
+        return sFields; \
+    }
+
+
+namespace fleece {
+
+    /** Describes one field of a struct bound with FLEECE_FIELDS. */
+    template <class S>
+    struct FieldBinding {
+        const char *name;
+        void (*encode)(Encoder&, const S&);
+        void (*decode)(const Value* NONNULL, S&, SharedKeys*);
+    };
+
+
+    /** The keys of a struct's fields, resolved for encoding with a particular SharedKeys (or
+        none), and sorted in the order the keys will appear in the Dict. */
+    class FieldKeys {
+    public:
+        FieldKeys(const std::vector<slice> &names, SharedKeys*);
+
+        /** Is this still valid for an Encoder using this SharedKeys? */
+        bool isCurrent(const SharedKeys *sk) const {
+            return sk == _sharedKeys && (!sk || sk->count() == _sharedKeysCount);
+        }
+
+        /** Indexes of the fields, in the order their keys are to be written. */
+        const std::vector<unsigned>& order() const      {return _order;}
+
+        void writeKey(Encoder &enc, unsigned field) const {
+            if (_codes[field] >= 0)
+                enc.writeKey(_codes[field]);
+            else
+                enc.writeKey(_names[field]);
+        }
+
+    private:
+        std::vector<slice> _names;
+        std::vector<int> _codes;            // Shared key of each field, or -1
+        std::vector<unsigned> _order;
+        const SharedKeys *_sharedKeys;
+        size_t _sharedKeysCount {0};
+    };
+
+
+    /** The keys of a struct's fields as Dict::keys, sorted by name, for use with the multi-key
+        Dict::get(). Like Dict::key, this must only be used on one thread. */
+    class FieldLookup {
+    public:
+        FieldLookup(const std::vector<slice> &names, SharedKeys*);
+
+        SharedKeys* sharedKeys() const                  {return _sharedKeys;}
+        size_t count() const                            {return _keys.size();}
+        Dict::key* keys()                               {return _keys.data();}
+        /** The index of the field whose key is keys()[i]. */
+        unsigned field(size_t i) const                  {return _fields[i];}
+
+    private:
+        std::vector<Dict::key> _keys;
+        std::vector<unsigned> _fields;
+        SharedKeys *_sharedKeys;
+    };
+
+
+    namespace internal {
+        template <class S>
+        std::vector<slice> fieldNames(const std::vector<FieldBinding<S>> &fields) {
+            std::vector<slice> names;
+            names.reserve(fields.size());
+            for (auto &field : fields)
+                names.emplace_back(field.name);
+            return names;
+        }
+
+        template <class T>
+        using isInteger = std::integral_constant<bool, std::is_integral<T>::value
+                                                       && !std::is_same<T, bool>::value>;
+
+        // Encoding individual fields:
+
+        inline void encodeField(Encoder &enc, bool b)                   {enc.writeBool(b);}
+        inline void encodeField(Encoder &enc, float f)                  {enc.writeFloat(f);}
+        inline void encodeField(Encoder &enc, double d)                 {enc.writeDouble(d);}
+        inline void encodeField(Encoder &enc, const std::string &str)   {enc.writeString(str);}
+
+        template <class T>
+        typename std::enable_if<isInteger<T>::value>::type encodeField(Encoder &enc, T i) {
+            if (std::is_signed<T>::value)
+                enc.writeInt((int64_t)i);
+            else
+                enc.writeUInt((uint64_t)i);
+        }
+
+        inline void encodeField(Encoder &enc, const std::vector<int64_t> &v) {
+            enc.writeArray(v.data(), v.size());
+        }
+        inline void encodeField(Encoder &enc, const std::vector<double> &v) {
+            enc.writeArray(v.data(), v.size());
+        }
+        inline void encodeField(Encoder &enc, const std::vector<float> &v) {
+            enc.writeArray(v.data(), v.size());
+        }
+
+        template <class T>
+        void encodeField(Encoder &enc, const std::vector<T> &v);
+
+        template <class S>
+        auto encodeField(Encoder &enc, const S &s)
+            -> decltype(fleeceFields((const S*)nullptr), void());
+
+        // Decoding individual fields:
+
+        inline void decodeField(const Value *v, bool &b, SharedKeys*)   {b = v->asBool();}
+        inline void decodeField(const Value *v, float &f, SharedKeys*)  {f = v->asFloat();}
+        inline void decodeField(const Value *v, double &d, SharedKeys*) {d = v->asDouble();}
+        inline void decodeField(const Value *v, std::string &str, SharedKeys*) {
+            str = (std::string)v->asString();
+        }
+
+        template <class T>
+        typename std::enable_if<isInteger<T>::value>::type
+        decodeField(const Value *v, T &i, SharedKeys*) {
+            if (std::is_signed<T>::value)
+                i = (T)v->asInt();
+            else
+                i = (T)v->asUnsigned();
+        }
+
+        template <class T>
+        void decodeField(const Value *v, std::vector<T> &vec, SharedKeys *sk);
+
+        template <class S>
+        auto decodeField(const Value *v, S &s, SharedKeys *sk)
+            -> decltype(fleeceFields((const S*)nullptr), void());
+
+        // Adapters used by FLEECE_FIELDS:
+
+        template <class S, class T, T S::*M>
+        void encodeMember(Encoder &enc, const S &s)                     {encodeField(enc, s.*M);}
+
+        template <class S, class T, T S::*M>
+        void decodeMember(const Value *v, S &s, SharedKeys *sk)         {decodeField(v, s.*M, sk);}
+    }
+
+
+    /** Writes a struct bound with FLEECE_FIELDS as a Dict. The keys are resolved (as shared keys,
+        if the encoder has a SharedKeys) only once per thread, and are written already sorted. */
+    template <class S>
+    void encodeStruct(Encoder &enc, const S &s) {
+        auto &fields = fleeceFields((const S*)nullptr);
+        static thread_local std::unique_ptr<FieldKeys> tKeys;
+        if (_usuallyFalse(!tKeys || !tKeys->isCurrent(enc.sharedKeys())))
+            tKeys.reset(new FieldKeys(internal::fieldNames(fields), enc.sharedKeys()));
+        auto &keys = *tKeys;
+        enc.beginSortedDictionary(fields.size());
+        for (unsigned i : keys.order()) {
+            keys.writeKey(enc, i);
+            fields[i].encode(enc, s);
+        }
+        enc.endDictionary();
+    }
+
+    /** Reads a Dict into a struct bound with FLEECE_FIELDS, using a multi-key lookup. Fields
+        whose keys are missing from the Dict are left unchanged. If the Dict was encoded with
+        shared keys, the SharedKeys must be given.
+        @return  False if the Value is not a Dict. */
+    template <class S>
+    bool decodeStruct(const Value *v, S &s, SharedKeys *sk =nullptr) {
+        const Dict *dict = v ? v->asDict() : nullptr;
+        if (!dict)
+            return false;
+        auto &fields = fleeceFields((const S*)nullptr);
+        static thread_local std::unique_ptr<FieldLookup> tLookup;
+        if (_usuallyFalse(!tLookup || tLookup->sharedKeys() != sk))
+            tLookup.reset(new FieldLookup(internal::fieldNames(fields), sk));
+        auto &lookup = *tLookup;
+        size_t n = lookup.count();
+        TempArray(values, const Value*, n);
+        dict->get(lookup.keys(), values, n);
+        for (size_t i = 0; i < n; ++i) {
+            if (values[i])
+                fields[lookup.field(i)].decode(values[i], s, sk);
+        }
+        return true;
+    }
+
+
+    namespace internal {
+        template <class T>
+        void encodeField(Encoder &enc, const std::vector<T> &v) {
+            enc.beginArray(v.size());
+            for (const T &item : v)
+                encodeField(enc, item);
+            enc.endArray();
+        }
+
+        template <class S>
+        auto encodeField(Encoder &enc, const S &s)
+            -> decltype(fleeceFields((const S*)nullptr), void())
+        {
+            encodeStruct(enc, s);
+        }
+
+        template <class T>
+        void decodeField(const Value *v, std::vector<T> &vec, SharedKeys *sk) {
+            vec.clear();
+            const Array *array = v->asArray();
+            if (!array)
+                return;
+            vec.reserve(array->count());
+            for (Array::iterator i(array); i; ++i) {
+                T item {};
+                decodeField(i.value(), item, sk);
+                vec.push_back(std::move(item));
+            }
+        }
+
+        template <class S>
+        auto decodeField(const Value *v, S &s, SharedKeys *sk)
+            -> decltype(fleeceFields((const S*)nullptr), void())
+        {
+            decodeStruct(v, s, sk);
+        }
+    }
+
+}
+
+
+// Implementation details of FLEECE_FIELDS:
+
+#define _FLEECE_FIELD(F) \
+    {#F, &fleece::internal::encodeMember<_FleeceStruct, decltype(_FleeceStruct::F), \
+                                         &_FleeceStruct::F>, \
+         &fleece::internal::decodeMember<_FleeceStruct, decltype(_FleeceStruct::F), \
+                                         &_FleeceStruct::F>},
+
+#define _FLEECE_EXPAND(X) X
+#define _FLEECE_FOREACH(M, ...) \
+    _FLEECE_EXPAND(_FLEECE_FOREACH_N(__VA_ARGS__, _FLEECE_FE32, _FLEECE_FE31, _FLEECE_FE30, \
+        _FLEECE_FE29, _FLEECE_FE28, _FLEECE_FE27, _FLEECE_FE26, _FLEECE_FE25, _FLEECE_FE24, \
+        _FLEECE_FE23, _FLEECE_FE22, _FLEECE_FE21, _FLEECE_FE20, _FLEECE_FE19, _FLEECE_FE18, \
+        _FLEECE_FE17, _FLEECE_FE16, _FLEECE_FE15, _FLEECE_FE14, _FLEECE_FE13, _FLEECE_FE12, \
+        _FLEECE_FE11, _FLEECE_FE10, _FLEECE_FE9, _FLEECE_FE8, _FLEECE_FE7, _FLEECE_FE6, \
+        _FLEECE_FE5, _FLEECE_FE4, _FLEECE_FE3, _FLEECE_FE2, _FLEECE_FE1)(M, __VA_ARGS__))
+#define _FLEECE_FOREACH_N(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, \
+        _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, \
+        NAME, ...) NAME
+#define _FLEECE_FE1(M, A)      M(A)
+#define _FLEECE_FE2(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE1(M, __VA_ARGS__))
+#define _FLEECE_FE3(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE2(M, __VA_ARGS__))
+#define _FLEECE_FE4(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE3(M, __VA_ARGS__))
+#define _FLEECE_FE5(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE4(M, __VA_ARGS__))
+#define _FLEECE_FE6(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE5(M, __VA_ARGS__))
+#define _FLEECE_FE7(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE6(M, __VA_ARGS__))
+#define _FLEECE_FE8(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE7(M, __VA_ARGS__))
+#define _FLEECE_FE9(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE8(M, __VA_ARGS__))
+#define _FLEECE_FE10(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE9(M, __VA_ARGS__))
+#define _FLEECE_FE11(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE10(M, __VA_ARGS__))
+#define _FLEECE_FE12(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE11(M, __VA_ARGS__))
+#define _FLEECE_FE13(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE12(M, __VA_ARGS__))
+#define _FLEECE_FE14(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE13(M, __VA_ARGS__))
+#define _FLEECE_FE15(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE14(M, __VA_ARGS__))
+#define _FLEECE_FE16(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE15(M, __VA_ARGS__))
+#define _FLEECE_FE17(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE16(M, __VA_ARGS__))
+#define _FLEECE_FE18(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE17(M, __VA_ARGS__))
+#define _FLEECE_FE19(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE18(M, __VA_ARGS__))
+#define _FLEECE_FE20(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE19(M, __VA_ARGS__))
+#define _FLEECE_FE21(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE20(M, __VA_ARGS__))
+#define _FLEECE_FE22(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE21(M, __VA_ARGS__))
+#define _FLEECE_FE23(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE22(M, __VA_ARGS__))
+#define _FLEECE_FE24(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE23(M, __VA_ARGS__))
+#define _FLEECE_FE25(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE24(M, __VA_ARGS__))
+#define _FLEECE_FE26(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE25(M, __VA_ARGS__))
+#define _FLEECE_FE27(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE26(M, __VA_ARGS__))
+#define _FLEECE_FE28(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE27(M, __VA_ARGS__))
+#define _FLEECE_FE29(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE28(M, __VA_ARGS__))
+#define _FLEECE_FE30(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE29(M, __VA_ARGS__))
+#define _FLEECE_FE31(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE30(M, __VA_ARGS__))
+#define _FLEECE_FE32(M, A, ...) M(A) _FLEECE_EXPAND(_FLEECE_FE31(M, __VA_ARGS__))
@@ -0,0 +1,375 @@
+//
+// StructuralIndex.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "StructuralIndex.hh"
+#include <algorithm>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    // AVX2 isn't part of the x86-64 baseline, so compile for it per-function and check the
+    // CPU at runtime:
+    #define FL_JSON_AVX2
+    #define AVX2_FN __attribute__((target("avx2")))
+    #include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FL_JSON_SSE2
+    #include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define FL_JSON_NEON
+    #include <arm_neon.h>
+#endif
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+
+namespace fleece {
+
+    static inline unsigned countTrailingZeros(uint64_t n) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, n);
+        return index;
+#else
+        return __builtin_ctzll(n);
+#endif
+    }
+
+
+#pragma mark - CLASSIFYING BYTES:
+
+
+    // Bit-masks of the interesting bytes in a 64-byte block; bit i corresponds to byte i.
+    struct StructuralIndex::Masks {
+        uint64_t quote;             // '"'
+        uint64_t backslash;         // '\'
+        uint64_t op;                // '{', '}', '[', ']', ':', ','
+        uint64_t space;             // ' ', '\t', '\n', '\r'
+    };
+
+    typedef void (*Classifier)(const uint8_t *block, StructuralIndex::Masks&);
+
+
+#if !defined(FL_JSON_SSE2) && !defined(FL_JSON_NEON)
+    // Portable version: looks up each byte's class in a table.
+    enum : uint8_t {kQuote = 1, kBackslash = 2, kOp = 4, kSpace = 8};
+
+    static const uint8_t* charClasses() {
+        static uint8_t sClasses[256];
+        static bool sInitialized = [] {
+            sClasses[(uint8_t)'"'] = kQuote;
+            sClasses[(uint8_t)'\\'] = kBackslash;
+            for (char c : {'{', '}', '[', ']', ':', ','})
+                sClasses[(uint8_t)c] = kOp;
+            for (char c : {' ', '\t', '\n', '\r'})
+                sClasses[(uint8_t)c] = kSpace;
+            return true;
+        }();
+        (void)sInitialized;
+        return sClasses;
+    }
+
+    static void classifyPortable(const uint8_t *block, StructuralIndex::Masks &m) {
+        static const uint8_t *sClasses = charClasses();
+        uint64_t quote = 0, backslash = 0, op = 0, space = 0;
+        for (unsigned i = 0; i < 64; ++i) {
+            uint64_t c = sClasses[block[i]];
+            quote     |= (c & 1) << i;
+            backslash |= ((c >> 1) & 1) << i;
+            op        |= ((c >> 2) & 1) << i;
+            space     |= ((c >> 3) & 1) << i;
+        }
+        m = {quote, backslash, op, space};
+    }
+#endif
+
+
+#ifdef FL_JSON_SSE2
+    // '[' and ']' differ from '{' and '}' only by the 0x20 bit, so OR-ing it in lets one
+    // comparison catch both.
+    static void classifySSE2(const uint8_t *block, StructuralIndex::Masks &m) {
+        m = {0, 0, 0, 0};
+        for (unsigned i = 0; i < 64; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(block + i));
+            __m128i lowered = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            __m128i op = _mm_or_si128(
+                            _mm_or_si128(_mm_cmpeq_epi8(lowered, _mm_set1_epi8('{')),
+                                         _mm_cmpeq_epi8(lowered, _mm_set1_epi8('}'))),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                         _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+            __m128i space = _mm_or_si128(
+                            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+            m.quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+            m.backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                                            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+            m.op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << i;
+            m.space |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << i;
+        }
+    }
+#endif
+
+
+#ifdef FL_JSON_AVX2
+    AVX2_FN
+    static void classifyAVX2(const uint8_t *block, StructuralIndex::Masks &m) {
+        m = {0, 0, 0, 0};
+        for (unsigned i = 0; i < 64; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(block + i));
+            __m256i lowered = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+            __m256i op = _mm256_or_si256(
+                            _mm256_or_si256(_mm256_cmpeq_epi8(lowered, _mm256_set1_epi8('{')),
+                                            _mm256_cmpeq_epi8(lowered, _mm256_set1_epi8('}'))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+            __m256i space = _mm256_or_si256(
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+            m.quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << i;
+            m.backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+            m.op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << i;
+            m.space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << i;
+        }
+    }
+#endif
+
+
+#ifdef FL_JSON_NEON
+    // Packs four 16-byte comparison results (0x00 or 0xFF per byte) into a 64-bit mask.
+    static inline uint64_t neonMask(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3) {
+        static const uint8_t kBits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                          1, 2, 4, 8, 16, 32, 64, 128};
+        const uint8x16_t bits = vld1q_u8(kBits);
+        uint8x16_t s0 = vpaddq_u8(vandq_u8(m0, bits), vandq_u8(m1, bits));
+        uint8x16_t s1 = vpaddq_u8(vandq_u8(m2, bits), vandq_u8(m3, bits));
+        s0 = vpaddq_u8(s0, s1);
+        s0 = vpaddq_u8(s0, s0);
+        return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+    }
+
+    static void classifyNEON(const uint8_t *block, StructuralIndex::Masks &m) {
+        uint8x16_t quote[4], backslash[4], op[4], space[4];
+        for (unsigned i = 0; i < 4; ++i) {
+            uint8x16_t v = vld1q_u8(block + 16*i);
+            uint8x16_t lowered = vorrq_u8(v, vdupq_n_u8(0x20));
+            quote[i] = vceqq_u8(v, vdupq_n_u8('"'));
+            backslash[i] = vceqq_u8(v, vdupq_n_u8('\\'));
+            op[i] = vorrq_u8(vorrq_u8(vceqq_u8(lowered, vdupq_n_u8('{')),
+                                      vceqq_u8(lowered, vdupq_n_u8('}'))),
+                             vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                                      vceqq_u8(v, vdupq_n_u8(','))));
+            space[i] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                                         vceqq_u8(v, vdupq_n_u8('\t'))),
+                                vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+                                         vceqq_u8(v, vdupq_n_u8('\r'))));
+        }
+        m.quote     = neonMask(quote[0], quote[1], quote[2], quote[3]);
+        m.backslash = neonMask(backslash[0], backslash[1], backslash[2], backslash[3]);
+        m.op        = neonMask(op[0], op[1], op[2], op[3]);
+        m.space     = neonMask(space[0], space[1], space[2], space[3]);
+    }
+#endif
+
+
+    static Classifier bestClassifier() {
+#ifdef FL_JSON_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return classifyAVX2;
+#endif
+#if defined(FL_JSON_SSE2)
+        return classifySSE2;
+#elif defined(FL_JSON_NEON)
+        return classifyNEON;
+#else
+        return classifyPortable;
+#endif
+    }
+
+
+#pragma mark - STRINGS:
+
+
+    const uint8_t* StructuralIndex::findQuoteOrBackslash(const uint8_t *p, const uint8_t *end) {
+#if defined(FL_JSON_SSE2)
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+            if (mask)
+                return p + countTrailingZeros(mask);
+        }
+#elif defined(FL_JSON_NEON)
+        for (; end - p >= 16; p += 16) {
+            uint8x16_t v = vld1q_u8(p);
+            uint8x16_t hits = vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\')));
+            if (vmaxvq_u8(hits))
+                break;          // the loop below will find it
+        }
+#endif
+        for (; p < end; ++p) {
+            if (*p == '"' || *p == '\\')
+                return p;
+        }
+        return end;
+    }
+
+
+    static inline bool mustEscape(uint8_t ch) {
+        return ch < 32 || ch == '"' || ch == '\\' || ch == 127;
+    }
+
+    const uint8_t* StructuralIndex::findCharToEscape(const uint8_t *p, const uint8_t *end) {
+#if defined(FL_JSON_SSE2)
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            // There's no unsigned byte comparison, but min(v,31)==v is the same as v <= 31:
+            __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(31)), v);
+            __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                                           _mm_cmpeq_epi8(v, _mm_set1_epi8(127)));
+            int mask = _mm_movemask_epi8(_mm_or_si128(ctrl, special));
+            if (mask)
+                return p + countTrailingZeros(mask);
+        }
+#elif defined(FL_JSON_NEON)
+        for (; end - p >= 16; p += 16) {
+            uint8x16_t v = vld1q_u8(p);
+            uint8x16_t hits = vorrq_u8(vorrq_u8(vcltq_u8(v, vdupq_n_u8(32)),
+                                                vceqq_u8(v, vdupq_n_u8(127))),
+                                       vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')),
+                                                vceqq_u8(v, vdupq_n_u8('\\'))));
+            if (vmaxvq_u8(hits))
+                break;          // the loop below will find it
+        }
+#endif
+        for (; p < end; ++p) {
+            if (mustEscape(*p))
+                return p;
+        }
+        return end;
+    }
+
+
+#pragma mark - INDEXING:
+
+
+    // Returns a mask in which each bit is the XOR of that bit and all lower ones in `x`.
+    static inline uint64_t prefixXor(uint64_t x) {
+        x ^= x << 1;
+        x ^= x << 2;
+        x ^= x << 4;
+        x ^= x << 8;
+        x ^= x << 16;
+        x ^= x << 32;
+        return x;
+    }
+
+
+    const size_t StructuralIndex::kWindowSize;
+
+    void StructuralIndex::start(slice input) {
+        _input = input;
+        _indexedEnd = _windowStart = 0;
+        _count = _cur = 0;
+        _inString = _afterScalar = 0;
+        _escaped = false;
+    }
+
+
+    // Finds the positions in the next window of input.
+    void StructuralIndex::indexWindow() {
+        size_t windowSize = std::min(kWindowSize, _input.size - _indexedEnd);
+        if (_capacity < windowSize) {
+            _capacity = std::max(windowSize, (size_t)64);
+            _positions.reset(new uint32_t[_capacity]);
+        }
+        _windowStart = _indexedEnd;
+        auto block = (const uint8_t*)_input.buf + _windowStart;
+        uint32_t *out = _positions.get();
+        static const Classifier sClassify = bestClassifier();
+        Masks masks;
+        uint32_t pos;
+        for (pos = 0; pos + 64 <= windowSize; pos += 64, block += 64) {
+            sClassify(block, masks);
+            out = indexBlock(masks, pos, out);
+        }
+        if (pos < windowSize) {
+            // Pad the final partial block with spaces:
+            uint8_t lastBlock[64];
+            memset(lastBlock, ' ', sizeof(lastBlock));
+            memcpy(lastBlock, block, windowSize - pos);
+            sClassify(lastBlock, masks);
+            out = indexBlock(masks, pos, out);
+        }
+        _indexedEnd += windowSize;
+        _count = out - _positions.get();
+        _cur = 0;
+    }
+
+
+    uint32_t* StructuralIndex::indexBlock(const Masks &m, uint32_t blockPos, uint32_t *out) {
+        // Find the backslash-escaped bytes. Backslashes are rare, so visit them one by one:
+        uint64_t escaped = 0;
+        uint64_t backslash = m.backslash;
+        if (_escaped) {
+            escaped = 1;
+            backslash &= ~1ull;         // an escaped backslash doesn't escape anything
+            _escaped = false;
+        }
+        while (backslash) {
+            unsigned i = countTrailingZeros(backslash);
+            if (i == 63) {
+                _escaped = true;
+                break;
+            }
+            escaped |= 2ull << i;
+            backslash &= ~(3ull << i);
+        }
+
+        // Unescaped quotes toggle in and out of strings. `inString` covers each string's
+        // opening quote and contents; `stringTail` its contents and closing quote:
+        uint64_t quote = m.quote & ~escaped;
+        uint64_t inString = prefixXor(quote) ^ _inString;
+        _inString = (uint64_t)((int64_t)inString >> 63);
+        uint64_t stringTail = inString ^ quote;
+
+        // A token starts at any non-space, non-operator byte that doesn't follow another such
+        // byte. (Quotes don't count as preceding bytes, so junk right after a string is found.)
+        uint64_t scalar = ~(m.op | m.space);
+        uint64_t nonQuoteScalar = scalar & ~quote;
+        uint64_t followsScalar = (nonQuoteScalar << 1) | _afterScalar;
+        _afterScalar = nonQuoteScalar >> 63;
+
+        uint64_t structurals = (m.op | (scalar & ~followsScalar)) & ~stringTail;
+        while (structurals) {
+            *out++ = blockPos + countTrailingZeros(structurals);
+            structurals &= structurals - 1;
+        }
+        return out;
+    }
+
+}
@@ -0,0 +1,89 @@
+//
+// StructuralIndex.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "slice.hh"
+#include "PlatformCompat.hh"
+#include <memory>
+
+
+namespace fleece {
+
+    /** The first stage of JSONConverter's parser: finds the positions of the structural
+        characters in JSON text (brackets, braces, colons and commas outside strings) and of
+        the first characters of the tokens between them (strings, numbers, true/false/null).
+        The caller then walks these positions in order to parse the JSON.
+
+        The input is classified 64 bytes at a time with SIMD instructions (AVX2 or SSE2 on x86,
+        NEON on ARM, otherwise plain 64-bit arithmetic); string quotes and backslash escapes are
+        resolved with bitwise operations on the resulting masks, so there's no per-byte
+        branching. Positions are produced a window of input at a time, which keeps memory use
+        constant regardless of the input size. */
+    class StructuralIndex {
+    public:
+        /** Starts indexing new input. */
+        void start(slice input);
+
+        /** Returns the position of the next structural character or token, or the input size
+            if there are no more. */
+        size_t next() {
+            while (_usuallyFalse(_cur == _count)) {
+                if (_indexedEnd >= _input.size)
+                    return _input.size;
+                indexWindow();
+            }
+            return _windowStart + _positions[_cur++];
+        }
+
+        /** Returns what the next call to next() will. */
+        size_t peek() {
+            size_t pos = next();
+            if (pos < _input.size)
+                --_cur;
+            return pos;
+        }
+
+        /** Returns a pointer to the first '"' or '\\' in the range, or `end` if there is none. */
+        static const uint8_t* findQuoteOrBackslash(const uint8_t *start NONNULL,
+                                                   const uint8_t *end NONNULL);
+
+        /** Returns a pointer to the first byte in the range that has to be escaped in a JSON
+            string ('"', '\\', a control character or DEL), or `end` if there is none. */
+        static const uint8_t* findCharToEscape(const uint8_t *start NONNULL,
+                                               const uint8_t *end NONNULL);
+
+        /** Bytes of input indexed at a time. (Must be a multiple of 64.) */
+        static const size_t kWindowSize = 64 * 1024;
+
+        struct Masks;   // (internal)
+
+    private:
+        void indexWindow();
+        uint32_t* indexBlock(const Masks&, uint32_t blockPos, uint32_t *out);
+
+        slice _input;
+        size_t _indexedEnd {0};                 // Input offset up to which positions were found
+        size_t _windowStart {0};                // Input offset that _positions are relative to
+        std::unique_ptr<uint32_t[]> _positions; // Positions found in the current window
+        size_t _capacity {0}, _count {0}, _cur {0};
+        uint64_t _inString {0};                 // All 1s if the last block ended inside a string
+        uint64_t _afterScalar {0};              // 1 if the last block ended with a token char
+        bool _escaped {false};                  // True if the next byte is backslash-escaped
+    };
+
+}
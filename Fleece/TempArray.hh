@@ -7,6 +7,7 @@
 //
 
 #pragma once
+#include "Allocator.hh"
 #include <stdlib.h>
 #include <memory>
 
@@ -29,24 +30,29 @@
 
 #else
 
-    // class used internally by TempArray macro
+    // class used internally by TempArray macro. (T must be a POD type; heap arrays come from
+    // the current fleece::Allocator and aren't constructed.)
     template <class T>
     struct _TempArray {
         _TempArray(size_t n)
         :_onHeap(n * sizeof(T) >= 1024)
-        ,_array( _onHeap ? new T[n] : nullptr)
+        ,_allocator(_onHeap ? &fleece::Allocator::current() : nullptr)
+        ,_array( _onHeap ? (T*)_allocator->allocateOrThrow(n * sizeof(T)) : nullptr)
+        ,_size(n * sizeof(T))
         { }
 
         ~_TempArray() {
             if (_onHeap)
-                delete[] _array;
+                _allocator->deallocate(_array, _size);
         }
 
         operator T* () {return _array;}
         template <class U> explicit operator U* () {return (U*)_array;}
 
         bool const _onHeap;
+        fleece::Allocator* const _allocator;
         T* _array;
+        size_t const _size;
     };
 
 
@@ -0,0 +1,312 @@
+//
+// UTF8.cc
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "UTF8.hh"
+#include "PlatformCompat.hh"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    // AVX2 isn't part of the x86-64 baseline, so compile for it per-function and check the
+    // CPU at runtime:
+    #define FL_UTF8_AVX2
+    #define AVX2_FN __attribute__((target("avx2")))
+    #include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define FL_UTF8_NEON
+    #include <arm_neon.h>
+#endif
+
+
+namespace fleece {
+
+    typedef bool (*Validator)(const uint8_t *p, const uint8_t *end);
+
+
+#pragma mark - SCALAR:
+
+
+    static bool validateScalar(const uint8_t *p, const uint8_t *end) {
+        while (p < end) {
+            // Skip ASCII 8 bytes at a time:
+            for (; end - p >= 8; p += 8) {
+                uint64_t word;
+                memcpy(&word, p, 8);
+                if (word & 0x8080808080808080ull)
+                    break;
+            }
+            if (p == end)
+                break;
+            uint8_t ch = *p;
+            if (ch < 0x80) {
+                ++p;
+                continue;
+            }
+            // The valid ranges of the second byte depend on the first (Unicode 3.9, table 3-7):
+            unsigned n;
+            uint8_t lo = 0x80, hi = 0xBF;
+            if (ch < 0xC2) {
+                return false;           // continuation byte, or overlong 2-byte sequence
+            } else if (ch < 0xE0) {
+                n = 1;
+            } else if (ch < 0xF0) {
+                n = 2;
+                if (ch == 0xE0)
+                    lo = 0xA0;          // overlong
+                else if (ch == 0xED)
+                    hi = 0x9F;          // surrogate
+            } else if (ch < 0xF5) {
+                n = 3;
+                if (ch == 0xF0)
+                    lo = 0x90;          // overlong
+                else if (ch == 0xF4)
+                    hi = 0x8F;          // above U+10FFFF
+            } else {
+                return false;
+            }
+            if (_usuallyFalse(end - p <= (ptrdiff_t)n))
+                return false;
+            if (p[1] < lo || p[1] > hi)
+                return false;
+            for (unsigned i = 2; i <= n; ++i) {
+                if ((p[i] & 0xC0) != 0x80)
+                    return false;
+            }
+            p += n + 1;
+        }
+        return true;
+    }
+
+
+#pragma mark - LOOKUP TABLES:
+
+
+    // The vector validators look up three 16-entry tables, indexed by the high and low nibbles
+    // of the previous byte and the high nibble of the current byte. Each entry has a bit for
+    // each kind of error that's possible given that nibble; ANDing the three leaves only the
+    // errors that are actually present in that pair of bytes.
+    enum : uint8_t {
+        kTooShort     = 1 << 0,     // 11______ 0_______  or  11______ 11______
+        kTooLong      = 1 << 1,     // 0_______ 10______
+        kOverlong3    = 1 << 2,     // 11100000 100_____
+        kTooLarge     = 1 << 3,     // 11110100 1001____, 11110100 101_____, 11110101+ 10______
+        kSurrogate    = 1 << 4,     // 11101101 101_____
+        kOverlong2    = 1 << 5,     // 1100000_ 10______
+        kTooLarge1000 = 1 << 6,     // 11110101+ 1000____
+        kOverlong4    = 1 << 6,     // 11110000 1000____
+        kTwoConts     = 1 << 7,     // 10______ 10______
+        kCarry        = kTooShort | kTooLong | kTwoConts,
+    };
+
+    static const uint8_t kByte1High[16] = {
+        kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+        kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+        kTooShort | kOverlong2,
+        kTooShort,
+        kTooShort | kOverlong3 | kSurrogate,
+        kTooShort | kTooLarge | kTooLarge1000 | kOverlong4,
+    };
+
+    static const uint8_t kByte1Low[16] = {
+        kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+        kCarry | kOverlong2,
+        kCarry,
+        kCarry,
+        kCarry | kTooLarge,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+    };
+
+    static const uint8_t kByte2High[16] = {
+        kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+        kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+        kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+        kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+        kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+        kTooShort, kTooShort, kTooShort, kTooShort,
+    };
+
+    // The pair lookups can't see the third and fourth bytes of a sequence; those are found by
+    // checking that a byte 2 or 3 positions after a 3- or 4-byte lead byte is a continuation,
+    // i.e. that its pair lookup came out as exactly kTwoConts.
+    // At the end of a block, a lead byte too close to the end is carried over as "incomplete";
+    // it's an error unless the next block is non-ASCII (and so checked in full.)
+
+
+#pragma mark - AVX2:
+
+
+#ifdef FL_UTF8_AVX2
+    struct AVX2State {
+        __m256i prev, error, prevIncomplete;
+    };
+
+    AVX2_FN
+    static inline __m256i lookupAVX2(const uint8_t table[16], __m256i nibbles) {
+        __m256i t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)table));
+        return _mm256_shuffle_epi8(t, nibbles);
+    }
+
+    AVX2_FN
+    static inline __m256i highNibblesAVX2(__m256i v) {
+        return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+    }
+
+    AVX2_FN
+    static inline void checkBlockAVX2(__m256i input, AVX2State &s) {
+        if (_mm256_movemask_epi8(input) == 0) {
+            // All ASCII:
+            s.error = _mm256_or_si256(s.error, s.prevIncomplete);
+            s.prevIncomplete = _mm256_setzero_si256();
+            s.prev = input;
+            return;
+        }
+        // The input shifted by 1, 2, 3 bytes, with the end of the previous block shifted in:
+        __m256i carried = _mm256_permute2x128_si256(s.prev, input, 0x21);
+        __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+        __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+        __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+        __m256i special = _mm256_and_si256(
+                             _mm256_and_si256(lookupAVX2(kByte1High, highNibblesAVX2(prev1)),
+                                              lookupAVX2(kByte1Low, _mm256_and_si256(prev1,
+                                                                    _mm256_set1_epi8(0x0F)))),
+                             lookupAVX2(kByte2High, highNibblesAVX2(input)));
+        // Bytes >= 0xE0 two back or >= 0xF0 three back get their high bit set:
+        __m256i mustBeCont = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0x60)),
+                                             _mm256_subs_epu8(prev3, _mm256_set1_epi8(0x70)));
+        mustBeCont = _mm256_and_si256(mustBeCont, _mm256_set1_epi8((char)0x80));
+        s.error = _mm256_or_si256(s.error, _mm256_xor_si256(mustBeCont, special));
+
+        // Lead bytes too close to the end of the block:
+        const __m256i kMaxValue = _mm256_setr_epi8(
+                (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+                (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+                (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+                (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+                (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+                (char)(0xF0-1), (char)(0xE0-1), (char)(0xC0-1));
+        s.prevIncomplete = _mm256_subs_epu8(input, kMaxValue);
+        s.prev = input;
+    }
+
+    AVX2_FN
+    static bool validateAVX2(const uint8_t *p, const uint8_t *end) {
+        AVX2State s = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+        for (; end - p >= 32; p += 32)
+            checkBlockAVX2(_mm256_loadu_si256((const __m256i*)p), s);
+        if (p < end) {
+            uint8_t buf[32] = { };          // padded with ASCII NULs
+            memcpy(buf, p, end - p);
+            checkBlockAVX2(_mm256_loadu_si256((const __m256i*)buf), s);
+        }
+        s.error = _mm256_or_si256(s.error, s.prevIncomplete);
+        return _mm256_testz_si256(s.error, s.error);
+    }
+#endif
+
+
+#pragma mark - NEON:
+
+
+#ifdef FL_UTF8_NEON
+    struct NEONState {
+        uint8x16_t prev, error, prevIncomplete;
+    };
+
+    static inline void checkBlockNEON(uint8x16_t input, NEONState &s) {
+        if (vmaxvq_u8(input) < 0x80) {
+            // All ASCII:
+            s.error = vorrq_u8(s.error, s.prevIncomplete);
+            s.prevIncomplete = vdupq_n_u8(0);
+            s.prev = input;
+            return;
+        }
+        // The input shifted by 1, 2, 3 bytes, with the end of the previous block shifted in:
+        uint8x16_t prev1 = vextq_u8(s.prev, input, 15);
+        uint8x16_t prev2 = vextq_u8(s.prev, input, 14);
+        uint8x16_t prev3 = vextq_u8(s.prev, input, 13);
+
+        uint8x16_t special = vandq_u8(vandq_u8(vqtbl1q_u8(vld1q_u8(kByte1High),
+                                                          vshrq_n_u8(prev1, 4)),
+                                               vqtbl1q_u8(vld1q_u8(kByte1Low),
+                                                          vandq_u8(prev1, vdupq_n_u8(0x0F)))),
+                                      vqtbl1q_u8(vld1q_u8(kByte2High), vshrq_n_u8(input, 4)));
+        // Bytes >= 0xE0 two back or >= 0xF0 three back get their high bit set:
+        uint8x16_t mustBeCont = vorrq_u8(vqsubq_u8(prev2, vdupq_n_u8(0x60)),
+                                         vqsubq_u8(prev3, vdupq_n_u8(0x70)));
+        mustBeCont = vandq_u8(mustBeCont, vdupq_n_u8(0x80));
+        s.error = vorrq_u8(s.error, veorq_u8(mustBeCont, special));
+
+        // Lead bytes too close to the end of the block:
+        static const uint8_t kMaxValue[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                              0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                              0xF0-1, 0xE0-1, 0xC0-1};
+        s.prevIncomplete = vqsubq_u8(input, vld1q_u8(kMaxValue));
+        s.prev = input;
+    }
+
+    static bool validateNEON(const uint8_t *p, const uint8_t *end) {
+        NEONState s = {vdupq_n_u8(0), vdupq_n_u8(0), vdupq_n_u8(0)};
+        for (; end - p >= 16; p += 16)
+            checkBlockNEON(vld1q_u8(p), s);
+        if (p < end) {
+            uint8_t buf[16] = { };          // padded with ASCII NULs
+            memcpy(buf, p, end - p);
+            checkBlockNEON(vld1q_u8(buf), s);
+        }
+        return vmaxvq_u8(vorrq_u8(s.error, s.prevIncomplete)) == 0;
+    }
+#endif
+
+
+#pragma mark - VALIDATING:
+
+
+    static Validator bestValidator() {
+#ifdef FL_UTF8_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return validateAVX2;
+#endif
+#ifdef FL_UTF8_NEON
+        return validateNEON;
+#else
+        return validateScalar;
+#endif
+    }
+
+
+    bool IsValidUTF8(slice s) noexcept {
+        auto p = (const uint8_t*)s.buf, end = p + s.size;
+        // Short strings, which are most of them, aren't worth setting up the vectors for:
+        if (s.size < 64)
+            return validateScalar(p, end);
+        static const Validator sValidate = bestValidator();
+        return sValidate(p, end);
+    }
+
+}
@@ -0,0 +1,34 @@
+//
+// UTF8.hh
+//
+// Copyright (c) 2018 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "slice.hh"
+
+
+namespace fleece {
+
+    /** Returns true if the string is well-formed UTF-8: no stray continuation bytes, truncated
+        or overlong sequences, surrogates (U+D800..DFFF) or code points above U+10FFFF.
+
+        Runs of ASCII are skipped 32 or 8 bytes at a time. Other input is checked with the
+        lookup-table algorithm of Keiser & Lemire ("Validating UTF-8 in less than one instruction
+        per byte", 2021) using AVX2 on x86 (if the CPU has it) or NEON on ARM; otherwise with a
+        scalar loop. */
+    bool IsValidUTF8(slice) noexcept;
+
+}
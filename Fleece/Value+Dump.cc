@@ -30,6 +30,14 @@ namespace fleece {
             out << "&";
         switch (tag()) {
             case kSpecialTag:
+                if (sharedStringIndex() >= 0) {
+                    out << "SharedString[#" << sharedStringIndex() << "]";
+                    break;
+                } else if (asCompressedString()) {
+                    out << "CompressedString[" << asCompressedString().size << " bytes]";
+                    break;
+                }
+                // fall through
             case kShortIntTag:
             case kIntTag:
             case kFloatTag:
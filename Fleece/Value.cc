@@ -24,6 +24,9 @@
 #include "varint.hh"
 #include "PlatformCompat.hh"
 #include "JSONEncoder.hh"
+#include "NumConversion.hh"
+#include "SharedKeys.hh"
+#include <algorithm>
 #include <assert.h>
 #include <math.h>
 
@@ -59,6 +62,17 @@ namespace fleece {
                 case kSpecialValueFalse:
                 case kSpecialValueTrue:
                     return kBoolean;
+                case kSpecialValueCompressedString:
+                    return kCompressedString;
+                case kSpecialValueSharedString:
+                case kSpecialValueSharedString+1:
+                case kSpecialValueSharedString+2:
+                case kSpecialValueSharedString+3:
+                    return kSharedString;
+                case kSpecialValueBlobRef:
+                    return kBlobRef;
+                case kSpecialValueSegmentedArray:
+                    return kArray;
                 case kSpecialValueNull:
                 default:
                     return kNull;
@@ -72,7 +86,10 @@ namespace fleece {
     bool Value::asBool() const noexcept {
         switch (tag()) {
             case kSpecialTag:
-                return tinyValue() == kSpecialValueTrue;
+                return tinyValue() == kSpecialValueTrue || sharedStringIndex() >= 0
+                    || tinyValue() == kSpecialValueCompressedString
+                    || tinyValue() == kSpecialValueBlobRef
+                    || tinyValue() == kSpecialValueSegmentedArray;
             case kShortIntTag:
             case kIntTag:
             case kFloatTag:
@@ -150,15 +167,15 @@ namespace fleece {
     }
 
     alloc_slice Value::toString() const {
-        char buf[32], *str = buf;
+        char buf[kMaxNumberLength + 1], *str = buf;
         switch (tag()) {
             case kShortIntTag:
             case kIntTag: {
                 int64_t i = asInt();
                 if (isUnsigned())
-                    sprintf(str, "%llu", (unsigned long long)i);
+                    str[WriteUInt(i, str)] = '\0';
                 else
-                    sprintf(str, "%lld", (long long)i);
+                    str[WriteInt(i, str)] = '\0';
                 break;
             }
             case kSpecialTag: {
@@ -172,6 +189,21 @@ namespace fleece {
                     case kSpecialValueTrue:
                         str = (char*)"true";
                         break;
+                    case kSpecialValueSharedString:
+                    case kSpecialValueSharedString+1:
+                    case kSpecialValueSharedString+2:
+                    case kSpecialValueSharedString+3:
+                        FleeceException::_throw(InvalidData,
+                                                "Shared string can't be read without its pool");
+                    case kSpecialValueCompressedString:
+                        FleeceException::_throw(InvalidData,
+                                        "Compressed string can't be read without its compressor");
+                    case kSpecialValueBlobRef:
+                        str = (char*)"{blob}";
+                        break;
+                    case kSpecialValueSegmentedArray:
+                        str = (char*)"{segmented array}";
+                        break;
                     default:
                         str = (char*)"{?special?}";
                         break;
@@ -180,9 +212,9 @@ namespace fleece {
             }
             case kFloatTag: {
                 if (_byte[0] & 0x8)
-                    sprintf(str, "%.16g", asDouble());
+                    str[WriteDouble(asDouble(), str)] = '\0';
                 else
-                    sprintf(str, "%.6g", asFloat());
+                    str[WriteFloat(asFloat(), str)] = '\0';
                 break;
             }
             default:
@@ -195,16 +227,51 @@ namespace fleece {
         return _usuallyTrue(tag() == kStringTag) ? getStringBytes() : nullslice;
     }
 
+    slice Value::asString(const SharedKeys *sharedValues) const {
+        int index = sharedStringIndex();
+        if (_usuallyTrue(index < 0))
+            return asString();
+        throwIf(!sharedValues, InvalidData, "Shared string can't be read without its pool");
+        slice str = sharedValues->decode(index);
+        throwIf(!str, InvalidData, "Shared string isn't in the pool");
+        return str;
+    }
+
+    slice Value::asCompressedString() const noexcept {
+        if (_usuallyTrue(tag() != kSpecialTag || tinyValue() != kSpecialValueCompressedString))
+            return nullslice;
+        slice s(&_byte[2], kMaxVarintLen32);
+        uint32_t size;
+        ReadUVarInt32(&s, &size);
+        return slice(s.buf, size);
+    }
+
+    bool Value::asBlobRef(slice &digest, uint64_t &length) const noexcept {
+        if (_usuallyTrue(tag() != kSpecialTag || tinyValue() != kSpecialValueBlobRef))
+            return false;
+        digest = slice(&_byte[2], kBlobRefDigestSize);
+        slice s(&_byte[2 + kBlobRefDigestSize], kMaxVarintLen64);
+        return ReadUVarInt(&s, &length);
+    }
+
     slice Value::asData() const noexcept {
         return _usuallyTrue(tag() == kBinaryTag) ? getStringBytes() : nullslice;
     }
 
     const Array* Value::asArray() const noexcept {
-        if (_usuallyFalse(tag() != kArrayTag))
-            return nullptr;
+        if (_usuallyFalse(tag() != kArrayTag)) {
+            if (tag() != kSpecialTag || tinyValue() != kSpecialValueSegmentedArray)
+                return nullptr;
+        }
         return (const Array*)this;
     }
 
+    const Array* Value::segmentIndex() const noexcept {
+        if (_usuallyTrue(tag() != kSpecialTag || tinyValue() != kSpecialValueSegmentedArray))
+            return nullptr;
+        return (const Array*)deref<true>((const Value*)&_byte[2]);
+    }
+
     const Dict* Value::asDict() const noexcept {
         if (_usuallyFalse(tag() != kDictTag))
             return nullptr;
@@ -298,6 +365,52 @@ namespace fleece {
                 return true;
             }
         }
+        if (_usuallyFalse(t == kSpecialTag && tinyValue() == kSpecialValueCompressedString)) {
+            // Make sure the size varint is in range before dataSize() reads it:
+            if (_usuallyFalse(&_byte[2] > (const uint8_t*)dataEnd))
+                return false;
+            slice s(&_byte[2], std::min((size_t)kMaxVarintLen32,
+                                        (size_t)((const uint8_t*)dataEnd - &_byte[2])));
+            uint32_t size;
+            if (_usuallyFalse(!ReadUVarInt32(&s, &size)))
+                return false;
+        } else if (_usuallyFalse(t == kSpecialTag && tinyValue() == kSpecialValueSegmentedArray)) {
+            // Check the count and the index, which must be an array of arrays whose counts add
+            // up to the count:
+            auto countStart = &_byte[2 + kWide];
+            if (_usuallyFalse(countStart > (const uint8_t*)dataEnd))
+                return false;
+            slice s(countStart, std::min((size_t)kMaxVarintLen32,
+                                         (size_t)((const uint8_t*)dataEnd - countStart)));
+            uint32_t count;
+            if (_usuallyFalse(!ReadUVarInt32(&s, &count)))
+                return false;
+            auto indexPtr = (const Value*)&_byte[2];
+            if (_usuallyFalse(!indexPtr->isPointer()))
+                return false;
+            auto index = indexPtr->carefulDeref(true, dataStart, this);
+            if (_usuallyFalse(!index || index->tag() != kArrayTag
+                                     || !index->validate(dataStart, this)))
+                return false;
+            uint64_t total = 0;
+            for (Array::iterator i((const Array*)index); i; ++i) {
+                if (_usuallyFalse(i.value()->tag() != kArrayTag))
+                    return false;
+                total += ((const Array*)i.value())->count();
+            }
+            if (_usuallyFalse(total != count))
+                return false;
+        } else if (_usuallyFalse(t == kSpecialTag && tinyValue() == kSpecialValueBlobRef)) {
+            // Likewise for the length varint following the digest:
+            auto lengthStart = &_byte[2 + kBlobRefDigestSize];
+            if (_usuallyFalse(lengthStart > (const uint8_t*)dataEnd))
+                return false;
+            slice s(lengthStart, std::min((size_t)kMaxVarintLen64,
+                                          (size_t)((const uint8_t*)dataEnd - lengthStart)));
+            uint64_t length;
+            if (_usuallyFalse(!ReadUVarInt(&s, &length)))
+                return false;
+        }
         // Default: just check that size fits:
         return offsetby(this, dataSize()) <= dataEnd;
     }
@@ -305,8 +418,16 @@ namespace fleece {
     // This does not include the inline items in arrays/dicts
     size_t Value::dataSize() const noexcept {
         switch(tag()) {
-            case kShortIntTag:
-            case kSpecialTag:   return 2;
+            case kSpecialTag:   if (_usuallyFalse(tinyValue() == kSpecialValueCompressedString))
+                                    return (uint8_t*)asCompressedString().end() - (uint8_t*)this;
+                                if (_usuallyFalse(tinyValue() == kSpecialValueBlobRef))
+                                    return (uint8_t*)SkipVarInt(&_byte[2 + kBlobRefDigestSize])
+                                                - (uint8_t*)this;
+                                if (_usuallyFalse(tinyValue() == kSpecialValueSegmentedArray))
+                                    return (uint8_t*)SkipVarInt(&_byte[2 + kWide])
+                                                - (uint8_t*)this;
+                                return 2;
+            case kShortIntTag:  return 2;
             case kFloatTag:     return isDouble() ? 10 : 6;
             case kIntTag:       return 2 + (tinyValue() & 0x07);
             case kStringTag:
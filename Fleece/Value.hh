@@ -36,7 +36,8 @@ namespace fleece {
     class SharedKeys;
 
 
-    /* Types of values -- same as JSON types, plus binary data */
+    /* Types of values -- same as JSON types, plus binary data, plus kinds of value whose
+       contents are stored outside the document and have to be resolved by the reader */
     enum valueType : uint8_t {
         kNull = 0,
         kBoolean,
@@ -44,7 +45,10 @@ namespace fleece {
         kString,
         kData,
         kArray,
-        kDict
+        kDict,
+        kSharedString,      // A string in an external pool; see asString(const SharedKeys*)
+        kCompressedString,  // A compressed string; see asCompressedString()
+        kBlobRef,           // A reference to binary data in a BlobStore; see asBlobRef()
     };
 
 
@@ -105,7 +109,32 @@ namespace fleece {
         /** Returns the exact contents of a string. Other types return a null slice. */
         slice asString() const noexcept;
 
-        /** Returns the exact contents of a binary data value. Other types return a null slice. */
+        /** Like asString, but also resolves a shared string (type kSharedString; see
+            Encoder::setSharedValues) through the pool it was encoded with. Throws InvalidData
+            if the pool is null or doesn't contain the string. */
+        slice asString(const SharedKeys *sharedValues) const;
+
+        /** If this is a shared string, returns its index in the pool; otherwise returns -1.
+            Shared strings are equal if and only if their indexes are. */
+        int sharedStringIndex() const noexcept {
+            if (tag() != internal::kSpecialTag
+                    || (tinyValue() & 0x0C) != internal::kSpecialValueSharedString)
+                return -1;
+            return ((tinyValue() & 0x03) << 8) | _byte[1];
+        }
+
+        /** If this is a compressed string (type kCompressedString; see
+            Encoder::setStringCompressor), returns its compressed form, to be given to the
+            StringCompressor's decompress() method; otherwise returns a null slice. */
+        slice asCompressedString() const noexcept;
+
+        /** If this is a blob reference (type kBlobRef; see Encoder::setBlobStore), sets `digest`
+            to the SHA-256 digest of the blob's contents and `length` to its size, and returns
+            true. The blob is fetched from a BlobStore by its key (BlobKey::fromDigest.) */
+        bool asBlobRef(slice &digest, uint64_t &length) const noexcept;
+
+        /** Returns the exact contents of a binary data value. Other types, including blob
+            references (kBlobRef), return a null slice. */
         slice asData() const noexcept;
 
         /** If this value is an array, returns it cast to 'const Array*', else returns nullptr. */
@@ -186,6 +215,7 @@ namespace fleece {
 
         // arrays/dicts:
         bool isWideArray() const noexcept     {return (_byte[0] & 0x08) != 0;}
+        const Array* segmentIndex() const noexcept;   // non-null only for a segmented array
         uint32_t countValue() const noexcept  {return (((uint32_t)_byte[0] << 8) | _byte[1]) & 0x07FF;}
         bool countIsZero() const noexcept     {return _byte[1] == 0 && (_byte[0] & 0x7) == 0;}
 
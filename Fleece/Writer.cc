@@ -17,15 +17,25 @@
 //
 
 #include "Writer.hh"
+#include "Base64.hh"
+#include "FleeceException.hh"
 #include "PlatformCompat.hh"
-#include "decode.h"
-#include "encode.h"
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
 #include <algorithm>
 
+#ifdef _MSC_VER
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
 
 namespace fleece {
 
+    const size_t Writer::kMaxChunkSizeHint;
+
     Writer::Writer(size_t initialCapacity)
     :_chunkSize(initialCapacity),
      _length(0)
@@ -44,7 +54,7 @@ namespace fleece {
 
     Writer::~Writer() {
         for (auto &chunk : _chunks)
-            freeChunk(chunk);
+            chunk.free();
     }
 
     Writer& Writer::operator= (Writer&& w) noexcept {
@@ -54,18 +64,57 @@ namespace fleece {
     }
 
     void Writer::reset() {
-        size_t size = _chunks.size();
-        if (size == 0) {
-            addChunk(_chunkSize);
-        } else {
-            if (size > 1) {
-                for (size_t i = 0; i < size-1; i++)
-                    freeChunk(_chunks[i]);
-                _chunks.erase(_chunks.begin(), _chunks.end() - 1);
-            }
-            _chunks[0].reset();
+        for (auto &chunk : _chunks)
+            freeChunk(chunk);
+        _chunks.clear();
+        // If the next output needs a bigger chunk than _initialBuf, start with an empty one;
+        // the first write replaces it with a _chunkSize chunk, so nothing's allocated till then.
+        _chunks.emplace_back(_initialBuf, _chunkSize <= kDefaultInitialCapacity ? sizeof(_initialBuf)
+                                                                                : 0);
+        _length = _flushedLength = 0;
+    }
+
+    void Writer::setSink(Sink sink, bool autoFlush) {
+        throwIf(_length > 0, InternalError, "can't set a sink after writing");
+        _sink = std::move(sink);
+        _autoFlush = autoFlush;
+    }
+
+    void Writer::flush() {
+        if (!_sink)
+            return;
+        for (auto &chunk : _chunks) {
+            if (chunk.length() > 0)
+                _sink(chunk.contents());
+        }
+        // Free all the chunks but the last, and continue writing at its start:
+        if (_chunks.size() > 1) {
+            for (size_t i = 0; i < _chunks.size() - 1; ++i)
+                freeChunk(_chunks[i]);
+            _chunks.erase(_chunks.begin(), _chunks.end() - 1);
         }
-        _length = 0;
+        _chunks[0].reset();
+        _flushedLength = _length;
+    }
+
+    Writer::Sink Writer::fileSink(int fd) {
+        return [fd](slice data) {
+            while (data.size > 0) {
+                auto size = (unsigned)std::min(data.size, (size_t)1 << 30);
+#ifdef _MSC_VER
+                auto n = ::_write(fd, data.buf, size);
+#else
+                auto n = ::write(fd, data.buf, size);
+#endif
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw FleeceException(InternalError,
+                                          std::string("Can't write output: ") + strerror(errno));
+                }
+                data.moveStart(n);
+            }
+        };
     }
 
     const void* Writer::curPos() const {
@@ -73,7 +122,7 @@ namespace fleece {
     }
 
     size_t Writer::posToOffset(const void *pos) const {
-        size_t offset = 0;
+        size_t offset = _flushedLength;
         for (auto &chunk : _chunks) {
             if (chunk.contains(pos))
                 return offset + chunk.offsetOf(pos);
@@ -99,8 +148,19 @@ namespace fleece {
     }
 
     const void* Writer::writeToNewChunk(const void* data, size_t length) {
-        if (_usuallyTrue(_chunkSize <= 64*1024))
+        if (_autoFlush) {
+            flush();
+            const void *result = _chunks.back().write(data, length);
+            if (result)
+                return result;
+        }
+        if (_usuallyFalse(_chunks.back().length() == 0)) {
+            // Nothing's in the current chunk (as after reset), so replace it instead of growing:
+            freeChunk(_chunks.back());
+            _chunks.pop_back();
+        } else if (_usuallyTrue(_chunkSize <= 64*1024)) {
             _chunkSize *= 2;
+        }
         addChunk(std::max(length, _chunkSize));
         const void *result = _chunks.back().write(data, length);
         assert(result);
@@ -112,13 +172,51 @@ namespace fleece {
         ::memcpy((void*)pos, data.buf, data.size);
     }
 
+    void Writer::truncate(size_t newLength) {
+        assert(newLength <= _length);
+        throwIf(newLength < _flushedLength, InternalError, "can't truncate flushed output");
+        // Free the chunks that start after the new end:
+        size_t end = _length;
+        while (end - _chunks.back().length() > newLength) {
+            end -= _chunks.back().length();
+            freeChunk(_chunks.back());
+            _chunks.pop_back();
+        }
+        auto &chunk = _chunks.back();
+        chunk.truncate(chunk.length() - (end - newLength));
+        _length = newLength;
+    }
+
+    // Adds a chunk with at least the given capacity, reusing a spare one if possible.
     void Writer::addChunk(size_t capacity) {
+        for (auto i = _spareChunks.begin(); i != _spareChunks.end(); ++i) {
+            if (i->capacity() >= capacity) {
+                _chunks.push_back(std::move(*i));
+                _spareChunks.erase(i);
+                return;
+            }
+        }
         _chunks.emplace_back(capacity);
     }
 
+    // Keeps a chunk that's no longer needed as a spare, unless there are enough of those.
     void Writer::freeChunk(Chunk &chunk) {
-        if (chunk.start() != &_initialBuf)
+        if (!chunk.isAllocated())
+            return;                         // it's _initialBuf (or has been extracted)
+        if (_spareChunks.size() < kMaxSpareChunks) {
+            chunk.reset();
+            _spareChunks.push_back(std::move(chunk));
+        } else {
             chunk.free();
+        }
+    }
+
+    bool Writer::contains(const void *ptr) const {
+        for (auto &chunk : _chunks) {
+            if (chunk.contains(ptr))
+                return true;
+        }
+        return false;
     }
 
     std::vector<slice> Writer::output() const {
@@ -129,17 +227,35 @@ namespace fleece {
         return result;
     }
 
+    void Writer::copyOutput(size_t offset, void *dst, size_t length) const {
+        assert(offset + length <= _length);
+        assert(offset >= _flushedLength);
+        offset -= _flushedLength;
+        for (auto &chunk : _chunks) {
+            slice contents = chunk.contents();
+            if (offset < contents.size) {
+                size_t n = std::min(length, contents.size - offset);
+                memcpy(dst, contents.offset(offset), n);
+                dst = offsetby(dst, n);
+                length -= n;
+                if (length == 0)
+                    return;
+                offset = 0;
+            } else {
+                offset -= contents.size;
+            }
+        }
+    }
+
     alloc_slice Writer::extractOutput() {
         alloc_slice output;
-#if 0 //TODO: Restore this optimization
-        if (_chunks.size() == 1 && _chunks[0].start() != &_initialBuf) {
-            _chunks[0].resizeToFit();
-            output = alloc_slice::adopt(_chunks[0].contents());
+        if (_sink) {
+            flush();
+        } else if (_chunks.size() == 1 && _chunks[0].isAllocated()) {
+            // The chunk's memory is already an alloc_slice, so it can be handed over as-is:
+            output = _chunks[0].extract();
             _chunks.clear();
-            _length = 0;
-        } else
-#endif
-        {
+        } else {
             output = alloc_slice(length());
             void* dst = (void*)output.buf;
             for (auto &chunk : _chunks) {
@@ -147,8 +263,13 @@ namespace fleece {
                 memcpy(dst, contents.buf, contents.size);
                 dst = offsetby(dst, contents.size);
             }
-            reset();
+            // Start the next output with room for this much (plus some), so it fits in one chunk,
+            // unless it's huge:
+            if (_chunks.size() > 1)
+                _chunkSize = std::max(_chunkSize, std::min(length() + length() / 4,
+                                                           kMaxChunkSizeHint));
         }
+        reset();
         return output;
     }
 
@@ -161,21 +282,21 @@ namespace fleece {
     { }
 
     Writer::Chunk::Chunk(size_t capacity)
-    :_start(::malloc(capacity)),
-    _available(_start, capacity)
-    {
-        if (_usuallyFalse(!_start))
-            throw std::bad_alloc();
-    }
+    :_buffer(capacity),
+     _start((void*)_buffer.buf),
+     _available(_start, capacity)
+    { }
 
     Writer::Chunk::Chunk(Chunk&& c) noexcept
-    :_start(c._start),
+    :_buffer(std::move(c._buffer)),
+     _start(c._start),
      _available(c._available)
     {
         c._start = nullptr;
     }
 
     Writer::Chunk& Writer::Chunk::operator=(Chunk&& c) noexcept {
+        _buffer = std::move(c._buffer);
         _start = c._start;
         _available = c._available;
         c._start = nullptr;
@@ -184,8 +305,22 @@ namespace fleece {
 
 
     void Writer::Chunk::free() noexcept {
-        ::free(_start);
+        _buffer.reset();
+        _start = nullptr;
+    }
+
+    // Returns the chunk's contents and leaves the chunk empty. The memory is only reallocated to
+    // fit if most of it is unused.
+    alloc_slice Writer::Chunk::extract() {
+        size_t len = length();
+        alloc_slice result = std::move(_buffer);
+        if (result.size - len > len)
+            result.resize(len);
+        else
+            result.shorten(len);
         _start = nullptr;
+        _available = nullslice;
+        return result;
     }
 
     const void* Writer::Chunk::write(const void* data, size_t length) {
@@ -205,35 +340,24 @@ namespace fleece {
         return true;
     }
 
-    void Writer::Chunk::resizeToFit() noexcept {
-        size_t len = length();
-        void *newStart = ::realloc(_start, len);
-        if (newStart)
-            _start = newStart;
-        _available = slice(offsetby(newStart,len), (size_t)0);
-    }
-
 
 #pragma mark - BASE64:
 
 
     void Writer::writeBase64(slice data) {
-        size_t base64size = ((data.size + 2) / 3) * 4;
-        auto dst = (char*)reserveSpace(base64size);
-        base64::encoder enc;
-        enc.set_chars_per_line(0);
-        size_t written = enc.encode(data.buf, data.size, dst);
-        written += enc.encode_end(dst + written);
-        assert((size_t)written == base64size);
+        size_t base64size = Base64EncodedSize(data.size);
+        size_t written = EncodeBase64(data, (void*)reserveSpace(base64size));
+        assert(written == base64size);
         (void)written;      // suppresses 'unused value' warning in release builds
     }
 
 
     void Writer::writeDecodedBase64(slice base64) {
-        base64::decoder dec;
-        std::vector<char> buf((base64.size + 3) / 4 * 3);
-        size_t len = dec.decode(base64.buf, base64.size, buf.data());
-        write(buf.data(), len);
+        // Decode straight into the output, then give back whatever wasn't needed:
+        size_t maxSize = Base64MaxDecodedSize(base64.size);
+        size_t len = DecodeBase64(base64, (void*)reserveSpace(maxSize));
+        if (len < maxSize)
+            truncate(_length - (maxSize - len));
     }
 
 }
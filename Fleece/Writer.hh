@@ -19,6 +19,7 @@
 #pragma once
 
 #include "slice.hh"
+#include <functional>
 #include <vector>
 
 namespace fleece {
@@ -37,15 +38,44 @@ namespace fleece {
 
         void reset();
 
+        /** A destination for output; it's called with each piece of the output, in order. */
+        using Sink = std::function<void(slice)>;
+
+        /** Makes the Writer pass its output to a sink instead of keeping all of it in memory.
+            If `autoFlush` is true, whenever a chunk fills up all the output so far is flushed
+            to the sink and the chunks are reused; otherwise that only happens when flush() is
+            called. Flushed data can't be read back or rewritten. Must be called before
+            anything is written. */
+        void setSink(Sink sink, bool autoFlush =true);
+
+        /** Passes all the output written so far to the sink. */
+        void flush();
+
+        /** The number of bytes that have been passed to the sink. */
+        size_t flushedLength() const            {return _flushedLength;}
+
+        /** Returns a Sink that writes to a file descriptor. It throws if a write fails. */
+        static Sink fileSink(int fd);
+
+        /** The total number of bytes written, including any that have been flushed. */
         size_t length() const                   {return _length;}
         const void* curPos() const;
         size_t posToOffset(const void *pos NONNULL) const;
 
-        /** Returns the data written, in pieces. Does not change the state of the Writer. */
+        /** Returns the data written (since the last flush), in pieces. Does not change the state
+            of the Writer. */
         std::vector<slice> output() const;
 
+        /** Copies already-written data, starting at `offset` in the output, to `dst`. */
+        void copyOutput(size_t offset, void *dst NONNULL, size_t length) const;
+
         /** Returns the data written. The Writer stops managing this memory; it now belongs to
-            the caller and will be freed when no more alloc_slices refer to it. */
+            the caller and will be freed when no more alloc_slices refer to it.
+            If the output fits in a single chunk, that chunk is handed over without copying.
+            Otherwise it's copied, and the Writer's next output will go in a chunk big enough to
+            hold this much (up to kMaxChunkSizeHint), so it can be handed over next time. That
+            chunk isn't allocated until something is written.
+            If there's a sink, this instead flushes the rest of the output and returns null. */
         alloc_slice extractOutput();
 
         const void* write(const void* data, size_t length);
@@ -70,7 +100,14 @@ namespace fleece {
             @param newData  The data that replaces the old */
         void rewrite(const void *pos NONNULL, slice newData);
 
+        /** Discards everything written after the first `length` bytes. */
+        void truncate(size_t length);
+
+        /** Returns true if `ptr` points to output that's still in memory. */
+        bool contains(const void *ptr) const;
+
     private:
+        // A chunk's memory is an alloc_slice (except for _initialBuf), so it can be extracted.
         class Chunk {
         public:
             Chunk(size_t capacity);
@@ -79,10 +116,12 @@ namespace fleece {
             Chunk(const Chunk&) =delete;
             Chunk& operator=(Chunk&&) noexcept;
             void free() noexcept;
+            alloc_slice extract();
+            bool isAllocated() const  {return _buffer.buf != nullptr;}
             void reset()              {_available.setStart(_start);}
+            void truncate(size_t len) {_available.setStart(offsetby(_start, len));}
             const void* write(const void* data, size_t length);
             bool pad();
-            void resizeToFit() noexcept;
             void* start()             {return _start;}
             size_t length() const     {return (int8_t*)_available.buf - (int8_t*)_start;}
             size_t capacity() const   {return (int8_t*)_available.end() - (int8_t*)_start;}
@@ -91,10 +130,17 @@ namespace fleece {
             bool contains(const void *ptr) const   {return ptr >= _start && ptr <= _available.buf;}
             size_t offsetOf(const void *ptr) const {return (int8_t*)ptr - (int8_t*)_start;}
         private:
+            alloc_slice _buffer;
             void *_start;
             slice _available;
         };
 
+        // Max number of freed chunks kept for reuse:
+        static const size_t kMaxSpareChunks = 4;
+
+        // Max size of chunk that extractOutput will make the next output start with:
+        static const size_t kMaxChunkSizeHint = 16 * 1024 * 1024;
+
         const void* writeToNewChunk(const void* data, size_t length);
         void addChunk(size_t capacity);
         void freeChunk(Chunk &chunk);
@@ -103,8 +149,12 @@ namespace fleece {
         const Writer& operator=(const Writer&) = delete;
 
         std::vector<Chunk> _chunks;
+        std::vector<Chunk> _spareChunks;    // Freed chunks, to be reused by addChunk
         size_t _chunkSize;
         size_t _length;
+        size_t _flushedLength {0};          // Number of bytes passed to _sink
+        Sink _sink;                         // Where output goes, if anywhere
+        bool _autoFlush {false};            // Flush to _sink whenever a chunk fills up?
         uint8_t _initialBuf[kDefaultInitialCapacity];
     };
 
@@ -17,14 +17,15 @@
 //
 
 #include "slice.hh"
-#include "encode.h"
-#include "decode.h"
+#include "Allocator.hh"
+#include "Base64.hh"
 #include "Fleece.h" // for FLSlice and FLSliceResult
 #include <algorithm>
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>
 #include <atomic>
+#include <new>
 #ifdef _MSC_VER
 #include "memmem.h"
 #endif
@@ -243,13 +244,9 @@ namespace fleece {
 
     std::string pure_slice::base64String() const {
         std::string str;
-        size_t strLen = ((size + 2) / 3) * 4;
+        size_t strLen = Base64EncodedSize(size);
         str.resize(strLen);
-        char *dst = &str[0];
-        base64::encoder enc;
-        enc.set_chars_per_line(0);
-        size_t written = enc.encode(buf, size, dst);
-        written += enc.encode_end(dst + written);
+        size_t written = EncodeBase64(slice(buf, size), &str[0]);
         assert(written == strLen);
         (void)written;  // avoid compiler warning in release build when 'assert' is a no-op
         return str;
@@ -257,11 +254,9 @@ namespace fleece {
 
 
     slice pure_slice::readBase64Into(pure_slice output) const {
-        size_t expectedLen = (size + 3) / 4 * 3;
-        if (expectedLen > output.size)
+        if (Base64MaxDecodedSize(size) > output.size)
             return nullslice;
-        base64::decoder dec;
-        size_t len = dec.decode(buf, size, (void*)output.buf);
+        size_t len = DecodeBase64(slice(buf, size), (void*)output.buf);
         assert(len <= output.size);
         return slice(output.buf, len);
     }
@@ -279,6 +274,8 @@ namespace fleece {
 
 
     struct alloc_slice::sharedBuffer {
+        Allocator* _allocator;              // The allocator that allocated this block
+        size_t _capacity;                   // Allocated size of _buf
         std::atomic<uint32_t> _refCount {1};
         uint8_t _buf[4];
 
@@ -292,16 +289,21 @@ namespace fleece {
 
         inline void release() noexcept {
             assertHeapBlock(this);
-            if (--_refCount == 0)
-                delete this;
-        }
-
-        static inline void* operator new(size_t basicSize, size_t bufferSize) {
-            return ::operator new(basicSize - sizeof(sharedBuffer::_buf) + bufferSize);
+            if (--_refCount == 0) {
+                Allocator *allocator = _allocator;
+                size_t blockSize = offsetof(sharedBuffer, _buf) + _capacity;
+                this->~sharedBuffer();
+                allocator->deallocate(this, blockSize);
+            }
         }
 
         static inline sharedBuffer* newBuffer(size_t size) {
-            return new(size) sharedBuffer;
+            Allocator &allocator = Allocator::current();
+            void *block = allocator.allocateOrThrow(offsetof(sharedBuffer, _buf) + size);
+            auto buffer = new (block) sharedBuffer;
+            buffer->_allocator = &allocator;
+            buffer->_capacity = size;
+            return buffer;
         }
 
         static inline slice newSlice(size_t size) {
@@ -310,12 +312,11 @@ namespace fleece {
 
         inline sharedBuffer* realloc(size_t newSize) {
             assertHeapBlock(this);
-            return slice::reallocBytes(this, offsetof(sharedBuffer, _buf) + newSize);
-        }
-
-        static inline void operator delete(void* ptr) {
-            assertHeapBlock(ptr);
-            ::operator delete(ptr);
+            auto buffer = (sharedBuffer*)_allocator->reallocateOrThrow(
+                                                this, offsetof(sharedBuffer, _buf) + _capacity,
+                                                offsetof(sharedBuffer, _buf) + newSize);
+            buffer->_capacity = newSize;
+            return buffer;
         }
     };
 
@@ -116,6 +116,13 @@ namespace fleece {
                 return asString().asNSString(sharedStrings);
             case kData:
                 return asData().copiedNSData();
+            case kSharedString:
+                FleeceException::_throw(InvalidData, "Shared string can't be read without its pool");
+            case kCompressedString:
+                FleeceException::_throw(InvalidData,
+                                        "Compressed string can't be read without its compressor");
+            case kBlobRef:
+                FleeceException::_throw(InvalidData, "Blob has to be fetched from its BlobStore");
             case kArray: {
                 auto iter = asArray()->begin();
                 auto result = [[NSMutableArray alloc] initWithCapacity: iter.count()];
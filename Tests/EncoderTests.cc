@@ -18,13 +18,25 @@
 
 #include "FleeceTests.hh"
 #include "JSONConverter.hh"
+#include "NDJSONConverter.hh"
+#include "UTF8.hh"
+#include "JSONEncoder.hh"
 #include "KeyTree.hh"
 #include "Path.hh"
+#include "StructFields.hh"
+#include "BaseStringIndex.hh"
+#include "StringCompressor.hh"
+#include "Allocator.hh"
+#include "Base64.hh"
+#include "NumConversion.hh"
+#include "BlobStore.hh"
 #include "Internal.hh"
 #include "jsonsl.h"
 #include "mn_wordlist.h"
+#include <functional>
 #include <iostream>
 #include <float.h>
+#include <random>
 
 
 namespace fleece {
@@ -412,6 +424,134 @@ public:
         testArrayOfLength(0xFFFF);
     }
 
+    TEST_CASE_METHOD(EncoderTests, "BulkArrays", "[Encoder]") {
+        // writeArray must produce exactly what writing the items one by one does:
+        auto compare = [&](std::function<void(Encoder&)> bulk, std::function<void(Encoder&)> each) {
+            Encoder enc1, enc2;
+            bulk(enc1);
+            enc2.beginArray();
+            each(enc2);
+            enc2.endArray();
+            REQUIRE(enc1.extractOutput() == enc2.extractOutput());
+        };
+
+        const int64_t ints[] = {0, 1, -2048, 2047, 2048, -2049, 12345678, INT64_MAX, INT64_MIN};
+        compare([&](Encoder &e) {e.writeArray(ints, 9);},
+                [&](Encoder &e) {for (auto i : ints) e.writeInt(i);});
+        const double doubles[] = {0.0, -1.0, 3.5, 1e100, 3.14159265358979, 123456.0, -0.125};
+        compare([&](Encoder &e) {e.writeArray(doubles, 7);},
+                [&](Encoder &e) {for (auto d : doubles) e.writeDouble(d);});
+        const float floats[] = {0.0f, 17.0f, 3.25f, -1e30f, 1e6f};
+        compare([&](Encoder &e) {e.writeArray(floats, 5);},
+                [&](Encoder &e) {for (auto f : floats) e.writeFloat(f);});
+        const bool bools[] = {true, false, false, true};
+        compare([&](Encoder &e) {e.writeArray(bools, 4);},
+                [&](Encoder &e) {for (auto b : bools) e.writeBool(b);});
+        const slice strings[] = {"a"_sl, "hello"_sl, ""_sl, "hello"_sl};
+        compare([&](Encoder &e) {e.writeArray(strings, 4);},
+                [&](Encoder &e) {for (auto str : strings) e.writeString(str);});
+
+        // Inside a dictionary:
+        enc.beginDictionary();
+        enc.writeKey("n");
+        enc.writeArray(ints, 9);
+        enc.endDictionary();
+        endEncoding();
+        auto d = Value::fromData(result)->asDict();
+        REQUIRE(d);
+        auto a = d->get("n"_sl)->asArray();
+        REQUIRE(a->count() == 9);
+        for (unsigned i = 0; i < 9; ++i)
+            REQUIRE(a->get(i)->asInt() == ints[i]);
+    }
+
+    struct Pet {
+        std::string species;
+        int legs;
+    };
+    FLEECE_FIELDS(Pet, species, legs)
+
+    struct Person {
+        std::string name;
+        int64_t age {0};
+        bool isActive {false};
+        double balance {0};
+        std::vector<std::string> tags;
+        std::vector<int64_t> scores;
+        std::vector<Pet> pets;
+    };
+    FLEECE_FIELDS(Person, name, age, isActive, balance, tags, scores, pets)
+
+    TEST_CASE_METHOD(EncoderTests, "StructFields", "[Encoder]") {
+        Person p;
+        p.name = "Alice";
+        p.age = 34;
+        p.isActive = true;
+        p.balance = 1234.5;
+        p.tags = {"admin", "x"};
+        p.scores = {1, 100000, -7};
+        p.pets = {{"cat", 4}, {"bird", 2}};
+
+        // The fields are written in key order, just as if by hand:
+        encodeStruct(enc, p);
+        endEncoding();
+        alloc_slice viaStruct = result;
+        enc.beginDictionary();
+        enc.writeKey("age");        enc.writeInt(p.age);
+        enc.writeKey("balance");    enc.writeDouble(p.balance);
+        enc.writeKey("isActive");   enc.writeBool(p.isActive);
+        enc.writeKey("name");       enc.writeString(p.name);
+        enc.writeKey("pets");
+        enc.beginArray();
+        for (auto &pet : p.pets) {
+            enc.beginDictionary();
+            enc.writeKey("legs");       enc.writeInt(pet.legs);
+            enc.writeKey("species");    enc.writeString(pet.species);
+            enc.endDictionary();
+        }
+        enc.endArray();
+        enc.writeKey("scores");     enc.writeArray(p.scores.data(), p.scores.size());
+        enc.writeKey("tags");
+        enc.beginArray();
+        for (auto &tag : p.tags)
+            enc.writeString(tag);
+        enc.endArray();
+        enc.endDictionary();
+        endEncoding();
+        REQUIRE(viaStruct == result);
+
+        Person p2;
+        REQUIRE(decodeStruct(Value::fromData(viaStruct), p2));
+        CHECK(p2.name == p.name);
+        CHECK(p2.age == p.age);
+        CHECK(p2.isActive == p.isActive);
+        CHECK(p2.balance == p.balance);
+        CHECK(p2.tags == p.tags);
+        CHECK(p2.scores == p.scores);
+        REQUIRE(p2.pets.size() == 2);
+        CHECK(p2.pets[1].species == "bird");
+        CHECK(p2.pets[1].legs == 2);
+        CHECK(!decodeStruct(Value::fromData(viaStruct)->asDict()->get("tags"_sl), p2));
+
+        // With shared keys:
+        SharedKeys sk;
+        int key;
+        sk.encodeAndAdd("tags"_sl, key);    // so the shared keys aren't in alphabetical order
+        enc.setSharedKeys(&sk);
+        encodeStruct(enc, p);
+        endEncoding();
+        enc.setSharedKeys(nullptr);
+        auto dict = Value::fromData(result)->asDict();
+        REQUIRE(dict);
+        REQUIRE(dict->get("name"_sl, &sk)->asString() == "Alice"_sl);
+        Person p3;
+        REQUIRE(decodeStruct(dict, p3, &sk));
+        CHECK(p3.name == p.name);
+        CHECK(p3.tags == p.tags);
+        CHECK(p3.pets.size() == 2);
+        CHECK(dict->toJSON(&sk, true) == Value::fromData(viaStruct)->toJSON(nullptr, true));
+    }
+
     TEST_CASE_METHOD(EncoderTests, "Dictionaries", "[Encoder]") {
         {
             enc.beginDictionary();
@@ -525,6 +665,60 @@ public:
         delete [] string;
     }
 
+    TEST_CASE_METHOD(EncoderTests, "NarrowOrWide", "[Encoder]") {
+        {
+            // One 3-byte int among short ones: moving it out of line beats going wide
+            enc.beginArray(5);
+            enc.writeInt(2048);
+            for (int i = 1; i <= 4; ++i)
+                enc.writeInt(i);
+            enc.endArray();
+            REQUIRE(enc.stats().narrowCollections == 1);
+            REQUIRE(enc.stats().wideCollections == 0);
+            REQUIRE(enc.stats().movedValues == 1);
+            checkOutput("1100 0800 6005 8003 0001 0002 0003 0004 8006");
+            auto a = checkArray(5);
+            REQUIRE(a->get(0)->asInt() == 2048);
+            REQUIRE(a->get(4)->asInt() == 4);
+        }
+        {
+            // Same size either way, so stay wide:
+            enc.beginArray(2);
+            enc.writeInt(2048);
+            enc.writeInt(1);
+            enc.endArray();
+            checkOutput("6802 1100 0800 0001 0000 8005");
+        }
+        {
+            // A shared string >64KB back gets copied close by instead of widening the array:
+            std::string big(70000, 'x');
+            unsigned numWide = enc.stats().wideCollections, numMoved = enc.stats().movedValues;
+            enc.beginArray();
+            enc.writeString("far away");
+            enc.writeString(big);
+            for (int n = 0; n < 2; ++n) {
+                enc.beginArray();
+                enc.writeString("far away");
+                for (int i = 0; i < 8; ++i)
+                    enc.writeInt(i);
+                enc.endArray();
+            }
+            enc.endArray();
+            REQUIRE(enc.stats().wideCollections == numWide + 1);           // only the outer array is wide
+            REQUIRE(enc.stats().movedValues == numMoved + 1);   // 2nd array reuses the new copy
+            endEncoding();
+            REQUIRE(result.size < 70100);
+            auto a = checkArray(4);
+            REQUIRE(a->get(0)->asString() == "far away"_sl);
+            for (uint32_t n = 2; n < 4; ++n) {
+                auto inner = a->get(n)->asArray();
+                REQUIRE(inner->count() == 9);
+                REQUIRE(inner->get(0)->asString() == "far away"_sl);
+                REQUIRE(inner->get(8)->asInt() == 7);
+            }
+        }
+    }
+
 #pragma mark - JSON:
 
     TEST_CASE_METHOD(EncoderTests, "JSONStrings", "[Encoder]") {
@@ -665,11 +859,1130 @@ public:
 
         fprintf(stderr, "\nJSON size: %zu bytes; Fleece size: %zu bytes (%.2f%%)\n",
                 input.size, result.size, (result.size*100.0/input.size));
-#ifndef NDEBUG
-        fprintf(stderr, "Narrow: %u, Wide: %u (total %u)\n", enc._numNarrow, enc._numWide, enc._numNarrow+enc._numWide);
-        fprintf(stderr, "Narrow count: %u, Wide count: %u (total %u)\n", enc._narrowCount, enc._wideCount, enc._narrowCount+enc._wideCount);
-        fprintf(stderr, "Used %u pointers to shared strings\n", enc._numSavedStrings);
-#endif
+        auto &stats = enc.stats();
+        fprintf(stderr, "Narrow: %u, Wide: %u (total %u)\n", stats.narrowCollections, stats.wideCollections, stats.narrowCollections+stats.wideCollections);
+        fprintf(stderr, "Narrow count: %zu, Wide count: %zu (total %zu)\n", stats.narrowItems, stats.wideItems, stats.narrowItems+stats.wideItems);
+        fprintf(stderr, "Used %u pointers to shared strings, saving %zu bytes\n", stats.stringsReused, stats.stringBytesSaved);
+        fprintf(stderr, "Moved %u values out of line to keep collections narrow\n", stats.movedValues);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "EncoderStats", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        enc.timeSorting(true);
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(input));
+        enc.end();
+        result = enc.extractOutput();
+
+        auto &stats = enc.stats();
+        size_t total = 0;
+        for (auto bytes : stats.bytesByType)
+            total += bytes;
+        CHECK(total <= result.size);
+        CHECK(total + 6 >= result.size);               // only the root Value isn't counted
+        CHECK(stats.bytesByType[kNull] == 0);
+        CHECK(stats.bytesByType[kString] > stats.bytesByType[kNumber]);
+        CHECK(stats.narrowCollections + stats.wideCollections == 1000 * 6 + 1);
+        CHECK(stats.stringsReused > 0);
+        CHECK(stats.stringBytesSaved > stats.stringsReused);
+        CHECK(stats.sortNanoseconds > 0);
+
+        unsigned pointers = 0;
+        for (auto n : stats.pointers)
+            pointers += n;
+        CHECK(pointers > 0);
+        CHECK(stats.pointers[Encoder::Stats::kPointerBuckets - 1] == 0);
+
+        enc.reset();
+        CHECK(enc.stats().bytesByType[kString] == 0);
+        CHECK(enc.stats().narrowCollections == 0);
+
+        // Sorting isn't timed by default:
+        Encoder enc2;
+        JSONConverter jr2(enc2);
+        REQUIRE(jr2.encodeJSON(input));
+        enc2.end();
+        CHECK(enc2.stats().narrowCollections > 0);
+        CHECK(enc2.stats().sortNanoseconds == 0);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DeltaWithStringIndex", "[Encoder]") {
+        alloc_slice base = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+        auto people = Value::fromTrustedData(base)->asArray();
+
+        BaseStringIndex index(base);
+        CHECK(index.count() > 1000);
+        auto person = people->get(0)->asDict();
+        ssize_t offset = index.find("Glenda Morse"_sl);
+        CHECK(offset == (ssize_t)person->get("name"_sl) - (ssize_t)base.buf);
+        CHECK(index.find("Not A Person"_sl) == -1);
+
+        auto writeDelta = [&](Encoder &e) {
+            e.beginDictionary();
+            e.writeKey("name"_sl);
+            e.writeString("Glenda Morse"_sl);
+            e.writeKey("friend"_sl);
+            e.writeValue(people->get(1));
+            e.writeKey("gender"_sl);
+            e.writeString("female"_sl);
+            e.writeKey("motto"_sl);
+            e.writeString("Not in the base"_sl);
+            e.endDictionary();
+        };
+
+        // Delta using a walk of the base:
+        Encoder enc1;
+        enc1.setBase(base);
+        enc1.reuseBaseStrings();
+        writeDelta(enc1);
+        alloc_slice delta1 = enc1.extractOutput();
+
+        // Same delta using the index, and a copy of the index reloaded from its data:
+        BaseStringIndex reloaded(base, index.data());
+        CHECK(reloaded.count() == index.count());
+        CHECK(reloaded.find("Glenda Morse"_sl) == offset);
+        for (auto idx : {&index, &reloaded}) {
+            Encoder enc2;
+            enc2.setBase(base);
+            enc2.reuseBaseStrings(*idx);
+            writeDelta(enc2);
+            alloc_slice delta2 = enc2.extractOutput();
+            CHECK(delta2.size == delta1.size);
+            CHECK(enc2.stats().stringsReused == 4);                 // 2 keys and 2 values
+
+            alloc_slice combined(base.size + delta2.size);
+            memcpy((void*)combined.buf, base.buf, base.size);
+            memcpy((void*)&combined[base.size], delta2.buf, delta2.size);
+            auto root = Value::fromData(combined)->asDict();
+            REQUIRE(root);
+            CHECK(root->get("name"_sl)->asString() == "Glenda Morse"_sl);
+            CHECK(root->get("gender"_sl)->asString() == "female"_sl);
+            CHECK(root->get("motto"_sl)->asString() == "Not in the base"_sl);
+            CHECK(root->get("friend"_sl)->asDict()->get("name"_sl)->asString()
+                  == people->get(1)->asDict()->get("name"_sl)->asString());
+        }
+
+        CHECK_THROWS_AS(BaseStringIndex(base, "\xff\xff\xff\x7f"_sl), FleeceException);
+        Encoder enc3;
+        enc3.setBase(delta1);
+        CHECK_THROWS_AS(enc3.reuseBaseStrings(index), FleeceException);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "CompressedStrings", "[Encoder]") {
+        alloc_slice doc = JSONConverter::convertJSON(readFile(kTestFilesDir "1000people.json"));
+        auto people = Value::fromTrustedData(doc)->asArray();
+
+        std::vector<slice> samples;
+        for (uint32_t i = 0; i < 100; ++i)
+            samples.push_back(people->get(i)->asDict()->get("about"_sl)->asString());
+        StringCompressor compressor(samples);
+        CHECK(compressor.count() == StringCompressor::kMaxSymbols);
+
+        slice about = people->get(500)->asDict()->get("about"_sl)->asString();
+        alloc_slice compressed = compressor.compress(about);
+        CHECK(compressed.size < about.size * 2 / 3);
+        CHECK(StringCompressor::decompressedSize(compressed) == about.size);
+        CHECK(compressor.decompress(compressed) == about);
+        CHECK(compressor.equals(compressed, about));
+        CHECK(!compressor.equals(compressed, samples[0]));
+        CHECK(compressor.hasPrefix(compressed, about.upTo(about.find(" "_sl).buf)));
+        CHECK(compressor.hasPrefix(compressed, about(0, 37)));
+        CHECK(!compressor.hasPrefix(compressed, "Nope"_sl));
+
+        auto reloaded = StringCompressor::fromData(compressor.data());
+        CHECK(reloaded.compress(about) == compressed);
+        CHECK_THROWS_AS(StringCompressor::fromData("\x02\x09zzzzzzzzz"_sl), FleeceException);
+
+        enc.setStringCompressor(&compressor);
+        enc.writeValue(people);
+        enc.end();
+        result = enc.extractOutput();
+        CHECK(result.size < doc.size * 3 / 4);
+
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        auto person = root->asArray()->get(500)->asDict();
+        auto aboutValue = person->get("about"_sl);
+        CHECK(aboutValue->type() == kCompressedString);
+        CHECK(aboutValue->asString() == nullslice);
+        CHECK(compressor.decompress(aboutValue->asCompressedString()) == about);
+        CHECK_THROWS_AS(aboutValue->toJSON(), FleeceException);
+        CHECK(person->get("name"_sl)->asCompressedString() == nullslice);    // too short
+        CHECK(person->get("name"_sl)->asString() == people->get(500)->asDict()->get("name"_sl)
+                                                                         ->asString());
+
+        JSONEncoder jsonEnc;
+        jsonEnc.setStringCompressor(&compressor);
+        jsonEnc.writeValue(root);
+        CHECK(jsonEnc.extractOutput() == Value::fromTrustedData(doc)->toJSON());
+
+        // Copying to an encoder without the compressor decompresses, given the compressor:
+        Encoder plainEnc;
+        CHECK_THROWS_AS(plainEnc.writeValue(person), FleeceException);
+        plainEnc.reset();
+        plainEnc.setSourceStringCompressor(&compressor);
+        plainEnc.writeValue(root);
+        plainEnc.end();
+        alloc_slice plain = plainEnc.extractOutput();
+        CHECK(Value::fromData(plain)->toJSON() == Value::fromTrustedData(doc)->toJSON());
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "Savepoints", "[Encoder]") {
+        enc.beginDictionary();
+        enc.writeKey("name"_sl);
+        enc.writeString("Widget Inspector"_sl);
+        auto sp = enc.savepoint();
+
+        // Speculatively write a nested object, then discard it:
+        enc.writeKey("extra"_sl);
+        enc.beginArray();
+        enc.writeString("Speculative"_sl);
+        enc.beginDictionary();
+        enc.writeKey("deep"_sl);
+        enc.writeDouble(3.14159);
+        for (int i = 0; i < 1000; ++i) {                // force the Writer to add chunks
+            enc.writeKey(slice(std::to_string(i)));
+            enc.writeString(slice("string number " + std::to_string(i)));
+        }
+        enc.rollbackTo(sp);
+
+        // The discarded strings must not be reused:
+        enc.writeKey("title"_sl);
+        enc.writeString("Speculative"_sl);
+        auto sp2 = enc.savepoint();
+        enc.writeKey("bad"_sl);
+        enc.rollbackTo(sp2);                           // roll back a key with no value
+        enc.writeKey("age"_sl);
+        enc.writeInt(70000);
+        enc.endDictionary();
+        endEncoding();
+        CHECK(result.size < 100);
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        CHECK(root->toJSON() == "{\"age\":70000,\"name\":\"Widget Inspector\","
+                                "\"title\":\"Speculative\"}"_sl);
+
+        Encoder enc2;
+        enc2.beginArray();
+        auto sp3 = enc2.savepoint();
+        enc2.beginArray();
+        enc2.endArray();
+        enc2.endArray();
+        CHECK_THROWS_AS(enc2.rollbackTo(sp3), FleeceException);
+
+        // A different collection opened at the same depth doesn't count as the same one:
+        Encoder enc3;
+        enc3.beginArray();
+        enc3.beginArray();
+        enc3.writeInt(1);
+        auto sp4 = enc3.savepoint();
+        enc3.writeString("a string long enough to be written out of line"_sl);
+        enc3.endArray();
+        enc3.beginArray();
+        enc3 << 2 << 3 << 4;
+        CHECK_THROWS_AS(enc3.rollbackTo(sp4), FleeceException);
+
+        // Rolling back restores the stats:
+        auto sp5 = enc3.savepoint();
+        auto stringBytes = enc3.stats().bytesByType[kString];
+        enc3.writeString("another string long enough to be written out of line"_sl);
+        CHECK(enc3.stats().bytesByType[kString] > stringBytes);
+        enc3.rollbackTo(sp5);
+        CHECK(enc3.stats().bytesByType[kString] == stringBytes);
+        enc3.endArray();
+        enc3.endArray();
+        alloc_slice result3 = enc3.extractOutput();
+        CHECK(Value::fromData(result3)->toJSON() ==
+              "[[1,\"a string long enough to be written out of line\"],[2,3,4]]"_sl);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "Savepoints Keep Earlier Strings", "[Encoder]") {
+        std::string expected = "[";
+        enc.beginArray();
+        for (int i = 0; i < 300; ++i) {
+            std::string kept = "kept #" + std::to_string(i);
+            enc.writeString(slice(kept));
+            auto sp = enc.savepoint();
+            for (int j = 0; j <= i % 5; ++j)
+                enc.writeString(slice("dropped #" + std::to_string(i * 5 + j)));
+            enc.writeString(slice(kept));
+            enc.rollbackTo(sp);
+
+            // Earlier strings are still reused; rolled-back ones are written again:
+            auto stringBytes = enc.stats().bytesByType[kString];
+            enc.writeString(slice("kept #" + std::to_string(i / 2)));
+            CHECK(enc.stats().bytesByType[kString] == stringBytes);
+            std::string dropped = "dropped #" + std::to_string(i * 5);
+            enc.writeString(slice(dropped));
+            CHECK(enc.stats().bytesByType[kString] > stringBytes);
+            expected += "\"" + kept + "\",\"kept #" + std::to_string(i / 2) + "\",\""
+                      + dropped + "\",";
+        }
+        enc.endArray();
+        expected.back() = ']';
+        endEncoding();
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        CHECK(root->toJSON() == slice(expected));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "BlobRefs", "[Encoder]") {
+        CHECK(BlobKey::computeFrom("abc"_sl).hexString() ==
+              "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+        CHECK(BlobKey::computeFrom(nullslice).hexString() ==
+              "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+        std::string bigData(5000, '\0');
+        for (size_t i = 0; i < bigData.size(); ++i)
+            bigData[i] = (char)(i * 7);
+        auto bigKey = BlobKey::computeFrom(slice(bigData));
+
+        MemoryBlobStore store;
+        enc.setBlobStore(&store, 100);
+        enc.beginDictionary();
+        enc.writeKey("small"_sl);
+        enc.writeData("tiny attachment"_sl);
+        enc.writeKey("big"_sl);
+        enc.writeData(slice(bigData));
+        enc.writeKey("again"_sl);
+        enc.writeData(slice(bigData));
+        enc.endDictionary();
+        endEncoding();
+        CHECK(result.size < 150);
+        CHECK(store.count() == 1);
+        CHECK(store.get(bigKey) == slice(bigData));
+
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        auto dict = root->asDict();
+        CHECK(dict->get("small"_sl)->asData() == "tiny attachment"_sl);
+        slice digest;
+        uint64_t length;
+        CHECK(!dict->get("small"_sl)->asBlobRef(digest, length));
+        auto big = dict->get("big"_sl);
+        CHECK(big->type() == kBlobRef);
+        CHECK(big->asData() == nullslice);
+        REQUIRE(big->asBlobRef(digest, length));
+        CHECK(BlobKey::fromDigest(digest) == bigKey);
+        CHECK(length == bigData.size());
+        CHECK(store.get(BlobKey::fromDigest(digest)) == slice(bigData));
+
+        Writer b64Writer;
+        b64Writer.writeBase64(bigKey.asSlice());
+        alloc_slice b64 = b64Writer.extractOutput();
+        std::string blobJSON = "{\"@type\":\"blob\",\"digest\":\"sha256-" + std::string(b64)
+                             + "\",\"length\":5000}";
+        CHECK(dict->toJSON() == slice("{\"again\":" + blobJSON + ",\"big\":" + blobJSON
+                                      + ",\"small\":\"dGlueSBhdHRhY2htZW50\"}"));
+
+        // Copying the document into another encoder keeps the blob reference:
+        Encoder enc2;
+        enc2.writeValue(root);
+        alloc_slice copy = enc2.extractOutput();
+        REQUIRE(Value::fromData(copy)->asDict()->get("big"_sl)->asBlobRef(digest, length));
+        CHECK(BlobKey::fromDigest(digest) == bigKey);
+
+        DirectoryBlobStore dirStore("/tmp");
+        std::string path = dirStore.pathFor(bigKey);
+        remove(path.c_str());
+        CHECK(!dirStore.contains(bigKey));
+        CHECK(dirStore.get(bigKey) == nullslice);
+        dirStore.put(bigKey, slice(bigData));
+        CHECK(dirStore.contains(bigKey));
+        CHECK(dirStore.get(bigKey) == slice(bigData));
+        remove(path.c_str());
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "SegmentedArrays", "[Encoder]") {
+        std::vector<int64_t> numbers(1000);
+        for (int64_t i = 0; i < 1000; ++i)
+            numbers[i] = i * 3;
+        enc.writeArray(numbers.data(), numbers.size());
+        alloc_slice doc = enc.extractOutput();
+
+        // Append a few items at a time, each in a delta appended to the document:
+        size_t maxDeltaSize = 0;
+        for (int round = 0; round < 50; ++round) {
+            Encoder delta;
+            delta.setBase(doc);
+            delta.beginAppendingArray(Value::fromTrustedData(doc));
+            for (int i = 0; i < 3; ++i) {
+                numbers.push_back(numbers.size() * 3);
+                delta.writeInt(numbers.back());
+            }
+            delta.endArray();
+            alloc_slice deltaData = delta.extractOutput();
+            maxDeltaSize = std::max(maxDeltaSize, deltaData.size);
+
+            alloc_slice combined(doc.size + deltaData.size);
+            memcpy((void*)combined.buf, doc.buf, doc.size);
+            memcpy((void*)&combined[doc.size], deltaData.buf, deltaData.size);
+            doc = combined;
+        }
+        CHECK(maxDeltaSize < 400);          // (rewriting the whole array would take 2300 bytes)
+
+        auto root = Value::fromData(doc);
+        REQUIRE(root);
+        CHECK(root->type() == kArray);
+        auto array = root->asArray();
+        REQUIRE(array);
+        REQUIRE(array->count() == numbers.size());
+        for (uint32_t i = 0; i < numbers.size(); ++i)
+            CHECK(array->get(i)->asInt() == numbers[i]);
+        CHECK(array->get((uint32_t)numbers.size()) == nullptr);
+
+        Array::iterator iter(array);
+        for (uint32_t i = 0; i < numbers.size(); ++i, ++iter) {
+            REQUIRE(iter);
+            CHECK(iter.count() == numbers.size() - i);
+            CHECK(iter.value()->asInt() == numbers[i]);
+            if (i + 10 < numbers.size())
+                CHECK(iter[10]->asInt() == numbers[i + 10]);
+        }
+        CHECK(!iter);
+        Array::iterator iter2(array);
+        iter2 += 1040;
+        CHECK(iter2.value()->asInt() == numbers[1040]);
+        iter2 += (uint32_t)numbers.size() - 1041;
+        CHECK(iter2.value()->asInt() == numbers.back());
+
+        // The compact iterator (used by the C API) steps through it by index:
+        Array::compactIterator citer(array);
+        for (uint32_t i = 0; i < numbers.size(); ++i, ++citer) {
+            REQUIRE(citer);
+            CHECK(citer.count() == numbers.size() - i);
+            CHECK(citer.value()->asInt() == numbers[i]);
+            if (i + 10 < numbers.size())
+                CHECK(citer[10]->asInt() == numbers[i + 10]);
+        }
+        CHECK(!citer);
+        CHECK(citer.value() == nullptr);
+
+        // Copying it writes an ordinary array:
+        Encoder enc2;
+        enc2.writeValue(root);
+        alloc_slice copy = enc2.extractOutput();
+        CHECK(copy.size < doc.size);
+        auto copied = Value::fromData(copy);
+        REQUIRE(copied);
+        CHECK(copied->toJSON() == root->toJSON());
+        Array::compactIterator citer2(copied->asArray());
+        for (uint32_t i = 0; i < numbers.size(); ++i, ++citer2) {
+            REQUIRE(citer2);
+            CHECK(citer2.count() == numbers.size() - i);
+            CHECK(citer2.value()->asInt() == numbers[i]);
+            if (i + 10 < numbers.size())
+                CHECK(citer2[10]->asInt() == numbers[i + 10]);
+        }
+        CHECK(!citer2);
+        Encoder enc3;
+        enc3.writeArray(numbers.data(), numbers.size());
+        CHECK(enc3.extractOutput() == copy);
+
+        // Appending to an array that's not in the base just copies it:
+        Encoder enc4;
+        enc4.beginAppendingArray(root);
+        enc4.writeInt(-1);
+        enc4.endArray();
+        alloc_slice flat = enc4.extractOutput();
+        auto flatArray = Value::fromData(flat)->asArray();
+        CHECK(flatArray->count() == numbers.size() + 1);
+        CHECK(flatArray->get((uint32_t)numbers.size())->asInt() == -1);
+    }
+
+    TEST_CASE("WriterChunks", "[Encoder]") {
+        std::string data(1000, 'x');
+
+        // Output in a single chunk is extracted without copying:
+        Writer w(4000);
+        const void *start = w.write(slice(data));
+        w.write(slice(data));
+        alloc_slice out = w.extractOutput();
+        CHECK(out.buf == start);
+        CHECK(out.size == 2000);
+
+        // Output in several chunks is copied, but then the next output fits in one:
+        Writer w2;
+        for (int i = 0; i < 5; ++i)
+            w2.write(slice(data));
+        alloc_slice out2 = w2.extractOutput();
+        CHECK(out2 == slice(std::string(5000, 'x')));
+        start = w2.write(slice(data));
+        for (int i = 0; i < 4; ++i)
+            w2.write(slice(data));
+        CHECK(w2.extractOutput().buf == start);
+
+        // Chunks freed by reset() are reused:
+        Writer w3(1500);
+        w3.write(slice(data));
+        const void *second = w3.write(slice(data));
+        w3.reset();
+        CHECK(w3.write(slice(data)) == second);
+        w3.truncate(10);
+        CHECK(w3.length() == 10);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "OutputSink", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice doc = JSONConverter::convertJSON(input);
+        auto people = Value::fromTrustedData(doc);
+
+        std::string streamed;
+        size_t pieces = 0;
+        enc.setOutputSink([&](slice piece) {
+            streamed.append((const char*)piece.buf, piece.size);
+            ++pieces;
+        });
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(input));
+        enc.end();
+        CHECK(enc.extractOutput() == nullslice);
+        CHECK(pieces > 10);
+
+        auto root = Value::fromData(slice(streamed));
+        REQUIRE(root);
+        CHECK(root->toJSON() == people->toJSON());
+
+        // Spliced collections and bulk-written arrays are streamed as they're written, too:
+        std::string streamed2;
+        size_t pieces2 = 0;
+        Encoder enc2;
+        enc2.setOutputSink([&](slice piece) {
+            streamed2.append((const char*)piece.buf, piece.size);
+            ++pieces2;
+        });
+        std::vector<double> numbers(20000);
+        for (size_t i = 0; i < numbers.size(); ++i)
+            numbers[i] = i + 0.5;
+        enc2.beginArray();
+        for (Array::iterator i(people->asArray()); i; ++i)
+            enc2.writeValue(i.value());
+        CHECK(enc2.stats().splicedCollections == 1000);
+        CHECK(pieces2 > 10);
+        size_t splicePieces = pieces2;
+        enc2.writeArray(numbers.data(), numbers.size());
+        CHECK(pieces2 > splicePieces);
+        enc2.endArray();
+        enc2.end();
+        CHECK(enc2.extractOutput() == nullslice);
+        auto root2 = Value::fromData(slice(streamed2));
+        REQUIRE(root2);
+        CHECK(root2->asArray()->get(0)->toJSON() == people->asArray()->get(0)->toJSON());
+        CHECK(root2->asArray()->get(999)->toJSON() == people->asArray()->get(999)->toJSON());
+        CHECK(root2->asArray()->get(1000)->asArray()->get(19999)->asDouble() == 19999.5);
+
+        // The JSON encoder can stream too, here to a file:
+        FILE *f = tmpfile();
+        REQUIRE(f);
+        JSONEncoder jsonEnc;
+        jsonEnc.setOutputSink(Writer::fileSink(fileno(f)));
+        jsonEnc.writeValue(root);
+        CHECK(jsonEnc.extractOutput() == nullslice);
+        alloc_slice json = people->toJSON();
+        std::string fromFile(json.size, '\0');
+        rewind(f);
+        CHECK(fread(&fromFile[0], 1, fromFile.size(), f) == json.size);
+        CHECK(slice(fromFile) == json);
+        fclose(f);
+    }
+
+    TEST_CASE("Base64", "[Encoder]") {
+        static const char kChars[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        // Sizes on both sides of the SIMD block sizes, so the scalar tails get exercised too:
+        for (size_t size = 0; size < 300; size += (size < 70 ? 1 : 37)) {
+            std::string data(size, '\0');
+            for (size_t i = 0; i < size; ++i)
+                data[i] = (char)(i * 167 + size);
+
+            // Straightforward bit-at-a-time reference encoding:
+            std::string expected;
+            for (size_t bit = 0; bit < 8 * size; bit += 6) {
+                unsigned value = 0;
+                for (size_t b = bit; b < bit + 6; ++b) {
+                    value <<= 1;
+                    if (b < 8 * size && ((uint8_t)data[b / 8] & (0x80 >> (b % 8))))
+                        value |= 1;
+                }
+                expected += kChars[value];
+            }
+            while (expected.size() % 4)
+                expected += '=';
+
+            std::string base64 = slice(data).base64String();
+            REQUIRE(base64 == expected);
+
+            Writer w;
+            w.writeDecodedBase64(slice(base64));
+            REQUIRE(w.extractOutput() == slice(data));
+
+            // Line breaks are skipped:
+            std::string wrapped;
+            for (size_t i = 0; i < base64.size(); i += 19)
+                wrapped += base64.substr(i, 19) + "\r\n";
+            std::string decoded(Base64MaxDecodedSize(wrapped.size()), '\0');
+            slice out = slice(wrapped).readBase64Into(slice(decoded));
+            REQUIRE(out == slice(data));
+        }
+    }
+
+    // Counts the bytes it has allocated, and refuses to go over a budget.
+    class BudgetAllocator : public Allocator {
+    public:
+        BudgetAllocator(size_t budget)              :_budget(budget) { }
+        ~BudgetAllocator()                          {Allocator::setCurrent(nullptr);}
+        void* allocate(size_t size) override {
+            if (_inUse + size > _budget)
+                return nullptr;
+            _inUse += size;
+            ++_count;
+            return ::malloc(size);
+        }
+        void* reallocate(void *ptr, size_t oldSize, size_t newSize) override {
+            if (_inUse - oldSize + newSize > _budget)
+                return nullptr;
+            _inUse = _inUse - oldSize + newSize;
+            return ::realloc(ptr, newSize);
+        }
+        void deallocate(void *ptr, size_t size) noexcept override {
+            _inUse -= size;
+            ::free(ptr);
+        }
+        size_t _budget, _inUse {0}, _count {0};
+    };
+
+    TEST_CASE("Allocator", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice output;
+        {
+            BudgetAllocator allocator(100*1024*1024);
+            Allocator::setCurrent(&allocator);
+            {
+                Encoder enc;
+                JSONConverter jr(enc);
+                REQUIRE(jr.encodeJSON(input));
+                output = enc.extractOutput();
+                CHECK(allocator._count > 0);
+                CHECK(allocator._inUse >= output.size);
+            }
+            Allocator::setCurrent(nullptr);
+            // Blocks are freed by the allocator that made them, even after it's been replaced:
+            alloc_slice copy = output;
+            output = alloc_slice(copy.buf, copy.size);
+            CHECK(allocator._inUse > 0);
+            copy.reset();
+            CHECK(allocator._inUse == 0);
+        }
+        CHECK(Value::fromData(output) != nullptr);
+
+        {
+            // An idle Writer doesn't hold on to memory sized for its last output:
+            BudgetAllocator allocator(100*1024*1024);
+            Allocator::setCurrent(&allocator);
+            Writer w;
+            std::string data(100000, 'x');
+            for (int i = 0; i < 20; ++i)
+                w.write(slice(data));
+            alloc_slice out = w.extractOutput();
+            CHECK(allocator._inUse < out.size * 3 / 2);   // (allowing for spare chunks)
+            // ...but the next output still goes in a single chunk:
+            const void *start = w.write(slice(data));
+            for (int i = 1; i < 20; ++i)
+                w.write(slice(data));
+            CHECK(w.extractOutput().buf == start);
+            Allocator::setCurrent(nullptr);
+        }
+
+        // Going over the budget throws bad_alloc:
+        BudgetAllocator allocator(64*1024);
+        Allocator::setCurrent(&allocator);
+        Encoder enc;
+        enc.beginArray();
+        std::string big(1000, 'x');
+        CHECK_THROWS_AS({ for (int i = 0; i < 1000; ++i) enc.writeString(big + std::to_string(i)); },
+                        std::bad_alloc);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONParser", "[Encoder]") {
+        auto convert = [&](const std::string &json) -> std::string {
+            JSONConverter j(enc);
+            bool ok = j.encodeJSON(slice(json));
+            if (!ok) {
+                enc.reset();
+                return "ERROR " + std::to_string(j.jsonError()) + " @" + std::to_string(j.errorPos());
+            }
+            endEncoding();
+            std::string out = Value::fromData(result)->toJSON().asString();
+            enc.reset();
+            return out;
+        };
+
+        SECTION("Scalars and whitespace") {
+            CHECK(convert(" 17 ") == "17");
+            CHECK(convert("-9223372036854775808") == "-9223372036854775808");
+            CHECK(convert("18446744073709551615") == "18446744073709551615");
+            CHECK(convert("1e2") == "100");
+            CHECK(convert("\"hi\"") == "\"hi\"");
+            CHECK(convert("\n[ true ,false,\tnull ]\r\n") == "[true,false,null]");
+            CHECK(convert("{ \"a\" : [ ] , \"b\" : { } }") == "{\"a\":[],\"b\":{}}");
+            CHECK(convert("[\"{[,:]}\",\"\\\\\",\"\\\"\"]") == "[\"{[,:]}\",\"\\\\\",\"\\\"\"]");
+        }
+        SECTION("Errors") {
+            auto error = [](int code, size_t pos) {
+                return "ERROR " + std::to_string(code) + " @" + std::to_string(pos);
+            };
+            CHECK(convert("[1 2]") == error(JSONSL_ERROR_STRAY_TOKEN, 3));
+            CHECK(convert("[1,]") == error(JSONSL_ERROR_STRAY_TOKEN, 3));
+            CHECK(convert("{\"a\" 1}") == error(JSONSL_ERROR_MISSING_TOKEN, 5));
+            CHECK(convert("[01]") == error(JSONSL_ERROR_INVALID_NUMBER, 2));
+            CHECK(convert("[1.]") == error(JSONSL_ERROR_INVALID_NUMBER, 3));
+            CHECK(convert("[nul]") == error(JSONSL_ERROR_SPECIAL_EXPECTED, 1));
+            CHECK(convert("[1] x") == error(JSONSL_ERROR_GARBAGE_TRAILING, 4));
+            CHECK(convert("[[1]") == error(JSONConverter::kErrTruncatedJSON, 4));
+            CHECK(convert("{\"a\":\"b") == error(JSONConverter::kErrTruncatedJSON, 7));
+            std::string deep(JSONConverter::kMaxDepth + 1, '[');
+            CHECK(convert(deep) == error(JSONSL_ERROR_LEVELS_EXCEEDED, JSONConverter::kMaxDepth));
+        }
+        SECTION("Block and window boundaries") {
+            // Strings, escapes and numbers straddling every offset of a 64-byte block, and a
+            // document much bigger than one index window:
+            std::string json = "[";
+            for (int i = 0; i < 20000; ++i) {
+                if (i > 0) json += ",";
+                json += "\"" + std::string(i % 67, 'x') + "\\\"\\\\\"," + std::to_string(i * 7919);
+                json += ",{\"k\":[" + std::to_string(-i) + ".5]}";
+            }
+            json += "]";
+            REQUIRE(json.size() > 4 * StructuralIndex::kWindowSize);
+            CHECK(convert(json) == json);
+        }
+    }
+
+    TEST_CASE("ParseDouble", "[Encoder]") {
+        auto check = [](const char *str) {
+            INFO("Parsing " << str);
+            CHECK(ParseDouble(slice(str)) == strtod(str, nullptr));
+        };
+        check("0");
+        check("-0.0");
+        check("0.1");
+        check("123.456");
+        check("6.02e+23");
+        check("-1.5E-7");
+        check("9007199254740993");                      // halfway: rounds to even
+        check("9007199254740993.00000000000000000001"); // just above halfway
+        check("0.1000000000000000055511151231257827021181583404541015625");
+        check("2.2250738585072011e-308");               // largest denormal
+        check("2.2250738585072014e-308");               // smallest normal
+        check("4.9406564584124654e-324");               // smallest denormal
+        check("2.4703282292062328e-324");               // rounds up to it
+        check("1.7976931348623157e308");
+        check("1.7976931348623159e308");                // overflows to infinity
+        check("1e-400");
+        check("1e400");
+        check("123456789012345678901234567890e-20");
+        check("0.000000000000000000000000000000000000000000000001e+48");
+        check("7.0420557077594588669468784357561207962098443483187940792729600000e+59");
+        check("2.47032822920623272088284396434110686182529901307162382212792841250337753635104375932649918180817996189898282347722858865463328355177969898199387398005390939063150356595155702263922908583924491051844359318028499365361525003193704576782492193656236698636584807570015857692699037063119282795585513329278343384093519780155312465972635795746227664652728272200563740064854999770965994704540208281662262378573934507363390079677619305775067401763246736009689513405355374585166611342237666786041621596804619144672918403005300575308490487653917113865916462395249126236538818796362393732804238910186723484976682350898633885879256283027559956575244555072551893136908362547791869486679949683240497058210285131854513962138377228261454376934125320985913276672363281255e-324");
+
+        // Random doubles formatted with 17 significant digits must come back unchanged:
+        std::mt19937_64 random(42);
+        for (int i = 0; i < 100000; ++i) {
+            uint64_t bits = random();
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            if (std::isnan(d) || std::isinf(d))
+                continue;
+            char str[32];
+            sprintf(str, "%.17g", d);
+            INFO("Parsing " << str);
+            REQUIRE(ParseDouble(slice(str)) == d);
+        }
+
+        bool fitsInFloat;
+        ParseDouble("0.5"_sl, &fitsInFloat);
+        CHECK(fitsInFloat);
+        ParseDouble("0.1"_sl, &fitsInFloat);
+        CHECK(!fitsInFloat);
+        ParseDouble("3.4028234663852886e38"_sl, &fitsInFloat);     // FLT_MAX
+        CHECK(fitsInFloat);
+        ParseDouble("1e39"_sl, &fitsInFloat);
+        CHECK(!fitsInFloat);
+        ParseDouble("1.401298464324817e-45"_sl, &fitsInFloat);     // smallest float denormal
+        CHECK(fitsInFloat);
+        ParseDouble("1e-46"_sl, &fitsInFloat);
+        CHECK(!fitsInFloat);
+    }
+
+    TEST_CASE("NumberFormatting", "[Encoder]") {
+        auto fmtInt = [](int64_t i) {char buf[kMaxNumberLength]; return std::string(buf, WriteInt(i, buf));};
+        auto fmtDouble = [](double d) {char buf[kMaxNumberLength]; return std::string(buf, WriteDouble(d, buf));};
+        auto fmtFloat = [](float f) {char buf[kMaxNumberLength]; return std::string(buf, WriteFloat(f, buf));};
+
+        CHECK(fmtInt(0) == "0");
+        CHECK(fmtInt(9) == "9");
+        CHECK(fmtInt(10) == "10");
+        CHECK(fmtInt(-1234567) == "-1234567");
+        CHECK(fmtInt(INT64_MIN) == "-9223372036854775808");
+        char buf[kMaxNumberLength];
+        CHECK(std::string(buf, WriteUInt(UINT64_MAX, buf)) == "18446744073709551615");
+
+        CHECK(fmtDouble(0.0) == "0");
+        CHECK(fmtDouble(-0.0) == "-0");
+        CHECK(fmtDouble(100) == "100");
+        CHECK(fmtDouble(-2.5) == "-2.5");
+        CHECK(fmtDouble(123.456) == "123.456");
+        CHECK(fmtDouble(0.1 + 0.2) == "0.30000000000000004");
+        CHECK(fmtDouble(1e-4) == "0.0001");
+        CHECK(fmtDouble(1.5e-5) == "1.5e-05");
+        CHECK(fmtDouble(1e16) == "10000000000000000");
+        CHECK(fmtDouble(1e17) == "1e+17");
+        CHECK(fmtDouble(6.02e23) == "6.02e+23");
+        CHECK(fmtDouble(5e-324) == "5e-324");
+        CHECK(fmtDouble(DBL_MAX) == "1.7976931348623157e+308");
+        CHECK(fmtDouble(INFINITY) == "inf");
+        CHECK(fmtFloat(0.1f) == "0.1");
+        CHECK(fmtFloat((float)M_PI) == "3.1415927");
+        CHECK(fmtFloat(FLT_MAX) == "3.4028235e+38");
+
+        // Random doubles and floats must round-trip:
+        std::mt19937_64 random(1234);
+        for (int i = 0; i < 100000; ++i) {
+            uint64_t bits = random();
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            if (std::isnan(d) || std::isinf(d))
+                continue;
+            std::string str = fmtDouble(d);
+            INFO("Formatted " << str);
+            REQUIRE(ParseDouble(slice(str)) == d);
+            REQUIRE(str.size() <= 24);
+
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            if (std::isnan(f) || std::isinf(f))
+                continue;
+            str = fmtFloat(f);
+            REQUIRE(strtof(str.c_str(), nullptr) == f);
+        }
+
+        JSONEncoder enc;
+        enc.beginArray();
+        enc << -17 << 18446744073709551615ull << 0.1 << 2.5f;
+        enc.endArray();
+        CHECK(enc.extractOutput() == "[-17,18446744073709551615,0.1,2.5]"_sl);
+    }
+
+    TEST_CASE("JSONEncoderEscapes", "[Encoder]") {
+        // Every ASCII character, then each special one at every offset in a long string:
+        auto escaped = [](const std::string &str) {
+            std::string json = "\"";
+            for (uint8_t ch : str) {
+                char buf[8];
+                if (ch == '"' || ch == '\\')
+                    json += std::string("\\") + (char)ch;
+                else if (ch == '\r')
+                    json += "\\r";
+                else if (ch == '\n')
+                    json += "\\n";
+                else if (ch == '\t')
+                    json += "\\t";
+                else if (ch < 32 || ch == 127)
+                    json += std::string(buf, sprintf(buf, "\\u%04x", ch));
+                else
+                    json += (char)ch;
+            }
+            return json + "\"";
+        };
+        std::vector<std::string> strings {""};
+        std::string all;
+        for (int ch = 0; ch < 256; ++ch)
+            all += (char)ch;
+        strings.push_back(all);
+        for (uint8_t special : {'"', '\\', '\n', '\x01', '\x1f', '\x7f'}) {
+            for (size_t i = 0; i < 100; ++i) {
+                std::string str(100, 'x');
+                str[i] = special;
+                strings.push_back(str);
+            }
+        }
+        for (auto &str : strings) {
+            JSONEncoder enc;
+            enc.writeString(slice(str));
+            REQUIRE(enc.extractOutput() == slice(escaped(str)));
+        }
+    }
+
+    TEST_CASE("UTF8Validation", "[Encoder]") {
+        // A straightforward decoder to compare with:
+        auto isValid = [](const std::string &str) {
+            static const uint32_t kMinCodePoint[5] = {0, 0, 0x80, 0x800, 0x10000};
+            for (size_t i = 0; i < str.size(); ) {
+                uint8_t c = str[i];
+                size_t len;
+                uint32_t cp;
+                if (c < 0x80)                   {len = 1; cp = c;}
+                else if ((c & 0xE0) == 0xC0)    {len = 2; cp = c & 0x1F;}
+                else if ((c & 0xF0) == 0xE0)    {len = 3; cp = c & 0x0F;}
+                else if ((c & 0xF8) == 0xF0)    {len = 4; cp = c & 0x07;}
+                else                            return false;
+                if (i + len > str.size())
+                    return false;
+                for (size_t k = 1; k < len; ++k) {
+                    if ((str[i+k] & 0xC0) != 0x80)
+                        return false;
+                    cp = (cp << 6) | (str[i+k] & 0x3F);
+                }
+                if (len > 1 && (cp < kMinCodePoint[len] || cp > 0x10FFFF
+                                                        || (cp >= 0xD800 && cp <= 0xDFFF)))
+                    return false;
+                i += len;
+            }
+            return true;
+        };
+
+        // Every 1- to 4-byte sequence with interesting bytes, at offsets that straddle the
+        // vector blocks (in strings long enough to be checked with vectors), or at the end:
+        const uint8_t kBytes[] = {0x00, 0x41, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0,
+                                  0xC1, 0xC2, 0xDF, 0xE0, 0xE1, 0xEC, 0xED, 0xEE, 0xEF, 0xF0,
+                                  0xF1, 0xF3, 0xF4, 0xF5, 0xF8, 0xFF};
+        std::vector<std::string> seqs;
+        for (uint8_t a : kBytes) {
+            seqs.push_back(std::string(1, a));
+            for (uint8_t b : kBytes) {
+                seqs.push_back({(char)a, (char)b});
+                if (a >= 0xE0) {
+                    for (uint8_t c : kBytes) {
+                        seqs.push_back({(char)a, (char)b, (char)c});
+                        if (a >= 0xF0) {
+                            for (uint8_t d : {0x41, 0x80, 0xBF, 0xC2})
+                                seqs.push_back({(char)a, (char)b, (char)c, (char)d});
+                        }
+                    }
+                }
+            }
+        }
+        for (auto &seq : seqs) {
+            for (size_t offset : {0, 14, 15, 29, 30, 31, 32, 62, 63, 64}) {
+                std::string str(offset, 'x');
+                str += seq;
+                REQUIRE(IsValidUTF8(slice(str)) == isValid(str));
+                str.resize(96, 'y');
+                REQUIRE(IsValidUTF8(slice(str)) == isValid(str));
+            }
+        }
+
+        // Random mixtures of ASCII, valid characters and random bytes:
+        const char* kChars[] = {"a", "é", "€", "𝄞", "\xEF\xBF\xBF", "\xF4\x8F\xBF\xBF"};
+        std::mt19937 rng(1234);
+        for (int i = 0; i < 20000; ++i) {
+            std::string str;
+            size_t size = rng() % 300;
+            while (str.size() < size) {
+                unsigned r = rng() % 100;
+                if (r < 60)
+                    str += std::string(rng() % 40, 'a' + r % 26);
+                else if (r < 99)
+                    str += kChars[rng() % 6];
+                else
+                    str += (char)rng();
+            }
+            REQUIRE(IsValidUTF8(slice(str)) == isValid(str));
+        }
+
+        // Encoder and JSONConverter:
+        Encoder enc;
+        enc.beginArray();
+        enc.writeString("caf\xC3"_sl);
+        enc.validateUTF8(true);
+        enc.writeString("café 𝄞"_sl);
+        CHECK_THROWS_AS(enc.writeString("caf\xC3"_sl), FleeceException);
+        enc.beginDictionary();
+        CHECK_THROWS_AS(enc.writeKey("\xED\xA0\x80"_sl), FleeceException);
+        enc.reset();
+
+        JSONConverter jc(enc);
+        CHECK(jc.encodeJSON("{\"caf\xC3\xA9\":[\"ok\",\"\\u00e9\"]}"_sl));
+        enc.reset();
+        jc.reset();
+        CHECK(!jc.encodeJSON("{\"a\":[\"ok\",\"bad\xC0\xAF\"]}"_sl));
+        CHECK(jc.errorCode() == InvalidData);
+        CHECK(jc.errorPos() == 11);         // the string's opening quote
+
+        // Copied values are checked too, even big ones that would be spliced:
+        Encoder unchecked;
+        unchecked.beginDictionary();
+        for (int i = 0; i < 100; ++i) {
+            unchecked.writeKey("key" + std::to_string(100 + i));
+            unchecked.writeString(i == 50 ? "bad\xFF\xFE"_sl : "ok"_sl);
+        }
+        unchecked.endDictionary();
+        alloc_slice badDoc = unchecked.extractOutput();
+        Encoder enc2;
+        enc2.writeValue(Value::fromData(badDoc));
+        CHECK(enc2.stats().splicedCollections == 1);
+        Encoder enc3;
+        enc3.validateUTF8(true);
+        CHECK_THROWS_AS(enc3.writeValue(Value::fromData(badDoc)), FleeceException);
+
+        // ...as are appended array items:
+        unchecked.reset();
+        unchecked.beginArray();
+        unchecked.writeString("bad\xFF\xFE"_sl);
+        unchecked.endArray();
+        alloc_slice badArray = unchecked.extractOutput();
+        Encoder enc4;
+        enc4.validateUTF8(true);
+        enc4.beginArray();
+        CHECK_THROWS_AS(enc4.appendArrayItems(badArray), FleeceException);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeopleParallel", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice serial = JSONConverter::convertJSON(input);
+
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSONParallel(input, 4));
+        enc.end();
+        result = enc.extractOutput();
+        REQUIRE(result.buf);
+        REQUIRE(Value::fromData(result) != nullptr);
+        REQUIRE(Value::fromData(result)->toJSON() == Value::fromData(serial)->toJSON());
+
+        // Errors are reported at the same position as by serial conversion:
+        std::string bad((const char*)input.buf, input.size);
+        bad[bad.find("\"name\":", bad.size() * 3 / 4) + 8] = '@';
+        Encoder enc1, enc2;
+        JSONConverter jr1(enc1), jr2(enc2);
+        REQUIRE(!jr1.encodeJSON(slice(bad)));
+        REQUIRE(!jr2.encodeJSONParallel(slice(bad), 4));
+        REQUIRE(jr2.jsonError() == jr1.jsonError());
+        REQUIRE(jr2.errorPos() == jr1.errorPos());
+
+        // The encoder's options apply to every piece, such as UTF-8 validation:
+        std::string badUTF8((const char*)input.buf, input.size);
+        badUTF8[badUTF8.find("\"name\":", badUTF8.size() * 3 / 4) + 9] = '\xFF';
+        Encoder enc3, enc4;
+        enc3.validateUTF8(true);
+        enc4.validateUTF8(true);
+        JSONConverter jr3(enc3), jr4(enc4);
+        REQUIRE(!jr3.encodeJSON(slice(badUTF8)));
+        CHECK(jr3.errorCode() == InvalidData);
+        REQUIRE(!jr4.encodeJSONParallel(slice(badUTF8), 4));
+        CHECK(jr4.errorCode() == InvalidData);
+        CHECK(jr4.errorPos() == jr3.errorPos());
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeopleChunked", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice serial = JSONConverter::convertJSON(input);
+
+        for (size_t chunkSize : {1, 7, 64, 4000, 100000}) {
+            INFO("Chunk size " << chunkSize);
+            JSONConverter jr(enc);
+            for (size_t pos = 0; pos < input.size; pos += chunkSize)
+                REQUIRE(jr.feed(slice(offsetby(input.buf, pos),
+                                      std::min(chunkSize, input.size - pos))));
+            REQUIRE(jr.finish());
+            enc.end();
+            result = enc.extractOutput();
+            REQUIRE(Value::fromData(result)->toJSON() == Value::fromData(serial)->toJSON());
+            enc.reset();
+        }
+
+        // Errors are reported at the same position as when converting all at once:
+        std::string bad((const char*)input.buf, input.size);
+        bad[bad.find("\"name\":", bad.size() / 2) + 8] = '@';
+        Encoder enc1, enc2;
+        JSONConverter jr1(enc1), jr2(enc2);
+        REQUIRE(!jr1.encodeJSON(slice(bad)));
+        bool ok = true;
+        for (size_t pos = 0; ok && pos < bad.size(); pos += 1000)
+            ok = jr2.feed(slice(&bad[pos], std::min((size_t)1000, bad.size() - pos)));
+        REQUIRE(!ok);
+        REQUIRE(!jr2.finish());
+        REQUIRE(jr2.jsonError() == jr1.jsonError());
+        REQUIRE(jr2.errorPos() == jr1.errorPos());
+
+        // Tokens split at the end of the document:
+        JSONConverter jr3(enc);
+        CHECK(jr3.feed("[\"tr\\u0"_sl));
+        CHECK(jr3.feed("0e9\", 12"_sl));
+        CHECK(jr3.feed("34, tr"_sl));
+        CHECK(jr3.feed("ue"_sl));
+        CHECK(!jr3.finish());
+        CHECK(jr3.jsonError() == JSONConverter::kErrTruncatedJSON);
+        CHECK(jr3.errorPos() == 23);
+        enc.reset();
+        CHECK(jr3.feed("[\"tr\\u0"_sl));
+        CHECK(jr3.feed("0e9\", 12"_sl));
+        CHECK(jr3.feed("34, tr"_sl));
+        CHECK(jr3.feed("ue]"_sl));
+        CHECK(jr3.finish());
+        endEncoding();
+        CHECK(Value::fromData(result)->toJSON() == "[\"tré\",1234,true]"_sl);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertNDJSON", "[Encoder]") {
+        // Make NDJSON out of the people array:
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice fleece = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(fleece)->asArray();
+        std::string ndjson;
+        for (uint32_t i = 0; i < people->count(); ++i) {
+            ndjson += people->get(i)->toJSON().asString();
+            ndjson += (i % 3) ? "\n" : "\r\n\n";             // with some CRs and blank lines
+        }
+
+        SharedKeys sk;
+        NDJSONConverter converter(&sk, 4);
+        for (int pass = 0; pass < 2; ++pass) {              // (the second pass reuses the pool)
+            std::vector<alloc_slice> docs;
+            REQUIRE(converter.convert(slice(ndjson), docs));
+            REQUIRE(docs.size() == people->count());
+            for (uint32_t i = 0; i < people->count(); ++i) {
+                auto doc = Value::fromData(docs[i]);
+                REQUIRE(doc);
+                REQUIRE(doc->toJSON(&sk, true) == people->get(i)->toJSON(nullptr, true));
+            }
+        }
+        CHECK(sk.count() > 0);
+
+        // The first invalid line is reported, and the documents before it are returned:
+        std::string bad = ndjson;
+        size_t errorPos = bad.find("\"name\":", bad.size() / 2) + 7;
+        bad[errorPos] = '@';
+        bad[bad.find("\"name\":", bad.size() * 3 / 4) + 7] = '@';
+        std::vector<alloc_slice> docs;
+        REQUIRE(!converter.convert(slice(bad), docs));
+        CHECK(converter.jsonError() != 0);
+        CHECK(converter.errorPos() == errorPos);
+        size_t errorLine = 1 + std::count(bad.begin(), bad.begin() + errorPos, '\n');
+        CHECK(converter.errorLine() == errorLine);
+        CHECK(docs.size() == (size_t)std::count(bad.begin(), bad.begin() + errorPos, '\n')
+                             - std::count(bad.begin(), bad.begin() + errorPos, '\r'));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "CopyPeople", "[Encoder]") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice doc = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(doc)->asArray();
+
+        // Copy every other person; they're big enough to be spliced:
+        enc.beginArray();
+        for (uint32_t i = 0; i < people->count(); i += 2)
+            enc.writeValue(people->get(i));
+        enc.endArray();
+        enc.end();
+        result = enc.extractOutput();
+        CHECK(enc.stats().splicedCollections == 500);
+        CHECK(result.size < doc.size * 0.51);     // shared strings aren't duplicated
+
+        auto copy = Value::fromData(result);
+        REQUIRE(copy);
+        REQUIRE(copy->asArray()->count() == 500);
+        for (uint32_t i = 0; i < 500; ++i)
+            REQUIRE(copy->asArray()->get(i)->toJSON() == people->get(2*i)->toJSON());
     }
 
     TEST_CASE_METHOD(EncoderTests, "FindPersonByIndexUnsorted", "[Encoder]") {
@@ -818,6 +2131,59 @@ public:
         REQUIRE(name->asString() == slice("Marva Morse"));
     }
 
+    TEST_CASE_METHOD(EncoderTests, "Relayout", "[Encoder]") {
+        enc.beginDictionary();
+        enc.writeKey("cold");
+        enc.writeString("a cold string value");
+        enc.writeKey("list");
+        enc.beginArray();
+        enc.writeString("zero string");
+        enc.writeString("one string");
+        enc.writeString("two string");
+        enc.endArray();
+        enc.writeKey("hot");
+        enc.beginDictionary();
+        enc.writeKey("x");
+        enc.writeString("the hot string");
+        enc.endDictionary();
+        enc.endDictionary();
+        endEncoding();
+        alloc_slice original = result;
+        auto root = Value::fromData(original);
+
+        enc.relayout(root);
+        endEncoding();
+        REQUIRE(checkDict(3)->toJSON() == root->toJSON());
+
+        Encoder::LayoutPolicy policy;
+        policy.order = Encoder::LayoutPolicy::kHotFirst;
+        policy.hotPaths = {"list[1]", "hot.x"};
+        enc.relayout(root, policy);
+        endEncoding();
+        auto d = checkDict(3);
+        REQUIRE(d->toJSON() == root->toJSON());
+        // Hotter values are written later, i.e. closer to their parent:
+        auto list = d->get("list"_sl)->asArray();
+        REQUIRE(list > (const void*)d->get("hot"_sl));
+        REQUIRE(list->get(1) > list->get(0));
+        REQUIRE(list->get(1) > list->get(2));
+
+        // A big document survives both layouts intact:
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        JSONConverter jr(enc);
+        jr.encodeJSON(input);
+        endEncoding();
+        alloc_slice people = result;
+        root = Value::fromData(people);
+        enc.relayout(root);
+        endEncoding();
+        REQUIRE(Value::fromData(result)->toJSON() == root->toJSON());
+        policy.hotPaths = {"[-1].name", "[0]"};
+        enc.relayout(root, policy);
+        endEncoding();
+        REQUIRE(Value::fromData(result)->toJSON() == root->toJSON());
+    }
+
 #pragma mark - KEY TREE:
 
     TEST_CASE_METHOD(EncoderTests, "KeyTree", "[Encoder]") {
@@ -19,6 +19,7 @@
 #include "FleeceTests.hh"
 #include "Fleece.hh"
 #include "Path.hh"
+#include "JSONEncoder.hh"
 #include <iostream>
 
 using namespace std;
@@ -449,3 +450,127 @@ TEST_CASE("big JSON encoding") {
     std::string nameStr = (std::string)name->asString();
     REQUIRE(nameStr == std::string("Concepcion Burns"));
 }
+
+
+TEST_CASE("re-encoding with different SharedKeys") {
+    SharedKeys sk1;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    alloc_slice encoded = JSONConverter::convertJSON(input, &sk1);
+    auto root = Value::fromTrustedData(encoded);
+
+    // The second mapping assigns different numbers, and has room for only some of the keys:
+    SharedKeys sk2;
+    sk2.setMaxCount(10);
+    int key;
+    REQUIRE(sk2.encodeAndAdd("name"_sl, key));
+    REQUIRE(sk2.encodeAndAdd("age"_sl, key));
+
+    Encoder enc;
+    enc.setSharedKeys(&sk2);
+    enc.writeValue(root, &sk1);
+    enc.end();
+    alloc_slice reencoded = enc.extractOutput();
+    CHECK(sk2.count() == 10);
+
+    auto root2 = Value::fromTrustedData(reencoded);
+    CHECK(root2->toJSON(&sk2, true) == root->toJSON(&sk1, true));
+
+    REQUIRE(sk2.encode("name"_sl, key));
+    CHECK(key == 0);
+    auto person = root2->asArray()->get(123)->asDict();
+    CHECK(person->get(key)->asString() == "Concepcion Burns"_sl);
+}
+
+
+TEST_CASE("shared string values") {
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    alloc_slice encoded = JSONConverter::convertJSON(input);
+    auto person = Value::fromTrustedData(encoded)->asArray()->get(0);
+
+    SharedKeys pool;
+    int index;
+    for (auto str : {"person", "brown", "blue", "green", "male", "female", "laborum", "et"})
+        REQUIRE(pool.encodeAndAdd(slice(str), index));
+
+    Encoder plainEnc;
+    plainEnc.writeValue(person);
+    plainEnc.end();
+    alloc_slice plain = plainEnc.extractOutput();
+
+    Encoder enc;
+    enc.setSharedValues(&pool);
+    enc.writeValue(person);
+    enc.end();
+    alloc_slice pooled = enc.extractOutput();
+    CHECK(pooled.size < plain.size);
+
+    auto dict = Value::fromTrustedData(pooled)->asDict();
+    auto type = dict->get("type"_sl);
+    CHECK(type->type() == kSharedString);
+    CHECK(type->sharedStringIndex() == 0);
+    CHECK(type->asString() == nullslice);
+    CHECK(type->asString(&pool) == "person"_sl);
+    CHECK_THROWS_AS(type->asString(nullptr), FleeceException);
+    CHECK_THROWS_AS(dict->toJSON(), FleeceException);
+    CHECK(dict->get("eyeColor"_sl)->asString(&pool) == "blue"_sl);
+    CHECK(dict->get("name"_sl)->sharedStringIndex() == -1);
+    CHECK(dict->get("name"_sl)->asString(&pool) == "Glenda Morse"_sl);
+
+    JSONEncoder jsonEnc;
+    jsonEnc.setSharedValues(&pool);
+    jsonEnc.writeValue(dict);
+    CHECK(jsonEnc.extractOutput() == person->toJSON());
+
+    // Copying to an encoder with the same pool keeps the references:
+    Encoder samePoolEnc;
+    samePoolEnc.setSharedValues(&pool);
+    samePoolEnc.writeValue(dict);
+    samePoolEnc.end();
+    alloc_slice copied = samePoolEnc.extractOutput();
+    CHECK(Value::fromTrustedData(copied)->asDict()->get("type"_sl)->sharedStringIndex() == 0);
+
+    // Copying elsewhere resolves them, given the pool they came from:
+    Encoder noPoolEnc;
+    CHECK_THROWS_AS(noPoolEnc.writeValue(dict), FleeceException);
+    noPoolEnc.reset();
+    noPoolEnc.setSourceSharedValues(&pool);
+    noPoolEnc.writeValue(dict);
+    noPoolEnc.end();
+    alloc_slice resolved = noPoolEnc.extractOutput();
+    CHECK(Value::fromTrustedData(resolved)->toJSON() == person->toJSON());
+
+    SharedKeys otherPool;
+    REQUIRE(otherPool.encodeAndAdd("blue"_sl, index));
+    Encoder otherPoolEnc;
+    otherPoolEnc.setSharedValues(&otherPool);
+    otherPoolEnc.setSourceSharedValues(&pool);
+    otherPoolEnc.writeValue(dict);
+    otherPoolEnc.end();
+    alloc_slice repooled = otherPoolEnc.extractOutput();
+    auto repooledDict = Value::fromTrustedData(repooled)->asDict();
+    CHECK(repooledDict->get("type"_sl)->type() == kString);
+    CHECK(repooledDict->get("eyeColor"_sl)->sharedStringIndex() == 0);
+    JSONEncoder otherJSONEnc;
+    otherJSONEnc.setSharedValues(&otherPool);
+    otherJSONEnc.writeValue(repooledDict);
+    CHECK(otherJSONEnc.extractOutput() == person->toJSON());
+
+    // Keys are never pooled, even ones written from Values that are in the pool:
+    SharedKeys keyPool;
+    REQUIRE(keyPool.encodeAndAdd("gender"_sl, index));
+    Encoder keyPoolEnc;
+    keyPoolEnc.setSharedValues(&keyPool);
+    keyPoolEnc.beginDictionary();
+    for (Dict::iterator i(person->asDict()); i; ++i) {
+        keyPoolEnc.writeKey(i.key());
+        keyPoolEnc.writeValue(i.value());
+    }
+    keyPoolEnc.endDictionary();
+    keyPoolEnc.end();
+    alloc_slice keysKept = keyPoolEnc.extractOutput();
+    auto keysKeptDict = Value::fromTrustedData(keysKept)->asDict();
+    for (Dict::iterator i(keysKeptDict); i; ++i)
+        CHECK(i.key()->type() == kString);
+    CHECK(keysKeptDict->get("gender"_sl) != nullptr);
+    CHECK(keysKeptDict->toJSON() == person->toJSON());
+}